@@ -0,0 +1,103 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// A minimal blocking HTTP/1.1 client over raw sockets for the benchmarks, so that what is measured is the
+// server and not the client library. `Fetch()` sends each request over a fresh connection to the local port,
+// and reads the response until the server closes it. The requests over persistent connections go through
+// `demo::HTTPClientPool` instead.
+
+#ifndef DEMO_BENCH_HTTP_CLIENT_H
+#define DEMO_BENCH_HTTP_CLIENT_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../http_client_pool.h"
+
+namespace bench {
+
+struct FetchResult {
+  int code = 0;  // Zero if the request has failed.
+  size_t bytes = 0;  // The size of the whole response, headers included.
+  double first_byte_ms = 0;  // From the start of the request.
+};
+
+// The request to the local port, with the extra `headers` (each ending with "\r\n") and the body, if any.
+inline std::string MakeRequest(const std::string& method,
+                               const std::string& path,
+                               const std::string& headers = "",
+                               const std::string& body = "") {
+  return demo::MakeHTTPRequest(method, path, "localhost", headers, body);
+}
+
+// Sends the request and reads the response until the server closes the connection.
+// Calls `on_data(const char* data, size_t size)` on each piece of the response, which may return `false`
+// to stop reading early.
+template <typename F>
+FetchResult Fetch(int port, const std::string& request, F&& on_data) {
+  FetchResult result;
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return result;
+  }
+  sockaddr_in address = sockaddr_in();
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const auto begin = std::chrono::steady_clock::now();
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+      write(fd, request.data(), request.length()) == static_cast<ssize_t>(request.length())) {
+    char buffer[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+      if (!result.bytes) {
+        result.first_byte_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        // The status line is "HTTP/1.1 200 OK", and the first read is always longer than its first two words.
+        result.code = (n > 12) ? atoi(buffer + 9) : -1;
+      }
+      result.bytes += n;
+      if (!on_data(static_cast<const char*>(buffer), static_cast<size_t>(n))) {
+        break;
+      }
+    }
+  }
+  close(fd);
+  return result;
+}
+
+inline FetchResult Fetch(int port, const std::string& request) {
+  return Fetch(port, request, [](const char*, size_t) { return true; });
+}
+
+}  // namespace bench
+
+#endif  // DEMO_BENCH_HTTP_CLIENT_H
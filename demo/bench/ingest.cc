@@ -0,0 +1,79 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Measures the throughput of concurrent `PointStore` ingest as the number of writer threads grows,
+// compared to the baseline of one `std::vector<Point>` behind a single global mutex.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+
+#include "../point_store.h"
+
+DEFINE_int32(max_threads, 0, "The maximum number of writer threads, defaults to the number of cores.");
+DEFINE_int32(points_per_thread, 2000000, "The number of points each writer thread adds.");
+
+using demo::Point;
+using demo::PointStore;
+
+template <typename F>
+double PointsPerSecond(size_t threads, F&& add) {
+  std::vector<std::thread> workers;
+  const auto begin = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&add, t]() {
+      for (int i = 0; i < FLAGS_points_per_thread; ++i) {
+        add(Point(t, i, i & 1));
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  return threads * FLAGS_points_per_thread / seconds;
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  const size_t max_threads =
+      FLAGS_max_threads > 0 ? FLAGS_max_threads : std::max(1u, std::thread::hardware_concurrency());
+  printf("threads\tpoint_store_points_per_s\tglobal_mutex_points_per_s\n");
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    PointStore store;
+    const double sharded = PointsPerSecond(threads, [&store](const Point& p) { store.Add(p); });
+    std::mutex mutex;
+    std::vector<Point> points;
+    const double baseline = PointsPerSecond(threads, [&mutex, &points](const Point& p) {
+      std::lock_guard<std::mutex> lock(mutex);
+      points.push_back(p);
+    });
+    printf("%d\t%.0f\t%.0f\n", static_cast<int>(threads), sharded, baseline);
+  }
+}
@@ -0,0 +1,290 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// A load generator for the endpoints of `DemoServer`, which it runs in-process on its own port.
+//
+// Each scenario keeps `--connections` concurrent clients busy for `--seconds`, and prints one JSON line
+// with the requests per second and the latency quantiles, so that the runs can be compared by a script:
+//
+//   {"scenario":"get_ok","requests":51234,"errors":0,"rps":25617.0,"p50_ms":0.295,"p99_ms":0.655,...}
+//
+// The `*_keep_alive` scenarios send the same requests to `--demo_keep_alive_port` instead, each client over
+// one connection, and the `*_pipelined` ones send `--pipeline_depth` requests at a time before reading
+// the responses, each of which gets the latency of the whole batch.
+// The streaming scenario opens `--streams` concurrent `/layout/data` responses, and reports the time to
+// the first byte of the response as the latency, and the rate of the data received as `stream_bytes_per_s`.
+// The live points scenario posts one point at a time while a `/layout/data?source=points` stream watches for
+// them, and reports the time from posting a point to receiving it on the stream as the latency.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/strings/printf.h"
+
+#include "../demo.h"
+#include "../metrics.h"
+
+#include "http_client.h"
+
+DEFINE_int32(demo_port, 2017, "The local port to run the demo server under load on.");
+DEFINE_string(demo_log_dir, "", "The directory for the durable log of points, empty for in-memory only.");
+DEFINE_string(demo_data_dir, "", "The directory for the named datasets, empty to keep them in memory only.");
+DEFINE_int32(demo_dataset_max_points, 1000000, "The quota of points per named dataset.");
+DEFINE_int32(demo_max_resident_datasets, 16, "The number of named datasets to keep in memory.");
+DEFINE_string(demo_peers, "", "The comma-separated `host:port`-s of the nodes to shard the datasets across.");
+DEFINE_string(demo_host, "localhost", "The host of this node, as listed in `--demo_peers`.");
+DEFINE_int32(demo_threads, 8, "The number of threads to handle the requests on.");
+DEFINE_int32(demo_max_queued_requests, 1024, "The number of requests to queue before responding with a 503.");
+DEFINE_bool(demo_fast_start, false, "Load the static files on their first request instead of at startup.");
+DEFINE_bool(demo_warm_static_files, true, "With `--demo_fast_start`, load the static files in the background.");
+DEFINE_int32(demo_keep_alive_port, 2022, "The port to serve the small requests on with keep-alive.");
+DEFINE_int32(demo_stream_writers, 4, "The number of threads to write the `/layout/data` streams on.");
+DEFINE_int32(demo_stream_send_timeout_ms, 5000, "End the streams a write to which takes longer, 0 to never.");
+DEFINE_string(demo_dir, "..", "The directory with the `static/` files of the demo.");
+DEFINE_int32(connections, 8, "The number of concurrent clients.");
+DEFINE_double(seconds, 2, "The duration of each scenario.");
+DEFINE_int32(streams, 32, "The number of concurrent `/layout/data` streams.");
+DEFINE_int32(stream_seconds, 3, "The duration of each `/layout/data` stream.");
+DEFINE_int32(ndjson_batch, 100, "The number of points in each bulk upload.");
+DEFINE_int32(pipeline_depth, 16, "The number of requests the `*_pipelined` clients send at once.");
+
+using bricks::strings::Printf;
+
+struct Totals {
+  std::atomic<uint64_t> bytes{0};
+  demo::RouteMetrics latencies;
+};
+
+void Report(const std::string& scenario, const Totals& totals, double seconds, const std::string& extra = "") {
+  const demo::RouteStats stats = totals.latencies.Stats();
+  const uint64_t ok = stats.requests - stats.errors;
+  printf("{\"scenario\":\"%s\",\"requests\":%llu,\"errors\":%llu,\"rps\":%.1f,"
+         "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"bytes_per_response\":%.0f%s}\n",
+         scenario.c_str(),
+         static_cast<unsigned long long>(stats.requests),
+         static_cast<unsigned long long>(stats.errors),
+         stats.requests / seconds,
+         stats.LatencyQuantile(0.5) * 1e-6,
+         stats.LatencyQuantile(0.99) * 1e-6,
+         stats.LatencyQuantile(0.999) * 1e-6,
+         ok ? static_cast<double>(totals.bytes) / ok : 0.0,
+         extra.c_str());
+  fflush(stdout);
+}
+
+// Runs `--connections` clients for `--seconds`, each sending the requests made by `make_request(i)`.
+void Run(const std::string& scenario, std::function<std::string(uint64_t)> make_request) {
+  Totals totals;
+  std::atomic<uint64_t> next(0);
+  std::vector<std::thread> clients;
+  const auto begin = std::chrono::steady_clock::now();
+  const auto end = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>(FLAGS_seconds));
+  for (int c = 0; c < FLAGS_connections; ++c) {
+    clients.emplace_back([&]() {
+      while (std::chrono::steady_clock::now() < end) {
+        const std::string request = make_request(next++);
+        const auto request_begin = std::chrono::steady_clock::now();
+        const bench::FetchResult result = bench::Fetch(FLAGS_demo_port, request);
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - request_begin).count();
+        const bool error = (result.code != 200);
+        totals.latencies.Record(ns, 0, result.code);
+        if (!error) {
+          totals.bytes += result.bytes;
+        }
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  Report(scenario, totals, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+}
+
+// Same as `Run()`, but over a persistent connection per client, which sends `depth` requests at a time.
+void RunKeepAlive(const std::string& scenario, std::function<std::string(uint64_t)> make_request, int depth) {
+  Totals totals;
+  std::atomic<uint64_t> next(0);
+  std::vector<std::thread> clients;
+  const auto begin = std::chrono::steady_clock::now();
+  const auto end = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>(FLAGS_seconds));
+  for (int c = 0; c < FLAGS_connections; ++c) {
+    clients.emplace_back([&]() {
+      demo::HTTPClientPool pool(1);
+      const std::string authority = Printf("localhost:%d", FLAGS_demo_keep_alive_port);
+      std::string requests;
+      while (std::chrono::steady_clock::now() < end) {
+        requests.clear();
+        for (int i = 0; i < depth; ++i) {
+          requests += make_request(next++);
+        }
+        std::vector<demo::PooledHTTPResponse> responses;
+        const auto batch_begin = std::chrono::steady_clock::now();
+        try {
+          responses = pool.Pipeline(authority, requests, depth);
+        } catch (const std::exception&) {
+        }
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - batch_begin).count();
+        for (int i = 0; i < depth; ++i) {
+          const int code = (static_cast<size_t>(i) < responses.size()) ? responses[i].code : 0;
+          const bool error = (code != 200);
+          totals.latencies.Record(ns, 0, code);
+          if (!error) {
+            // The bodies only, the pool does not keep the headers.
+            totals.bytes += responses[i].body.length();
+          }
+        }
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  Report(scenario, totals, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+}
+
+void RunStreams() {
+  Totals totals;
+  std::vector<std::thread> clients;
+  const auto begin = std::chrono::steady_clock::now();
+  const std::string request = bench::MakeRequest("GET", Printf("/layout/data?t=%d", FLAGS_stream_seconds));
+  for (int s = 0; s < FLAGS_streams; ++s) {
+    clients.emplace_back([&]() {
+      const bench::FetchResult result = bench::Fetch(FLAGS_demo_port, request);
+      const bool error = (result.code != 200);
+      totals.latencies.Record(static_cast<uint64_t>(result.first_byte_ms * 1e6), 0, result.code);
+      if (!error) {
+        totals.bytes += result.bytes;
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  const std::string rate = Printf(",\"stream_bytes_per_s\":%.0f", totals.bytes / seconds);
+  Report("layout_data_streams", totals, seconds, rate);
+}
+
+void RunLivePoints() {
+  Totals totals;
+  std::atomic<uint64_t> received(0);
+  std::atomic_bool done(false);
+  // Only the points with `x >= 2` are streamed, so the points of the other scenarios do not get in the way.
+  std::thread viewer([&]() {
+    bench::Fetch(FLAGS_demo_port,
+                 bench::MakeRequest("GET", "/layout/data?source=points&x0=2"),
+                 [&](const char* data, size_t size) {
+                   received += std::count(data, data + size, '\n');
+                   return !done;
+                 });
+  });
+  int x = 2;
+  const auto post = [&x]() {
+    bench::Fetch(FLAGS_demo_port, bench::MakeRequest("POST", Printf("/demo_id?x=%d&y=0&label=1", x++)));
+  };
+  // Keeps posting until the stream is subscribed and gets the points, then lets the last ones arrive.
+  while (!received) {
+    post();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  const auto begin = std::chrono::steady_clock::now();
+  const auto end = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>(FLAGS_seconds));
+  while (std::chrono::steady_clock::now() < end) {
+    const uint64_t expected = received + 1;
+    const auto post_begin = std::chrono::steady_clock::now();
+    post();
+    while (received < expected) {
+      std::this_thread::yield();
+    }
+    totals.latencies.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - post_begin).count(),
+                            0,
+                            200);
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  // One more point for the viewer to notice it is done.
+  done = true;
+  post();
+  viewer.join();
+  Report("live_points", totals, seconds);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  if (chdir(FLAGS_demo_dir.c_str())) {
+    fprintf(stderr, "Can not change into `%s`.\n", FLAGS_demo_dir.c_str());
+    return -1;
+  }
+  demo::DemoServer server;
+
+  const auto get_ok = [](uint64_t) { return bench::MakeRequest("GET", "/ok"); };
+  const auto post_point = [](uint64_t i) {
+    const double x = (i % 1000) * 2e-3 - 1;
+    const double y = (i % 997) * 2e-3 - 1;
+    return bench::MakeRequest("POST", Printf("/demo_id?x=%lf&y=%lf&label=%d", x, y, static_cast<int>(i & 1)));
+  };
+  Run("get_ok", get_ok);
+  RunKeepAlive("get_ok_keep_alive", get_ok, 1);
+  RunKeepAlive("get_ok_pipelined", get_ok, FLAGS_pipeline_depth);
+  Run("get_static", [](uint64_t) { return bench::MakeRequest("GET", "/static/hello.txt"); });
+  Run("get_static_not_modified", [](uint64_t) {
+    static const std::string etag = "If-None-Match: " + demo::StaticFile("", "Hello, World!\n").etag + "\r\n";
+    return bench::MakeRequest("GET", "/static/hello.txt", etag);
+  });
+  Run("post_point", post_point);
+  RunKeepAlive("post_point_keep_alive", post_point, 1);
+  RunKeepAlive("post_point_pipelined", post_point, FLAGS_pipeline_depth);
+  Run("post_ndjson_batch", [](uint64_t i) {
+    std::string body;
+    for (int p = 0; p < FLAGS_ndjson_batch; ++p) {
+      const uint64_t j = i * FLAGS_ndjson_batch + p;
+      body += Printf("{\"x\":%lf,\"y\":%lf,\"label\":%s}\n",
+                     (j % 1000) * 2e-3 - 1,
+                     (j % 997) * 2e-3 - 1,
+                     (j & 1) ? "true" : "false");
+    }
+    return bench::MakeRequest("POST", "/demo_id?format=ndjson", "Content-Type: application/x-ndjson\r\n", body);
+  });
+  Run("get_demo_id_json", [](uint64_t) { return bench::MakeRequest("GET", "/demo_id"); });
+  Run("get_demo_id_svg", [](uint64_t) { return bench::MakeRequest("GET", "/demo_id?format=svg"); });
+  RunStreams();
+  RunLivePoints();
+}
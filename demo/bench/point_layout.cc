@@ -0,0 +1,152 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Compares the memory per point and the speed of filtered scans of the columnar `PointStore` against
+// the array-of-structs layout it used to have, a contiguous array of the padded 24-byte `Point`-s.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+
+#include "../point_store.h"
+
+DEFINE_int32(points, 10000000, "The number of points to scan.");
+DEFINE_int32(repeat, 5, "The number of times each scan is run, the best time is reported.");
+
+using demo::Point;
+using demo::PointStore;
+
+template <typename F>
+double BestMilliseconds(F&& f) {
+  double best = 1e100;
+  for (int i = 0; i < FLAGS_repeat; ++i) {
+    const auto begin = std::chrono::steady_clock::now();
+    f();
+    const auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::milli>(end - begin).count());
+  }
+  return best;
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  std::vector<Point> aos;
+  aos.reserve(FLAGS_points);
+  PointStore store(1);
+  for (int i = 0; i < FLAGS_points; ++i) {
+    const Point point(((i * 7919) % 2001) * 1e-3 - 1, ((i * 104729) % 2003) * 1e-3 - 1, (i * 31) % 5 < 2);
+    aos.push_back(point);
+    store.Add(point);
+  }
+  const PointStore::Snapshot snapshot = store.GetSnapshot();
+  volatile double sink = 0;
+
+  printf("layout\tbytes_per_point\tlabeled_with_x_above_0_ms\tsum_y_of_labeled_ms\tall_points_ms\n");
+
+  const double aos_count = BestMilliseconds([&]() {
+    size_t count = 0;
+    for (const Point& p : aos) {
+      count += (p.label & (p.x > 0));
+    }
+    sink = count;
+  });
+  const double aos_sum = BestMilliseconds([&]() {
+    double sum = 0;
+    for (const Point& p : aos) {
+      if (p.label) {
+        sum += p.y;
+      }
+    }
+    sink = sum;
+  });
+  const double aos_all = BestMilliseconds([&]() {
+    double sum = 0;
+    for (const Point& p : aos) {
+      sum += p.x + p.y;
+    }
+    sink = sum;
+  });
+  printf("array_of_structs\t%.2f\t%.1f\t%.1f\t%.1f\n",
+         static_cast<double>(sizeof(Point)),
+         aos_count,
+         aos_sum,
+         aos_all);
+
+  const double soa_count = BestMilliseconds([&]() {
+    size_t count = 0;
+    snapshot.ForEachBlock([&count](const PointStore::Snapshot::Block& block) {
+      // Compares 64 `x`-s at a time into a bit mask, and intersects it with the word of the label bitmap.
+      size_t result = 0;
+      for (size_t base = block.begin / 64 * 64; base < block.end; base += 64) {
+        const size_t begin = std::max(base, block.begin);
+        const size_t end = std::min(base + 64, block.end);
+        uint64_t mask = 0;
+        for (size_t i = begin; i < end; ++i) {
+          mask |= static_cast<uint64_t>(block.x[i] > 0) << (i - base);
+        }
+        result += __builtin_popcountll(mask & block.labels[base / 64].load(std::memory_order_relaxed));
+      }
+      count += result;
+    });
+    sink = count;
+  });
+  const double soa_sum = BestMilliseconds([&]() {
+    double sum = 0;
+    snapshot.ForEachBlock([&sum](const PointStore::Snapshot::Block& block) {
+      // Walks the set bits of the label bitmap, so only the `y`-s of the labeled points are touched.
+      double result = 0;
+      for (size_t w = block.begin / 64; w * 64 < block.end; ++w) {
+        uint64_t bits = block.labels[w].load(std::memory_order_relaxed);
+        while (bits) {
+          const size_t i = w * 64 + __builtin_ctzll(bits);
+          bits &= bits - 1;
+          if (i >= block.begin && i < block.end) {
+            result += block.y[i];
+          }
+        }
+      }
+      sum += result;
+    });
+    sink = sum;
+  });
+  const double soa_all = BestMilliseconds([&]() {
+    double sum = 0;
+    snapshot.ForEachBlock([&sum](const PointStore::Snapshot::Block& block) {
+      double result = 0;
+      for (size_t i = block.begin; i < block.end; ++i) {
+        result += block.x[i] + block.y[i];
+      }
+      sum += result;
+    });
+    sink = sum;
+  });
+  printf("columnar\t%.2f\t%.1f\t%.1f\t%.1f\n",
+         static_cast<double>(store.BytesAllocated()) / FLAGS_points,
+         soa_count,
+         soa_sum,
+         soa_all);
+}
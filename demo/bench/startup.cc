@@ -0,0 +1,167 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Measures how long `DemoServer` takes to start serving, and the memory it takes, with `./static/` of
+// a growing number of generated frontend files, loaded at startup as by default, and with `--demo_fast_start`,
+// both without and with the background warming of the files.
+//
+// Each run is a fresh child process, which prints one JSON line, with the time to construct the server,
+// the time until it has also answered `/ok`, the time to then serve the first static file, and the growth
+// of the resident memory by then:
+//
+//   {"mode":"fast","assets":1000,"startup_ms":3.1,"first_ok_ms":3.4,"first_asset_ms":6.2,"rss_growth_mb":1.2}
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/strings/printf.h"
+
+#include "../demo.h"
+
+#include "http_client.h"
+
+DEFINE_int32(demo_port, 2021, "The local port to start the demo server on.");
+DEFINE_string(demo_log_dir, "", "The directory for the durable log of points, empty for in-memory only.");
+DEFINE_string(demo_data_dir, "", "The directory for the named datasets, empty to keep them in memory only.");
+DEFINE_int32(demo_dataset_max_points, 1000000, "The quota of points per named dataset.");
+DEFINE_int32(demo_max_resident_datasets, 16, "The number of named datasets to keep in memory.");
+DEFINE_string(demo_peers, "", "The comma-separated `host:port`-s of the nodes to shard the datasets across.");
+DEFINE_string(demo_host, "localhost", "The host of this node, as listed in `--demo_peers`.");
+DEFINE_int32(demo_threads, 8, "The number of threads to handle the requests on.");
+DEFINE_int32(demo_max_queued_requests, 1024, "The number of requests to queue before responding with a 503.");
+DEFINE_bool(demo_fast_start, false, "Load the static files on their first request instead of at startup.");
+DEFINE_bool(demo_warm_static_files, true, "With `--demo_fast_start`, load the static files in the background.");
+DEFINE_int32(demo_keep_alive_port, 0, "The port to serve the small requests on with keep-alive, 0 for none.");
+DEFINE_int32(demo_stream_writers, 4, "The number of threads to write the `/layout/data` streams on.");
+DEFINE_int32(demo_stream_send_timeout_ms, 5000, "End the streams a write to which takes longer, 0 to never.");
+DEFINE_string(assets, "10,100,1000", "The comma-separated numbers of the static files to start with.");
+DEFINE_int32(asset_bytes, 64 << 10, "The size of each static file.");
+
+using bricks::strings::Printf;
+
+// Writes `count` files of `--asset_bytes` of varied JavaScript, so that they take some work to compress,
+// into `<dir>/static/`, unless they are there already.
+void GenerateAssets(const std::string& dir, int count) {
+  ::mkdir(".noshit", 0755);
+  ::mkdir(dir.c_str(), 0755);
+  ::mkdir((dir + "/static").c_str(), 0755);
+  uint64_t state = 42;
+  for (int i = 0; i < count; ++i) {
+    const std::string path = Printf("%s/static/chunk%d.js", dir.c_str(), i);
+    if (std::ifstream(path).good()) {
+      continue;
+    }
+    std::string content;
+    while (content.length() < static_cast<size_t>(FLAGS_asset_bytes)) {
+      state = state * 6364136223846793005ull + 1442695040888963407ull;
+      content += Printf("var v%d=%llu;\n", static_cast<int>(content.length()), state >> 40);
+    }
+    content.resize(FLAGS_asset_bytes);
+    std::ofstream(path) << content;
+  }
+}
+
+double ResidentMegabytes() {
+  size_t pages = 0;
+  size_t resident = 0;
+  if (FILE* f = fopen("/proc/self/statm", "r")) {
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return static_cast<double>(resident) * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+double MillisecondsSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+void Run(const char* mode, const std::string& dir, int assets) {
+  if (chdir(dir.c_str())) {
+    fprintf(stderr, "Can not change into `%s`.\n", dir.c_str());
+    return;
+  }
+  const double rss = ResidentMegabytes();
+  const auto begin = std::chrono::steady_clock::now();
+  demo::DemoServer server(FLAGS_demo_port);
+  const double startup_ms = MillisecondsSince(begin);
+  while (bench::Fetch(FLAGS_demo_port, bench::MakeRequest("GET", "/ok")).code != 200) {
+  }
+  const double first_ok_ms = MillisecondsSince(begin);
+  const std::string request = bench::MakeRequest("GET", "/static/chunk0.js", "Accept-Encoding: gzip\r\n");
+  const int code = bench::Fetch(FLAGS_demo_port, request).code;
+  const double first_asset_ms = MillisecondsSince(begin);
+  printf("{\"mode\":\"%s\",\"assets\":%d,\"startup_ms\":%.1f,\"first_ok_ms\":%.1f,\"first_asset_ms\":%.1f%s,"
+         "\"rss_growth_mb\":%.1f}\n",
+         mode,
+         assets,
+         startup_ms,
+         first_ok_ms,
+         first_asset_ms,
+         (code == 200) ? "" : ",\"error\":true",
+         ResidentMegabytes() - rss);
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  std::vector<int> counts;
+  for (const char* p = FLAGS_assets.c_str(); *p;) {
+    counts.push_back(atoi(p));
+    while (*p && *p != ',') {
+      ++p;
+    }
+    p += (*p == ',');
+  }
+  for (int assets : counts) {
+    const std::string dir = Printf(".noshit/startup_%d", assets);
+    GenerateAssets(dir, assets);
+    const struct {
+      const char* mode;
+      bool fast_start;
+      bool warm;
+    } modes[] = {{"eager", false, false}, {"fast", true, false}, {"fast_warm", true, true}};
+    for (const auto& mode : modes) {
+      // A fresh process per run, so that the memory and the routes of one run do not affect the next.
+      const pid_t pid = fork();
+      if (pid == 0) {
+        FLAGS_demo_fast_start = mode.fast_start;
+        FLAGS_demo_warm_static_files = mode.warm;
+        Run(mode.mode, dir, assets);
+        _exit(0);
+      }
+      waitpid(pid, nullptr, 0);
+    }
+  }
+}
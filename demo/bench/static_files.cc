@@ -0,0 +1,113 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Measures the requests per second of serving a frontend bundle the way `DemoServer` used to,
+// reading the whole uncompressed body on every hit, against the `StaticFileCache` with a browser
+// that accepts gzip, and with a browser that revalidates its cached copy via `If-None-Match`.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+#include "../../Bricks/file/file.h"
+
+#include "../static_files.h"
+
+#include "http_client.h"
+
+DEFINE_int32(port, 2016, "The local port to run the benchmark server on.");
+DEFINE_string(file, "", "The file to serve, defaults to a generated 256KB script.");
+DEFINE_int32(threads, 8, "The number of concurrent clients.");
+DEFINE_int32(requests, 2000, "The number of requests per scenario.");
+
+using bricks::FileSystem;
+using bricks::net::HTTPResponseCode;
+using bricks::net::api::HTTP;
+using bricks::net::api::Request;
+using demo::StaticFile;
+
+void Run(const char* scenario, const std::string& path, const std::string& headers) {
+  std::atomic_int next(0);
+  std::atomic_size_t bytes(0);
+  std::atomic_int failed(0);
+  std::vector<std::thread> clients;
+  const auto begin = std::chrono::steady_clock::now();
+  for (int t = 0; t < FLAGS_threads; ++t) {
+    clients.emplace_back([&]() {
+      while (next++ < FLAGS_requests) {
+        const bench::FetchResult result = bench::Fetch(FLAGS_port, bench::MakeRequest("GET", path, headers));
+        if (result.code == 200 || result.code == 304) {
+          bytes += result.bytes;
+        } else {
+          ++failed;
+        }
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  printf("%s\t%.0f\t%.0f\t%d\n",
+         scenario,
+         FLAGS_requests / seconds,
+         static_cast<double>(bytes) / FLAGS_requests,
+         static_cast<int>(failed));
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  std::string content;
+  if (!FLAGS_file.empty()) {
+    content = FileSystem::ReadFileAsString(FLAGS_file);
+  } else {
+    while (content.length() < (1u << 18)) {
+      content += "function f" + std::to_string(content.length()) + "(x) { return x * x + " +
+                 std::to_string(content.length() % 997) + "; }\n";
+    }
+  }
+  const std::string content_type = "application/javascript";
+
+  // The way `DemoServer` used to serve the static files, with the body read on startup and leaked.
+  const std::string* before = new std::string(content);
+  HTTP(FLAGS_port).Register("/before", [before, &content_type](Request r) {
+    r.connection.SendHTTPResponse(*before, HTTPResponseCode::OK, content_type);
+  });
+  const StaticFile after(content_type, content);
+  HTTP(FLAGS_port).Register("/after", [&after](Request r) { after.Serve(std::move(r)); });
+
+  printf("scenario\trequests_per_s\tbytes_per_response\tfailed\n");
+  Run("before", "/before", "");
+  Run("after_identity", "/after", "");
+  Run("after_gzip", "/after", "Accept-Encoding: gzip, deflate\r\n");
+  Run("after_not_modified", "/after", "Accept-Encoding: gzip\r\nIf-None-Match: " + after.ETag("gzip") + "\r\n");
+
+  HTTP(FLAGS_port).UnRegister("/before");
+  HTTP(FLAGS_port).UnRegister("/after");
+  delete before;
+}
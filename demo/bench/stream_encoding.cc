@@ -0,0 +1,116 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Compares the bytes per point of the `/layout/data` stream as JSON against `?encoding=gorilla`,
+// and the time to encode and to decode each point, on the series the way `DemoServer` produces it,
+// a point every 100 to 200 milliseconds of a slow sine, on the same series at a steady pace, and on
+// the series of random values, which is about the worst case for the XOR of the values.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../../Bricks/dflags/dflags.h"
+
+#include "../gorilla.h"
+#include "../number_format.h"
+
+DEFINE_int32(points, 1000000, "The number of points in each series.");
+DEFINE_int32(repeat, 5, "The number of times each series is encoded and decoded, the best time is reported.");
+
+using demo::FormatDouble;
+using demo::GorillaDecoder;
+using demo::GorillaEncoder;
+
+typedef std::vector<std::pair<int64_t, double>> Series;
+
+template <typename F>
+double BestNanosecondsPerPoint(F&& f) {
+  double best = 1e100;
+  for (int i = 0; i < FLAGS_repeat; ++i) {
+    const auto begin = std::chrono::steady_clock::now();
+    f();
+    const auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - begin).count());
+  }
+  return best / FLAGS_points;
+}
+
+void Run(const char* series_name, const Series& series) {
+  size_t json_bytes = 0;
+  for (const auto& point : series) {
+    char x[demo::kMaxFormattedNumberLength];
+    char y[demo::kMaxFormattedNumberLength];
+    json_bytes += FormatDouble(static_cast<double>(point.first), x) + FormatDouble(point.second, y) + 13;
+  }
+  std::string stream;
+  const double encode_ns = BestNanosecondsPerPoint([&series, &stream]() {
+    GorillaEncoder encoder;
+    stream.clear();
+    char record[GorillaEncoder::kMaxRecordLength];
+    for (const auto& point : series) {
+      stream.append(record, encoder.Add(point.first, point.second, record));
+    }
+  });
+  size_t decoded = 0;
+  const double decode_ns = BestNanosecondsPerPoint([&stream, &decoded]() {
+    GorillaDecoder decoder;
+    decoded = 0;
+    decoder.Feed(stream.data(), stream.length(), [&decoded](int64_t, double) { ++decoded; });
+  });
+  if (decoded != series.size()) {
+    fprintf(stderr, "Decoded %d points of %d.\n", static_cast<int>(decoded), static_cast<int>(series.size()));
+  }
+  printf("%s\t%.1f\t%.1f\t%.1fx\t%.1f\t%.1f\n",
+         series_name,
+         static_cast<double>(json_bytes) / series.size(),
+         static_cast<double>(stream.length()) / series.size(),
+         static_cast<double>(json_bytes) / stream.length(),
+         encode_ns,
+         decode_ns);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  std::mt19937_64 random(42);
+  const int64_t begin = 1444000000000ll;
+  Series demo_series;
+  Series steady_series;
+  Series random_series;
+  int64_t x = begin;
+  for (int i = 0; i < FLAGS_points; ++i) {
+    x += 100 + random() % 100;
+    demo_series.emplace_back(x, sin(5e-3 * (x - begin)));
+    steady_series.emplace_back(begin + 100ll * i, sin(5e-1 * i));
+    random_series.emplace_back(x, std::uniform_real_distribution<double>(-1, 1)(random));
+  }
+  printf("series\tjson_bytes_per_point\tgorilla_bytes_per_point\treduction\tencode_ns\tdecode_ns\n");
+  Run("demo", demo_series);
+  Run("steady", steady_series);
+  Run("random", random_series);
+}
@@ -0,0 +1,448 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `Broadcaster`, which fans out the data produced once to all the streaming subscribers.
+//
+// Each subscriber listens to one channel, and only receives the data published into that channel.
+// The producer calls `Publish()`, which appends the data to a bounded per-subscriber `ChunkChain`.
+// A small fixed pool of writer threads picks up the subscribers that have pending data and flushes
+// their buffers, so the number of threads does not grow with the number of subscribers.
+// A slow client only holds one writer at a time; while it is being written to, its buffer keeps
+// accumulating up to `max_pending_bytes`, and the data that does not fit is dropped for that client only.
+// A client that stops reading altogether would hold its writer for good, so with a non-zero
+// `send_timeout_ms` a watchdog ends the subscriptions the `Send()` to which takes longer than that, asks
+// their sinks to `Abort()`, and starts a new writer in place of each one stuck, which exits once its
+// `Send()` returns.
+//
+// With a non-zero `flush_delay_ms`, the pending data of a subscriber waits up to that long before being
+// flushed, so that small pieces of data published in a quick succession go out as one write.
+// The buffers come from a shared `ChunkPool`, and the queue of ready subscribers is intrusive,
+// so in the steady state neither publishing nor flushing allocates memory.
+//
+// The subscribers of `kNoChannel` get no published data, only what is sent to them via `PublishTo()`,
+// for the streams the data of which differs from one subscriber to another.
+
+#ifndef DEMO_BROADCASTER_H
+#define DEMO_BROADCASTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chunk_pool.h"
+
+namespace demo {
+
+// The destination of one subscription. `Send()` may throw if the client has gone away.
+// The sink is destroyed from a writer thread once the subscription is over, which closes the stream.
+struct BroadcastSink {
+  virtual ~BroadcastSink() = default;
+  // Sends the data gathered from `count` buffers in one go, the way `writev()` does.
+  virtual void Send(const ConstBuffer* buffers, size_t count) = 0;
+  // Called from another thread while `Send()` has been stuck for too long. Should make it return or throw
+  // soon, if the sink has a way to.
+  virtual void Abort() {}
+};
+
+class Broadcaster final {
+ private:
+  struct Subscription;
+
+ public:
+  // Refers to one subscription, to `PublishTo()` or to `Close()` it.
+  typedef std::shared_ptr<Subscription> Handle;
+
+  enum : size_t { kNoChannel = static_cast<size_t>(-1) };
+
+  enum class PublishResult { Queued, Dropped, Over };
+
+  explicit Broadcaster(size_t writer_threads = 4,
+                       size_t max_pending_bytes = 1 << 14,
+                       double flush_delay_ms = 0,
+                       double send_timeout_ms = 0)
+      : max_pending_bytes_(max_pending_bytes),
+        flush_delay_(std::chrono::microseconds(static_cast<int64_t>(flush_delay_ms * 1e3))),
+        send_timeout_(std::chrono::microseconds(static_cast<int64_t>(send_timeout_ms * 1e3))) {
+    std::lock_guard<std::mutex> lock(writers_mutex_);
+    for (size_t i = 0; i < std::max(writer_threads, static_cast<size_t>(1)); ++i) {
+      StartWriter();
+    }
+    if (send_timeout_.count() > 0) {
+      watchdog_ = std::thread(&Broadcaster::WatchdogThread, this);
+    }
+  }
+
+  ~Broadcaster() {
+    {
+      std::lock_guard<std::mutex> lock(ready_mutex_);
+      stop_ = true;
+    }
+    ready_cv_.notify_all();
+    if (watchdog_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(writers_mutex_);
+        stop_watchdog_ = true;
+      }
+      watchdog_cv_.notify_all();
+      watchdog_.join();
+    }
+    // No more writers are started once the watchdog is gone.
+    for (auto& thread : writers_) {
+      thread.join();
+    }
+    // Break the links of the ready queue before the subscriptions go away.
+    while (ready_head_) {
+      ready_head_ = std::move(ready_head_->next_ready);
+    }
+  }
+
+  // The subscription ends once a `Publish()` call is made with `now_ms >= end_ms`, after the data published
+  // before has been sent, or as soon as sending to the sink fails. The `initial` data is sent before anything
+  // published, and does not count towards the limit of the pending data. With `lossless`, for the data that can
+  // not be decoded with gaps in it, the subscription ends instead of dropping data that does not fit.
+  Handle Subscribe(std::unique_ptr<BroadcastSink> sink,
+                   double end_ms = 1e18,
+                   size_t channel = 0,
+                   const std::string& initial = "",
+                   bool lossless = false) {
+    Handle subscription(new Subscription(std::move(sink), end_ms, channel, lossless, pool_));
+    subscription->pending.Append(initial.data(), initial.length());
+    subscription->pending_since = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    subscriptions_.push_back(subscription);
+    return subscription;
+  }
+
+  // Appends `data` to the buffers of the active subscribers of the channel and wakes up the writers.
+  void Publish(const char* data, size_t size, double now_ms, size_t channel = 0) {
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool notify = false;
+    {
+      std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+      for (size_t i = 0; i < subscriptions_.size();) {
+        const Handle& s = subscriptions_[i];
+        if (s->done) {
+          subscriptions_[i] = std::move(subscriptions_.back());
+          subscriptions_.pop_back();
+          continue;
+        }
+        Append(s, (s->channel == channel) ? data : nullptr, size, now_ms, now, notify);
+        ++i;
+      }
+    }
+    if (notify) {
+      ready_cv_.notify_all();
+    }
+  }
+
+  void Publish(const std::string& data, double now_ms, size_t channel = 0) {
+    Publish(data.data(), data.length(), now_ms, channel);
+  }
+
+  // Appends `data` to the buffer of the one subscriber. Returns `Dropped` if it did not fit,
+  // and `Over` once the subscription has ended, after which there is no point to publish to it.
+  PublishResult PublishTo(const Handle& s, const char* data, size_t size, double now_ms) {
+    bool notify = false;
+    const PublishResult result = Append(s, data, size, now_ms, std::chrono::steady_clock::now(), notify);
+    if (notify) {
+      ready_cv_.notify_one();
+    }
+    return result;
+  }
+
+  // Ends the subscription once the data published to it so far has been sent.
+  void Close(const Handle& s) {
+    {
+      std::lock_guard<std::mutex> lock(s->mutex);
+      s->closing = true;
+      if (s->queued) {
+        return;
+      }
+      s->queued = true;
+      Enqueue(s, std::chrono::steady_clock::now());
+    }
+    ready_cv_.notify_one();
+  }
+
+  size_t SubscribersCount() const {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    return subscriptions_.size();
+  }
+
+  // The number of times data was not delivered to some subscriber because its buffer was full.
+  size_t DroppedCount() const { return dropped_; }
+
+  // The total size of the data delivered to the subscribers.
+  uint64_t SentBytes() const { return sent_bytes_; }
+
+  // The memory held for the pending data of all the subscribers, in chunks of `ChunkPool::ChunkSize()`.
+  size_t AllocatedChunks() const { return pool_.AllocatedCount(); }
+
+  // The number of subscriptions ended because sending to them took longer than `send_timeout_ms`.
+  size_t StalledCount() const { return stalled_; }
+
+ private:
+  struct Subscription {
+    std::unique_ptr<BroadcastSink> sink;
+    const double end_ms;
+    const size_t channel;
+    const bool lossless;
+    std::mutex mutex;
+    ChunkChain pending;  // Guarded by `mutex`.
+    std::chrono::steady_clock::time_point pending_since;  // Guarded by `mutex`. When `pending` got data.
+    bool queued = false;  // Guarded by `mutex`. True while in the ready queue or being written to.
+    bool closing = false;  // Guarded by `mutex`.
+    std::atomic_bool done;
+    // Guarded by `ready_mutex_`. The place in the ready queue, and the time to flush.
+    Handle next_ready;
+    std::chrono::steady_clock::time_point flush_at;
+    Subscription(
+        std::unique_ptr<BroadcastSink> sink, double end_ms, size_t channel, bool lossless, ChunkPool& pool)
+        : sink(std::move(sink)),
+          end_ms(end_ms),
+          channel(channel),
+          lossless(lossless),
+          pending(pool),
+          done(false) {}
+  };
+
+  // Appends `data`, unless it is null, to the buffer of `s`, and queues `s` for the writers
+  // if there is anything to do for it, setting `notify` then. The subscription is over once `now_ms` has
+  // reached its end.
+  PublishResult Append(const Handle& s,
+                       const char* data,
+                       size_t size,
+                       double now_ms,
+                       std::chrono::steady_clock::time_point now,
+                       bool& notify) {
+    PublishResult result = PublishResult::Queued;
+    std::lock_guard<std::mutex> lock(s->mutex);
+    if (now_ms >= s->end_ms) {
+      s->closing = true;
+    }
+    if (s->closing) {
+      result = PublishResult::Over;
+    } else if (data) {
+      if (s->pending.Size() + size <= max_pending_bytes_) {
+        if (s->pending.Empty()) {
+          s->pending_since = now;
+        }
+        s->pending.Append(data, size);
+      } else {
+        ++dropped_;
+        if (s->lossless) {
+          s->closing = true;
+          result = PublishResult::Over;
+        } else {
+          result = PublishResult::Dropped;
+        }
+      }
+    }
+    if (!s->queued && (s->closing || !s->pending.Empty())) {
+      s->queued = true;
+      Enqueue(s, s->closing ? now : s->pending_since + flush_delay_);
+      notify = true;
+    }
+    return result;
+  }
+
+  void Enqueue(const Handle& s, std::chrono::steady_clock::time_point flush_at) {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    s->flush_at = flush_at;
+    if (ready_tail_) {
+      ready_tail_->next_ready = s;
+    } else {
+      ready_head_ = s;
+    }
+    ready_tail_ = s.get();
+  }
+
+  // What the watchdog knows of a writer thread. Guarded by `writers_mutex_`.
+  struct Writer {
+    Subscription* sending = nullptr;  // The subscription being sent to, if any.
+    std::chrono::steady_clock::time_point since;  // When the `Send()` started.
+    bool stuck = false;  // Replaced by another writer, to exit once its `Send()` returns.
+  };
+
+  // Must be called with `writers_mutex_` locked.
+  void StartWriter() {
+    writer_states_.emplace_back(new Writer());
+    writers_.emplace_back(&Broadcaster::WriterThread, this, writer_states_.back().get());
+  }
+
+  void WriterThread(Writer* self) {
+    ChunkChain batch(pool_);
+    std::vector<ConstBuffer> buffers;
+    buffers.reserve(max_pending_bytes_ / pool_.ChunkSize() + 2);
+    while (true) {
+      Handle s;
+      {
+        std::unique_lock<std::mutex> lock(ready_mutex_);
+        while (!stop_) {
+          if (!ready_head_) {
+            ready_cv_.wait(lock);
+          } else if (ready_head_->flush_at > std::chrono::steady_clock::now()) {
+            ready_cv_.wait_until(lock, ready_head_->flush_at);
+          } else {
+            break;
+          }
+        }
+        if (stop_) {
+          return;
+        }
+        s = std::move(ready_head_);
+        ready_head_ = std::move(s->next_ready);
+        if (!ready_head_) {
+          ready_tail_ = nullptr;
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        batch.Swap(s->pending);
+      }
+      bool failed = false;
+      if (!batch.Empty()) {
+        buffers.clear();
+        batch.ForEachBuffer([&buffers](const ConstBuffer& buffer) { buffers.push_back(buffer); });
+        {
+          std::lock_guard<std::mutex> lock(writers_mutex_);
+          self->sending = s.get();
+          self->since = std::chrono::steady_clock::now();
+        }
+        try {
+          s->sink->Send(buffers.data(), buffers.size());
+          sent_bytes_ += batch.Size();
+        } catch (const std::exception& e) {
+          std::cerr << "Exception in data serving thread: " << e.what() << std::endl;
+          failed = true;
+        }
+        std::lock_guard<std::mutex> lock(writers_mutex_);
+        self->sending = nullptr;
+        // The watchdog has ended the subscription, and started another writer in place of this one.
+        failed |= self->stuck;
+      }
+      batch.Clear();
+      bool closing = false;
+      bool requeue = false;
+      {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (failed) {
+          // The data still pending has nowhere to go.
+          closing = true;
+          s->closing = true;
+        } else if (!s->pending.Empty()) {
+          // More data has arrived while writing; go to the back of the queue to be fair to others,
+          // right away if the subscription is closing, as no more data is coming.
+          requeue = true;
+          Enqueue(s, s->closing ? std::chrono::steady_clock::now() : s->pending_since + flush_delay_);
+        } else if (s->closing) {
+          // Closed either on expiry or by `Close()`, and everything published before has been sent.
+          closing = true;
+        } else {
+          s->queued = false;
+        }
+      }
+      if (closing) {
+        s->sink.reset();
+        s->done = true;
+      } else if (requeue) {
+        ready_cv_.notify_one();
+      }
+      std::lock_guard<std::mutex> lock(writers_mutex_);
+      if (self->stuck) {
+        return;
+      }
+    }
+  }
+
+  // Ends the subscriptions that have held a writer for longer than `send_timeout_`, and replaces the writers.
+  void WatchdogThread() {
+    std::unique_lock<std::mutex> lock(writers_mutex_);
+    while (!stop_watchdog_) {
+      watchdog_cv_.wait_for(lock, send_timeout_ / 4);
+      const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() - send_timeout_;
+      // Only those started before this pass are looked at.
+      const size_t count = writer_states_.size();
+      for (size_t i = 0; i < count && !stop_watchdog_; ++i) {
+        Writer& writer = *writer_states_[i];
+        if (writer.sending && !writer.stuck && writer.since < deadline) {
+          writer.stuck = true;
+          ++stalled_;
+          Subscription& s = *writer.sending;
+          {
+            // Nothing more goes to it, and its buffer goes back to the pool.
+            std::lock_guard<std::mutex> subscription_lock(s.mutex);
+            s.closing = true;
+            s.pending.Clear();
+          }
+          s.sink->Abort();
+          StartWriter();
+        }
+      }
+    }
+  }
+
+  const size_t max_pending_bytes_;
+  const std::chrono::steady_clock::duration flush_delay_;
+  const std::chrono::steady_clock::duration send_timeout_;
+
+  // Declared first, so that the chains of the subscriptions can return their chunks on destruction.
+  ChunkPool pool_;
+
+  mutable std::mutex subscriptions_mutex_;
+  std::vector<Handle> subscriptions_;
+
+  std::mutex ready_mutex_;
+  std::condition_variable ready_cv_;
+  Handle ready_head_;  // Guarded by `ready_mutex_`.
+  Subscription* ready_tail_ = nullptr;  // Guarded by `ready_mutex_`.
+  bool stop_ = false;  // Guarded by `ready_mutex_`.
+
+  std::atomic_size_t dropped_{0};
+  std::atomic<uint64_t> sent_bytes_{0};
+  std::atomic_size_t stalled_{0};
+
+  std::mutex writers_mutex_;
+  std::vector<std::unique_ptr<Writer>> writer_states_;  // Guarded by `writers_mutex_`.
+  std::vector<std::thread> writers_;  // Guarded by `writers_mutex_` while the watchdog runs.
+  std::condition_variable watchdog_cv_;  // Used with `writers_mutex_`.
+  bool stop_watchdog_ = false;  // Guarded by `writers_mutex_`.
+  std::thread watchdog_;
+
+  Broadcaster(const Broadcaster&) = delete;
+  void operator=(const Broadcaster&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_BROADCASTER_H
@@ -0,0 +1,100 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `CachedResponse`, a memoized HTTP handler for the endpoints whose output rarely changes.
+//
+// The body is built on the first request and then served from the cache, with the headers prepared once,
+// until `Invalidate()` is called. The cached body is shared via an atomic `std::shared_ptr`, so the requests
+// being served keep the old version alive while a new one is built, and the hot path takes no locks.
+
+#ifndef DEMO_CACHED_RESPONSE_H
+#define DEMO_CACHED_RESPONSE_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "../Bricks/cerealize/cerealize.h"
+#include "../Bricks/net/api/api.h"
+
+#include "metrics.h"
+
+namespace demo {
+
+class CachedResponse final {
+ public:
+  typedef std::function<std::string()> Builder;
+
+  explicit CachedResponse(Builder builder,
+                          const std::string& content_type = "application/json; charset=utf-8",
+                          const bricks::net::HTTPHeaders& headers = {{"Access-Control-Allow-Origin", "*"}})
+      : builder_(builder), content_type_(content_type), headers_(headers) {}
+
+  // The body `SendHTTPResponse(object, name)` would send, to be used from the builders.
+  template <typename T>
+  static std::string JSONBody(const T& object, const std::string& name) {
+    return bricks::cerealize::JSON(object, name) + '\n';
+  }
+
+  // The current body, built if it has been invalidated since the last call.
+  std::shared_ptr<const std::string> Body() const {
+    std::shared_ptr<const std::string> body = std::atomic_load(&body_);
+    if (!body) {
+      std::lock_guard<std::mutex> lock(build_mutex_);
+      body = std::atomic_load(&body_);
+      if (!body) {
+        body = std::make_shared<const std::string>(builder_());
+        std::atomic_store(&body_, body);
+      }
+    }
+    return body;
+  }
+
+  // Makes the next request rebuild the body. Taking the build mutex ensures that a build which has started
+  // before the invalidation does not store its, possibly stale, result after it.
+  void Invalidate() {
+    std::lock_guard<std::mutex> lock(build_mutex_);
+    std::atomic_store(&body_, std::shared_ptr<const std::string>());
+  }
+
+  void operator()(bricks::net::api::Request r) const {
+    const std::shared_ptr<const std::string> body = Body();
+    Respond(r, *body, bricks::net::HTTPResponseCode::OK, content_type_, headers_);
+  }
+
+ private:
+  const Builder builder_;
+  const std::string content_type_;
+  const bricks::net::HTTPHeaders headers_;
+  mutable std::mutex build_mutex_;
+  mutable std::shared_ptr<const std::string> body_;  // Accessed via `std::atomic_load/store` only.
+
+  CachedResponse(const CachedResponse&) = delete;
+  void operator=(const CachedResponse&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_CACHED_RESPONSE_H
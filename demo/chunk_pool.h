@@ -0,0 +1,197 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `ChunkPool`, which recycles the fixed-size buffers the streamed data is kept in,
+// and class `ChunkChain`, the queue of such buffers the data of one stream is appended to.
+//
+// Once the pool has grown to the number of buffers in flight, appending to the chains and flushing them
+// only moves the buffers between the chains and the pool, so streaming does not allocate.
+// After a burst, the pool frees the buffers beyond `max_idle_chunks`.
+
+#ifndef DEMO_CHUNK_POOL_H
+#define DEMO_CHUNK_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace demo {
+
+// A piece of the data to send, laid out as `struct iovec` is, for scatter-gather writes.
+struct ConstBuffer {
+  const char* data;
+  size_t size;
+};
+
+class ChunkPool final {
+ public:
+  // The header of a buffer, followed by `ChunkSize()` bytes of its data in the same allocation.
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+    char* Data() { return reinterpret_cast<char*>(this + 1); }
+  };
+
+  explicit ChunkPool(size_t chunk_size = 4096, size_t max_idle_chunks = 1024)
+      : chunk_size_(chunk_size), max_idle_chunks_(max_idle_chunks) {}
+
+  // All the chunks must have been released by now.
+  ~ChunkPool() {
+    while (idle_) {
+      Chunk* chunk = idle_;
+      idle_ = chunk->next;
+      ::operator delete(chunk);
+    }
+  }
+
+  size_t ChunkSize() const { return chunk_size_; }
+
+  // Returns an empty chunk, allocating one only if there are no idle chunks.
+  Chunk* Acquire() {
+    Chunk* chunk = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (idle_) {
+        chunk = idle_;
+        idle_ = chunk->next;
+        --idle_count_;
+      }
+    }
+    if (!chunk) {
+      chunk = static_cast<Chunk*>(::operator new(sizeof(Chunk) + chunk_size_));
+      ++allocated_;
+    }
+    chunk->next = nullptr;
+    chunk->size = 0;
+    return chunk;
+  }
+
+  // Takes back the linked list of chunks starting at `chain`.
+  void Release(Chunk* chain) {
+    Chunk* excess = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (chain) {
+        Chunk* chunk = chain;
+        chain = chunk->next;
+        if (idle_count_ < max_idle_chunks_) {
+          chunk->next = idle_;
+          idle_ = chunk;
+          ++idle_count_;
+        } else {
+          chunk->next = excess;
+          excess = chunk;
+        }
+      }
+    }
+    while (excess) {
+      Chunk* chunk = excess;
+      excess = chunk->next;
+      ::operator delete(chunk);
+      --allocated_;
+    }
+  }
+
+  // The number of chunks currently allocated, both idle and in use.
+  size_t AllocatedCount() const { return allocated_; }
+
+ private:
+  const size_t chunk_size_;
+  const size_t max_idle_chunks_;
+  std::mutex mutex_;
+  Chunk* idle_ = nullptr;  // Guarded by `mutex_`.
+  size_t idle_count_ = 0;  // Guarded by `mutex_`.
+  std::atomic_size_t allocated_{0};
+
+  ChunkPool(const ChunkPool&) = delete;
+  void operator=(const ChunkPool&) = delete;
+};
+
+// Not thread-safe; the users guard it along with the rest of the state of the stream.
+class ChunkChain final {
+ public:
+  explicit ChunkChain(ChunkPool& pool) : pool_(pool) {}
+  ~ChunkChain() { Clear(); }
+
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
+
+  // Copies `data` to the end of the chain, filling up the last chunk before taking more from the pool.
+  void Append(const char* data, size_t size) {
+    size_ += size;
+    while (size) {
+      if (!tail_ || tail_->size == pool_.ChunkSize()) {
+        ChunkPool::Chunk* chunk = pool_.Acquire();
+        if (tail_) {
+          tail_->next = chunk;
+        } else {
+          head_ = chunk;
+        }
+        tail_ = chunk;
+      }
+      const size_t n = std::min(size, pool_.ChunkSize() - tail_->size);
+      memcpy(tail_->Data() + tail_->size, data, n);
+      tail_->size += n;
+      data += n;
+      size -= n;
+    }
+  }
+
+  // Calls `f(const ConstBuffer&)` for each non-empty chunk, in order.
+  template <typename F>
+  void ForEachBuffer(F&& f) const {
+    for (ChunkPool::Chunk* chunk = head_; chunk; chunk = chunk->next) {
+      f(ConstBuffer{chunk->Data(), chunk->size});
+    }
+  }
+
+  // Exchanges the contents of two chains of the same pool, without copying the data.
+  void Swap(ChunkChain& other) {
+    std::swap(head_, other.head_);
+    std::swap(tail_, other.tail_);
+    std::swap(size_, other.size_);
+  }
+
+  // Returns all the chunks to the pool.
+  void Clear() {
+    pool_.Release(head_);
+    head_ = tail_ = nullptr;
+    size_ = 0;
+  }
+
+ private:
+  ChunkPool& pool_;
+  ChunkPool::Chunk* head_ = nullptr;
+  ChunkPool::Chunk* tail_ = nullptr;
+  size_t size_ = 0;
+
+  ChunkChain(const ChunkChain&) = delete;
+  void operator=(const ChunkChain&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_CHUNK_POOL_H
@@ -0,0 +1,268 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines the evaluation of the labeled points against the yin-yang class boundaries of `/yinyang.svg`.
+//
+// The boundary is the S-shaped curve made of the right half of the circle of radius 0.5 around (0, 0.5)
+// and the left half of the one around (0, -0.5). The points to the right of it are of the "true" class:
+//
+//   YinYangLabel(x, y) = (x > 0 && !InUpperCircle(x, y)) || InLowerCircle(x, y)
+//
+// `ScoreBatch()` classifies the points given as separate arrays of `x`-s, `y`-s and labels, and adds up
+// the confusion matrix. On x86-64 it uses the AVX2 kernel when the CPU has it, and the SSE2 one otherwise,
+// picked at runtime so the binary does not need to be built with `-mavx2`; elsewhere it is plain C++.
+// `ClassifierEvaluator` keeps the running confusion matrix of all the points added to the `State`.
+
+#ifndef DEMO_CLASSIFIER_H
+#define DEMO_CLASSIFIER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DEMO_CLASSIFIER_X86_64
+#include <immintrin.h>
+#endif
+
+#include "../Bricks/cerealize/cerealize.h"
+
+#include "point.h"
+
+namespace demo {
+
+struct ConfusionMatrix {
+  uint64_t true_positive = 0;  // Labeled "true", classified as "true".
+  uint64_t false_positive = 0;  // Labeled "false", classified as "true".
+  uint64_t true_negative = 0;
+  uint64_t false_negative = 0;
+
+  uint64_t Total() const { return true_positive + false_positive + true_negative + false_negative; }
+  double Accuracy() const {
+    return Total() ? static_cast<double>(true_positive + true_negative) / Total() : 0;
+  }
+
+  ConfusionMatrix& operator+=(const ConfusionMatrix& rhs) {
+    true_positive += rhs.true_positive;
+    false_positive += rhs.false_positive;
+    true_negative += rhs.true_negative;
+    false_negative += rhs.false_negative;
+    return *this;
+  }
+
+  template <typename A>
+  void save(A& ar) const {
+    const double accuracy = Accuracy();
+    ar(CEREAL_NVP(true_positive),
+       CEREAL_NVP(false_positive),
+       CEREAL_NVP(true_negative),
+       CEREAL_NVP(false_negative),
+       CEREAL_NVP(accuracy));
+  }
+};
+
+// The response of the `/score` endpoint.
+struct Evaluation {
+  ConfusionMatrix confusion;
+  size_t rejected = 0;  // The points of the posted batch that could not be parsed.
+  template <typename A>
+  void save(A& ar) const {
+    ar(CEREAL_NVP(confusion), CEREAL_NVP(rejected));
+  }
+};
+
+// The class of the point by the analytic boundary.
+inline bool YinYangLabel(double x, double y) {
+  const double upper = x * x + (y - 0.5) * (y - 0.5);
+  const double lower = x * x + (y + 0.5) * (y + 0.5);
+  return (x > 0 && !(upper < 0.25)) || lower < 0.25;
+}
+
+namespace impl {
+
+// The counts a confusion matrix is built from, which take fewer operations to update.
+struct ConfusionCounts {
+  uint64_t total = 0;
+  uint64_t labeled = 0;  // Labeled "true".
+  uint64_t predicted = 0;  // Classified as "true".
+  uint64_t both = 0;
+
+  // Adds `n` points given the bit masks of their labels and of the predictions.
+  void Add(unsigned labels, unsigned predictions, unsigned n) {
+    static const uint8_t kBits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+    total += n;
+    labeled += kBits[labels];
+    predicted += kBits[predictions];
+    both += kBits[labels & predictions];
+  }
+
+  void AddTo(ConfusionMatrix& matrix) const {
+    matrix.true_positive += both;
+    matrix.false_positive += predicted - both;
+    matrix.false_negative += labeled - both;
+    matrix.true_negative += total - labeled - predicted + both;
+  }
+};
+
+inline void ScoreScalar(const double* x, const double* y, const uint8_t* label, size_t n, ConfusionCounts& c) {
+  for (size_t i = 0; i < n; ++i) {
+    c.Add(label[i], YinYangLabel(x[i], y[i]), 1);
+  }
+}
+
+#ifdef DEMO_CLASSIFIER_X86_64
+
+// The bit mask of the four labels starting from `label`, in the order `_mm256_movemask_pd` uses.
+inline unsigned FourLabelBits(const uint8_t* label) {
+  uint32_t v;
+  memcpy(&v, label, sizeof(v));
+  return (v & 1) | ((v >> 7) & 2) | ((v >> 14) & 4) | ((v >> 21) & 8);
+}
+
+__attribute__((target("avx2"))) inline void ScoreAVX2(
+    const double* x, const double* y, const uint8_t* label, size_t n, ConfusionCounts& c) {
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d quarter = _mm256_set1_pd(0.25);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256d vx = _mm256_loadu_pd(x + i);
+    const __m256d vy = _mm256_loadu_pd(y + i);
+    const __m256d x2 = _mm256_mul_pd(vx, vx);
+    const __m256d du = _mm256_sub_pd(vy, half);
+    const __m256d dl = _mm256_add_pd(vy, half);
+    const __m256d upper = _mm256_add_pd(x2, _mm256_mul_pd(du, du));
+    const __m256d lower = _mm256_add_pd(x2, _mm256_mul_pd(dl, dl));
+    const __m256d right = _mm256_cmp_pd(vx, zero, _CMP_GT_OQ);
+    const __m256d outside_upper = _mm256_cmp_pd(upper, quarter, _CMP_NLT_UQ);
+    const __m256d inside_lower = _mm256_cmp_pd(lower, quarter, _CMP_LT_OQ);
+    const __m256d predicted = _mm256_or_pd(_mm256_and_pd(right, outside_upper), inside_lower);
+    c.Add(FourLabelBits(label + i), _mm256_movemask_pd(predicted), 4);
+  }
+  ScoreScalar(x + i, y + i, label + i, n - i, c);
+}
+
+inline void ScoreSSE2(const double* x, const double* y, const uint8_t* label, size_t n, ConfusionCounts& c) {
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d half = _mm_set1_pd(0.5);
+  const __m128d quarter = _mm_set1_pd(0.25);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    unsigned predictions = 0;
+    for (size_t j = 0; j < 4; j += 2) {
+      const __m128d vx = _mm_loadu_pd(x + i + j);
+      const __m128d vy = _mm_loadu_pd(y + i + j);
+      const __m128d x2 = _mm_mul_pd(vx, vx);
+      const __m128d du = _mm_sub_pd(vy, half);
+      const __m128d dl = _mm_add_pd(vy, half);
+      const __m128d upper = _mm_add_pd(x2, _mm_mul_pd(du, du));
+      const __m128d lower = _mm_add_pd(x2, _mm_mul_pd(dl, dl));
+      const __m128d right = _mm_cmpgt_pd(vx, zero);
+      const __m128d outside_upper = _mm_cmpnlt_pd(upper, quarter);
+      const __m128d inside_lower = _mm_cmplt_pd(lower, quarter);
+      const __m128d predicted = _mm_or_pd(_mm_and_pd(right, outside_upper), inside_lower);
+      predictions |= _mm_movemask_pd(predicted) << j;
+    }
+    c.Add(FourLabelBits(label + i), predictions, 4);
+  }
+  ScoreScalar(x + i, y + i, label + i, n - i, c);
+}
+
+inline bool HasAVX2() {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+}
+
+#endif  // DEMO_CLASSIFIER_X86_64
+
+}  // namespace impl
+
+// Classifies the `n` points and adds them to the confusion matrix `m`. The labels are 0 or 1.
+inline void ScoreBatch(const double* x, const double* y, const uint8_t* label, size_t n, ConfusionMatrix& m) {
+  impl::ConfusionCounts counts;
+#ifdef DEMO_CLASSIFIER_X86_64
+  if (impl::HasAVX2()) {
+    impl::ScoreAVX2(x, y, label, n, counts);
+  } else {
+    impl::ScoreSSE2(x, y, label, n, counts);
+  }
+#else
+  impl::ScoreScalar(x, y, label, n, counts);
+#endif
+  counts.AddTo(m);
+}
+
+// Scores the `Point`-s from `[begin, end)`, transposing them into the arrays `ScoreBatch()` takes
+// one block at a time.
+template <typename IT>
+ConfusionMatrix ScorePoints(IT begin, IT end) {
+  enum { kBlockSize = 256 };
+  double x[kBlockSize];
+  double y[kBlockSize];
+  uint8_t label[kBlockSize];
+  ConfusionMatrix matrix;
+  while (begin != end) {
+    size_t n = 0;
+    for (; n < kBlockSize && begin != end; ++n, ++begin) {
+      const Point& point = *begin;
+      x[n] = point.x;
+      y[n] = point.y;
+      label[n] = point.label;
+    }
+    ScoreBatch(x, y, label, n, matrix);
+  }
+  return matrix;
+}
+
+// Keeps the running confusion matrix of the points added so far. Safe to use concurrently.
+class ClassifierEvaluator final {
+ public:
+  template <typename IT>
+  void Add(IT begin, IT end) {
+    const ConfusionMatrix matrix = ScorePoints(begin, end);
+    true_positive_.fetch_add(matrix.true_positive, std::memory_order_relaxed);
+    false_positive_.fetch_add(matrix.false_positive, std::memory_order_relaxed);
+    true_negative_.fetch_add(matrix.true_negative, std::memory_order_relaxed);
+    false_negative_.fetch_add(matrix.false_negative, std::memory_order_relaxed);
+  }
+
+  ConfusionMatrix Matrix() const {
+    ConfusionMatrix matrix;
+    matrix.true_positive = true_positive_.load(std::memory_order_relaxed);
+    matrix.false_positive = false_positive_.load(std::memory_order_relaxed);
+    matrix.true_negative = true_negative_.load(std::memory_order_relaxed);
+    matrix.false_negative = false_negative_.load(std::memory_order_relaxed);
+    return matrix;
+  }
+
+ private:
+  std::atomic<uint64_t> true_positive_{0};
+  std::atomic<uint64_t> false_positive_{0};
+  std::atomic<uint64_t> true_negative_{0};
+  std::atomic<uint64_t> false_negative_{0};
+};
+
+}  // namespace demo
+
+#endif  // DEMO_CLASSIFIER_H
@@ -0,0 +1,393 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `DatasetRegistry`, which keeps many independent named `State`-s, the datasets, in one process.
+//
+// A dataset is created on its first write. Each one has its own locks, its own sizes and `max_points` quota,
+// and its own log in `<dir>/<name>/`. Once more than `max_resident` datasets are in memory, the least recently
+// used idle ones are evicted: their logs are compacted, and they get replayed from the disk on the next access.
+// Without a `dir`, the datasets only live in memory, and are never evicted.
+//
+// Looking up a dataset takes no locks. The names live in an open addressing hash table of atomic pointers,
+// which is only ever appended to, and each request pins its dataset by counting itself among its users,
+// so that eviction skips it. Only creating, loading and evicting datasets take the mutex of the registry.
+//
+// A dataset moved to another node is first detached, once no request is using it, so that no point is added
+// to it while it is being sent over, and is then either dropped, or restored should the move fail.
+
+#ifndef DEMO_DATASET_REGISTRY_H
+#define DEMO_DATASET_REGISTRY_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "state.h"
+
+namespace demo {
+
+class DatasetRegistry final {
+ private:
+  struct Entry;
+
+ public:
+  // Keeps the dataset in memory while the request is using it.
+  class Pin final {
+   public:
+    Pin() = default;
+    Pin(Pin&& rhs) : entry_(rhs.entry_), state_(rhs.state_) { rhs.entry_ = nullptr; }
+    ~Pin() {
+      if (entry_) {
+        --entry_->users;
+      }
+    }
+
+    explicit operator bool() const { return state_ != nullptr; }
+    State* operator->() const { return state_; }
+    State& operator*() const { return *state_; }
+
+   private:
+    friend class DatasetRegistry;
+    Pin(Entry* entry, State* state) : entry_(entry), state_(state) {}
+    Entry* entry_ = nullptr;
+    State* state_ = nullptr;
+
+    Pin(const Pin&) = delete;
+    void operator=(const Pin&) = delete;
+  };
+
+  DatasetRegistry(const std::string& dir,
+                  const StateOptions& options,
+                  size_t max_resident = 16,
+                  size_t capacity_log2 = 12)
+      : dir_(dir),
+        options_(options),
+        max_resident_(max_resident),
+        mask_((static_cast<size_t>(1) << capacity_log2) - 1),
+        slots_(new std::atomic<Entry*>[mask_ + 1]) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      slots_[i] = nullptr;
+    }
+    if (!dir_.empty()) {
+      ::mkdir(dir_.c_str(), 0755);
+    }
+  }
+
+  // All the pins must have been released by now.
+  ~DatasetRegistry() {
+    for (size_t i = 0; i <= mask_; ++i) {
+      Entry* entry = slots_[i];
+      if (entry) {
+        delete entry->state.load();
+        delete entry;
+      }
+    }
+  }
+
+  // The names are used as directory names, so only letters, digits, `-` and `_` are allowed.
+  static bool IsValidName(const std::string& name) {
+    if (name.empty() || name.length() > 64) {
+      return false;
+    }
+    for (char c : name) {
+      const bool alphanumeric = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+      if (!alphanumeric && c != '-' && c != '_') {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns the pinned dataset, loading it from the disk if it was evicted. Returns an empty pin if there is
+  // no such dataset and `create` is false, or if the registry has no room for one more dataset.
+  Pin Acquire(const std::string& name, bool create) {
+    const uint64_t hash = Hash(name);
+    Entry* entry = Find(name, hash);
+    if (entry) {
+      Touch(entry);
+      ++entry->users;
+      State* state = entry->state.load();
+      if (state) {
+        return Pin(entry, state);
+      }
+      --entry->users;
+    }
+    return AcquireSlow(name, hash, create);
+  }
+
+  // The names of all the datasets, both in memory and on the disk, including those not loaded since the start.
+  std::vector<std::string> Names() const {
+    std::vector<std::string> names;
+    for (size_t i = 0; i <= mask_; ++i) {
+      const Entry* entry = slots_[i].load(std::memory_order_acquire);
+      if (entry && (entry->state.load() || OnDisk(entry->name))) {
+        names.push_back(entry->name);
+      }
+    }
+    if (!dir_.empty()) {
+      if (DIR* dir = ::opendir(dir_.c_str())) {
+        while (const dirent* file = ::readdir(dir)) {
+          const std::string name = file->d_name;
+          if (IsValidName(name) && !Find(name, Hash(name)) && OnDisk(name)) {
+            names.push_back(name);
+          }
+        }
+        ::closedir(dir);
+      }
+    }
+    return names;
+  }
+
+  // Takes the dataset out of the registry, loading it if it was evicted, once no request is using it,
+  // waiting up to `timeout` for those that are. Until it is dropped or restored, the dataset can be neither
+  // acquired nor created. Returns null if it stayed in use, or if there is no such dataset.
+  std::unique_ptr<State> Detach(const std::string& name, std::chrono::milliseconds timeout) {
+    const uint64_t hash = Hash(name);
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry* entry = Find(name, hash);
+        if (entry && entry->detached) {
+          return nullptr;
+        }
+        State* state = entry ? entry->state.exchange(nullptr) : nullptr;
+        if (state && !entry->users) {
+          entry->detached = true;
+          --resident_;
+          return std::unique_ptr<State>(state);
+        }
+        if (state) {
+          entry->state = state;
+        } else if (!OnDisk(name)) {
+          return nullptr;
+        } else if ((entry = entry ? entry : Add(name, hash))) {
+          entry->detached = true;
+          return std::unique_ptr<State>(new State(Path(name), options_));
+        }
+      }
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return nullptr;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  // Deletes the detached dataset, along with its log.
+  void Drop(const std::string& name, std::unique_ptr<State> state) {
+    state.reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!dir_.empty()) {
+      const std::string path = Path(name);
+      if (DIR* dir = ::opendir(path.c_str())) {
+        while (const dirent* file = ::readdir(dir)) {
+          ::unlink((path + '/' + file->d_name).c_str());
+        }
+        ::closedir(dir);
+      }
+      ::rmdir(path.c_str());
+    }
+    if (Entry* entry = Find(name, Hash(name))) {
+      entry->detached = false;
+      entry->dropped = true;
+      ++dropped_;
+    }
+  }
+
+  // Puts the detached dataset back. The entries are never removed, so the one of a detached dataset is there,
+  // and, were it not, the dataset would be left to be loaded from its log.
+  void Restore(const std::string& name, std::unique_ptr<State> state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* entry = Find(name, Hash(name));
+    if (!entry) {
+      return;
+    }
+    entry->state = state.release();
+    entry->detached = false;
+    ++resident_;
+    EvictIdle(entry);
+  }
+
+  // The number of datasets seen since the start and not dropped, both in memory and not.
+  size_t Size() const { return size_ - dropped_; }
+
+  size_t ResidentCount() const { return resident_; }
+  size_t EvictionCount() const { return evictions_; }
+
+ private:
+  struct Entry {
+    const std::string name;
+    const uint64_t hash;
+    std::atomic<State*> state{nullptr};  // Null while evicted.
+    std::atomic_size_t users{0};
+    std::atomic<int64_t> last_used_ms{0};
+    bool detached = false;  // Guarded by `mutex_`.
+    bool dropped = false;  // Guarded by `mutex_`. Until created again.
+    Entry(const std::string& name, uint64_t hash) : name(name), hash(hash) {}
+  };
+
+  // FNV-1a.
+  static uint64_t Hash(const std::string& name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : name) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  Entry* Find(const std::string& name, uint64_t hash) const {
+    for (size_t i = hash & mask_, probes = 0; probes <= mask_; i = (i + 1) & mask_, ++probes) {
+      Entry* entry = slots_[i].load(std::memory_order_acquire);
+      if (!entry) {
+        return nullptr;
+      }
+      if (entry->hash == hash && entry->name == name) {
+        return entry;
+      }
+    }
+    return nullptr;
+  }
+
+  // Only writes the shared timestamp when it changes, to not bounce its cache line around on every request.
+  static void Touch(Entry* entry) {
+    const int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (entry->last_used_ms.load(std::memory_order_relaxed) != now) {
+      entry->last_used_ms.store(now, std::memory_order_relaxed);
+    }
+  }
+
+  std::string Path(const std::string& name) const { return dir_ + '/' + name; }
+
+  bool OnDisk(const std::string& name) const {
+    struct stat info;
+    return !dir_.empty() && ::stat(Path(name).c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+  }
+
+  Pin AcquireSlow(const std::string& name, uint64_t hash, bool create) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* entry = Find(name, hash);
+    if (entry && entry->detached) {
+      return Pin();
+    }
+    // An entry without a state is either evicted to the disk, or dropped.
+    if ((!entry || !entry->state.load()) && !create && !OnDisk(name)) {
+      return Pin();
+    }
+    if (!entry && !(entry = Add(name, hash))) {
+      return Pin();
+    }
+    State* state = entry->state.load();
+    if (!state) {
+      if (entry->dropped) {
+        entry->dropped = false;
+        --dropped_;
+      }
+      state = new State(dir_.empty() ? "" : Path(name), options_);
+      entry->state = state;
+      ++resident_;
+      EvictIdle(entry);
+    }
+    Touch(entry);
+    ++entry->users;
+    return Pin(entry, state);
+  }
+
+  // Returns null once the table is full. Keeps it at most three quarters full, for the probes to stay short.
+  Entry* Add(const std::string& name, uint64_t hash) {
+    if ((size_ + 1) * 4 > (mask_ + 1) * 3) {
+      return nullptr;
+    }
+    Entry* entry = new Entry(name, hash);
+    size_t i = hash & mask_;
+    while (slots_[i].load(std::memory_order_relaxed)) {
+      i = (i + 1) & mask_;
+    }
+    slots_[i].store(entry, std::memory_order_release);
+    ++size_;
+    return entry;
+  }
+
+  // Evicts the least recently used datasets not in use, other than `keep`, while there are too many in memory.
+  void EvictIdle(Entry* keep) {
+    if (dir_.empty()) {
+      return;
+    }
+    while (resident_ > max_resident_) {
+      Entry* victim = nullptr;
+      for (size_t i = 0; i <= mask_; ++i) {
+        Entry* entry = slots_[i];
+        if (entry && entry != keep && entry->state.load() && !entry->users &&
+            (!victim || entry->last_used_ms < victim->last_used_ms)) {
+          victim = entry;
+        }
+      }
+      if (!victim || !Evict(victim)) {
+        return;
+      }
+      ++evictions_;
+    }
+  }
+
+  // A request may have pinned the dataset since it was picked, then it stays.
+  bool Evict(Entry* entry) {
+    State* state = entry->state.exchange(nullptr);
+    if (entry->users) {
+      entry->state = state;
+      return false;
+    }
+    // Any request from now on sees no state, and waits for `mutex_` to load it again.
+    state->CompactLog();
+    delete state;
+    --resident_;
+    return true;
+  }
+
+  const std::string dir_;
+  const StateOptions options_;
+  const size_t max_resident_;
+  const size_t mask_;
+  std::unique_ptr<std::atomic<Entry*>[]> slots_;
+  std::mutex mutex_;  // Guards creating, loading and evicting the datasets.
+  std::atomic_size_t size_{0};
+  std::atomic_size_t dropped_{0};
+  std::atomic_size_t resident_{0};
+  std::atomic_size_t evictions_{0};
+
+  DatasetRegistry(const DatasetRegistry&) = delete;
+  void operator=(const DatasetRegistry&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_DATASET_REGISTRY_H
@@ -25,6 +25,19 @@ SOFTWARE.
 #include "demo.h"
 
 DEFINE_int32(demo_port, 2015, "The local port to spawn the demo on.");
+DEFINE_string(demo_log_dir, "", "The directory for the durable log of points, empty for in-memory only.");
+DEFINE_string(demo_data_dir, "", "The directory for the named datasets, empty to keep them in memory only.");
+DEFINE_int32(demo_dataset_max_points, 1000000, "The quota of points per named dataset.");
+DEFINE_int32(demo_max_resident_datasets, 16, "The number of named datasets to keep in memory.");
+DEFINE_string(demo_peers, "", "The comma-separated `host:port`-s of the nodes to shard the datasets across.");
+DEFINE_string(demo_host, "localhost", "The host of this node, as listed in `--demo_peers`.");
+DEFINE_int32(demo_threads, 8, "The number of threads to handle the requests on.");
+DEFINE_int32(demo_max_queued_requests, 1024, "The number of requests to queue before responding with a 503.");
+DEFINE_bool(demo_fast_start, false, "Load the static files on their first request instead of at startup.");
+DEFINE_bool(demo_warm_static_files, true, "With `--demo_fast_start`, load the static files in the background.");
+DEFINE_int32(demo_keep_alive_port, 0, "The port to serve the small requests on with keep-alive, 0 for none.");
+DEFINE_int32(demo_stream_writers, 4, "The number of threads to write the `/layout/data` streams on.");
+DEFINE_int32(demo_stream_send_timeout_ms, 5000, "End the streams a write to which takes longer, 0 to never.");
 
 int main(int argc, char** argv) {
   ParseDFlags(&argc, &argv);
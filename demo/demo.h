@@ -28,7 +28,13 @@ SOFTWARE.
 #define DEMO_DEMO_H
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <map>
+#include <set>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <iostream>
 
@@ -37,10 +43,37 @@ SOFTWARE.
 #include "../Bricks/strings/printf.h"
 #include "../Bricks/time/chrono.h"
 
+#include "broadcaster.h"
+#include "cached_response.h"
+#include "dataset_registry.h"
+#include "executor.h"
+#include "gorilla.h"
+#include "hash_ring.h"
+#include "http_client_pool.h"
+#include "keep_alive.h"
+#include "metrics.h"
+#include "number_format.h"
+#include "point_feed.h"
+#include "realtime_feed.h"
+#include "rollup.h"
+#include "static_files.h"
 #include "uptime.h"
 #include "state.h"
 
 DECLARE_int32(demo_port);
+DECLARE_string(demo_log_dir);
+DECLARE_string(demo_data_dir);
+DECLARE_int32(demo_dataset_max_points);
+DECLARE_int32(demo_max_resident_datasets);
+DECLARE_string(demo_peers);
+DECLARE_string(demo_host);
+DECLARE_int32(demo_threads);
+DECLARE_int32(demo_max_queued_requests);
+DECLARE_bool(demo_fast_start);
+DECLARE_bool(demo_warm_static_files);
+DECLARE_int32(demo_keep_alive_port);
+DECLARE_int32(demo_stream_writers);
+DECLARE_int32(demo_stream_send_timeout_ms);
 
 namespace demo {
 
@@ -48,11 +81,13 @@ using bricks::FileSystem;
 using bricks::time::Now;
 using bricks::strings::Printf;
 using bricks::net::api::HTTP;
+using bricks::net::api::GET;
+using bricks::net::api::POST;
 using bricks::net::api::Request;
 using bricks::net::HTTPHeaders;
+using bricks::net::HTTPServerConnection;
 using bricks::net::HTTPResponseCode;
 using bricks::net::GetFileMimeType;
-using namespace bricks::gnuplot;
 using namespace bricks::cerealize;
 
 
@@ -103,22 +138,27 @@ struct ExampleMeta {
 
   // The `data_url` is relative to the `layout_url`.
   std::string data_url = "/data";
+  // The encodings of the data stream a client can ask for via `?encoding=`, the first one is the default.
+  std::vector<std::string> data_encodings = {"json", "gorilla"};
   std::string visualizer_name = "plot-visualizer";
   Options visualizer_options;
 
   template <typename A>
   void save(A& ar) const {
-    ar(CEREAL_NVP(data_url), CEREAL_NVP(visualizer_name), CEREAL_NVP(visualizer_options));
+    ar(CEREAL_NVP(data_url),
+       CEREAL_NVP(data_encodings),
+       CEREAL_NVP(visualizer_name),
+       CEREAL_NVP(visualizer_options));
   }
 };
 
 struct ExampleConfig {
   std::string layout_url = "/layout";
 
-  // For the sake of the demo we put an empty array of `data_hostnames`
+  // Unless the datasets are sharded, we put an empty array of `data_hostnames`
   // that results in the option being ignored by the frontend.
-  // In production, this array should be filled with a set of alternative
-  // hostnames that all resolve to the same backend. This technique is used 
+  // With `--demo_peers`, this array lists all the nodes of the ring, since any of them
+  // forwards the requests to the node that owns the dataset. This technique is used
   // to overcome the browser domain-based connection limit. The frontend selects
   // a domain from this array for every new connection via a simple round-robin.
   std::vector<std::string> data_hostnames;
@@ -130,86 +170,318 @@ struct ExampleConfig {
 };
 
 
+// The nodes of the ring, and which one of them is this one.
+struct RingMembership {
+  std::vector<std::string> nodes;
+  std::string self;
+  size_t moved = 0;  // The number of datasets handed over to their new owners by the last change.
+
+  template <typename A>
+  void save(A& ar) const {
+    ar(CEREAL_NVP(nodes), CEREAL_NVP(self), CEREAL_NVP(moved));
+  }
+};
+
+// Percent-encodes all but the unreserved characters, for a query parameter of a URL.
+inline std::string EncodeURIComponent(const std::string& value) {
+  static const char hex[] = "0123456789ABCDEF";
+  std::string result;
+  for (char c : value) {
+    if (isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.' || c == '~') {
+      result += c;
+    } else {
+      result += '%';
+      result += hex[static_cast<unsigned char>(c) >> 4];
+      result += hex[static_cast<unsigned char>(c) & 15];
+    }
+  }
+  return result;
+}
+
+// Keeps the `Request` alive while its chunked response is being streamed by the `Broadcaster`.
+class ChunkedResponseSink final : public BroadcastSink {
+ public:
+  explicit ChunkedResponseSink(Request r, const std::string& content_type = "application/json; charset=utf-8")
+      : request_(std::move(r)),
+        response_(RespondChunked(
+            request_, HTTPResponseCode::OK, content_type, HTTPHeaders{{"Access-Control-Allow-Origin", "*"}})) {}
+  // The connection only takes whole strings, so the buffers are gathered into one reused string,
+  // which also makes them a single HTTP chunk.
+  void Send(const ConstBuffer* buffers, size_t count) override {
+    buffer_.clear();
+    for (size_t i = 0; i < count; ++i) {
+      buffer_.append(buffers[i].data, buffers[i].size);
+    }
+    response_.Send(buffer_);
+  }
+
+ private:
+  Request request_;
+  std::string buffer_;
+  HTTPServerConnection::ChunkedResponseSender response_;
+};
+
 class DemoServer {
  public:
-  DemoServer(int port = FLAGS_demo_port) : port_(port) {
+  // With a non-empty ring, the named datasets are sharded across its nodes, one of which should be
+  // `<--demo_host>:<port>`, this one. With a non-zero `keep_alive_port`, the small requests are also served
+  // there over persistent connections, see `ServeKeepAlive()`.
+  DemoServer(int port = FLAGS_demo_port,
+             const HashRing& ring = HashRing::FromList(FLAGS_demo_peers),
+             int keep_alive_port = FLAGS_demo_keep_alive_port)
+      : ring_(std::make_shared<HashRing>(ring)),
+        self_(Printf("%s:%d", FLAGS_demo_host.c_str(), port)),
+        state_(FLAGS_demo_log_dir),
+        datasets_(FLAGS_demo_data_dir, DatasetOptions(), FLAGS_demo_max_resident_datasets),
+        port_(port),
+        executor_(FLAGS_demo_threads, FLAGS_demo_max_queued_requests),
+        stop_(false),
+        producer_(&DemoServer::ProduceRealtimeData, this) {
     std::cout << Printf("Preparing to listen on port %d...\n", port_);
-    HTTP(port).Register("/ok", [](Request r) { r.connection.SendHTTPResponse("OK\n"); });
-    HTTP(port).Register("/uptime", UptimeTracker());
-    HTTP(port).Register("/yinyang.svg", State::ClassBoundaries);
-    HTTP(port).Register("/config.json", [](Request r) {
-      r.connection.SendHTTPResponse(ExampleConfig(),
-                                    "config",
-                                    HTTPResponseCode::OK,
-                                    "application/json; charset=utf-8",
-                                    HTTPHeaders({{"Access-Control-Allow-Origin", "*"}}));
+    Register("/ok", [](Request r) { Respond(r, "OK\n"); });
+    Register("/metrics", [this](Request r) {
+      Respond(r, metrics_.Render(), HTTPResponseCode::OK, "text/plain; version=0.0.4");
+    });
+    metrics_.Gauge("demo_points", "The number of points in the state.", [this]() {
+      return static_cast<double>(state_.points.Size());
+    });
+    metrics_.Gauge("demo_label_accuracy", "The share of the points labeled as per `/yinyang.svg`.", [this]() {
+      return state_.evaluator.Matrix().Accuracy();
+    });
+    metrics_.Gauge("demo_active_streams", "The number of `/layout/data` streams.", [this]() {
+      return static_cast<double>(broadcaster_.SubscribersCount());
     });
-    HTTP(port).Register("/layout/data", [](Request r) {
-      std::thread([](Request r) {
-                    // Since we are in another thread, need to catch exceptions ourselves.
-                    try {
-                      auto response = r.connection.SendChunkedHTTPResponse(
-                          HTTPResponseCode::OK,
-                          "application/json; charset=utf-8",
-                          {{"Access-Control-Allow-Origin", "*"}});
-                      std::string data;
-                      const double begin = static_cast<double>(Now());
-                      const double t = atof(r.url.query["t"].c_str());
-                      const double end = (t > 0) ? (begin + t * 1e3) : 1e18;
-                      double current;
-                      while ((current = static_cast<double>(Now())) < end) {
-                        std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 100 + 100));
-                        const double x = current;
-                        const double y = sin(5e-3 * (current - begin));
-                        data += Printf("{\"x\":%lf,\"y\":%lf}\n", x, y);
-                        const double f = (rand() % 101) * (rand() % 101) * (rand() % 101) * 1e-6;
-                        const size_t n = static_cast<size_t>(data.length() * f);
-                        if (n) {
-                          response.Send(data.substr(0, n));
-                          data = data.substr(n);
-                        }
-                      }
-                    } catch (const std::exception& e) {
-                      std::cerr << "Exception in data serving thread: " << e.what() << std::endl;
-                    }
-                  },
-                  std::move(r)).detach();
+    metrics_.Gauge("demo_stream_bytes_total", "The total size of the streamed data.", [this]() {
+      return static_cast<double>(broadcaster_.SentBytes());
+    }, "counter");
+    metrics_.Gauge("demo_stream_dropped_total", "The number of times a slow stream has lost data.", [this]() {
+      return static_cast<double>(broadcaster_.DroppedCount());
+    }, "counter");
+    metrics_.Gauge("demo_stream_stalled_total", "The number of streams ended for not reading.", [this]() {
+      return static_cast<double>(broadcaster_.StalledCount());
+    }, "counter");
+    metrics_.Gauge("demo_datasets", "The number of named datasets.", [this]() {
+      return static_cast<double>(datasets_.Size());
     });
-    HTTP(port).Register("/layout/meta", [](Request r) {
-      r.connection.SendHTTPResponse(ExampleMeta(),
-                                    "meta",
-                                    HTTPResponseCode::OK,
-                                    "application/json; charset=utf-8",
-                                    HTTPHeaders({{"Access-Control-Allow-Origin", "*"}}));
+    metrics_.Gauge("demo_datasets_resident", "The number of named datasets in memory.", [this]() {
+      return static_cast<double>(datasets_.ResidentCount());
     });
-    HTTP(port).Register("/layout", [](Request r) {
-      LayoutItem layout;
-      LayoutItem row;
-      layout.col.push_back(row);
-      r.connection.SendHTTPResponse(layout,
-                                    "layout",
-                                    HTTPResponseCode::OK,
-                                    "application/json; charset=utf-8",
-                                    HTTPHeaders({{"Access-Control-Allow-Origin", "*"}}));
+    metrics_.Gauge("demo_dataset_evictions_total", "The number of times a dataset was evicted.", [this]() {
+      return static_cast<double>(datasets_.EvictionCount());
+    }, "counter");
+    metrics_.Gauge("demo_requests_queued", "The number of requests waiting for a thread.", [this]() {
+      return static_cast<double>(executor_.QueuedCount());
     });
+    metrics_.Gauge("demo_requests_shed_total", "The number of requests refused with a 503.", [this]() {
+      return static_cast<double>(executor_.ShedCount());
+    }, "counter");
+    metrics_.Gauge("demo_point_stream_lag_total", "The number of times a live stream fell behind.", [this]() {
+      return static_cast<double>(point_feed_.LagCount());
+    }, "counter");
+    Register("/uptime", uptime_);
+    Register("/yinyang.svg", State::ClassBoundaries);
+    Register("/config.json", [this](Request r) { config_response_(std::move(r)); });
+    Register("/layout/data", [this](Request r) {
+      const double now = static_cast<double>(Now());
+      const double t = atof(r.url.query["t"].c_str());
+      const double end = (t > 0) ? (now + t * 1e3) : 1e18;
+      // With `encoding=gorilla`, streams the raw points as the records of `GorillaEncoder` instead of JSON,
+      // starting with the block being streamed now, which begins with a key record.
+      const std::string encoding = r.url.query["encoding"];
+      if (encoding == "gorilla") {
+        if (!r.url.query["window"].empty() || !r.url.query["source"].empty()) {
+          Respond(r, "The gorilla encoding is only for the raw points.\n", HTTPResponseCode::BadRequest);
+          return;
+        }
+        realtime_feed_.SubscribeGorilla(
+            std::unique_ptr<BroadcastSink>(new ChunkedResponseSink(std::move(r), "application/octet-stream")),
+            end);
+        return;
+      }
+      if (!encoding.empty() && encoding != "json") {
+        Respond(r, "Unknown encoding.\n", HTTPResponseCode::BadRequest);
+        return;
+      }
+      // With `source=points`, streams the points added via `/demo_id` as NDJSON instead, optionally only those
+      // with the given `label`, and only those within the box of any of `x0`, `y0`, `x1` and `y1`.
+      // A slow client gets every second, fourth, etc. point, or, with `lag=drop`, gets disconnected.
+      if (r.url.query["source"] == "points") {
+        auto& q = r.url.query;
+        PointFilter filter;
+        if (!q["label"].empty()) {
+          filter.label = (q["label"] == "true" || q["label"] == "1") ? 1 : 0;
+        }
+        const auto bound = [&q](const char* name, double& value) {
+          if (!q[name].empty()) {
+            value = atof(q[name].c_str());
+          }
+        };
+        bound("x0", filter.x0);
+        bound("y0", filter.y0);
+        bound("x1", filter.x1);
+        bound("y1", filter.y1);
+        const LagPolicy policy = (q["lag"] == "drop") ? LagPolicy::Drop : LagPolicy::Downsample;
+        point_feed_.Subscribe(
+            std::unique_ptr<BroadcastSink>(new ChunkedResponseSink(std::move(r))), end, filter, policy);
+        return;
+      }
+      // With `window=<ms>`, starts with the history of the window downsampled to at most `width` buckets,
+      // and keeps streaming at the same resolution. The finest resolution streams the raw points.
+      const double window = atof(r.url.query["window"].c_str());
+      size_t channel = 0;
+      std::string history;
+      if (window > 0) {
+        const int width = atoi(r.url.query["width"].c_str());
+        const RollupStore& rollups = realtime_feed_.Rollups();
+        const size_t resolution = rollups.Resolution(now - window, now, (width > 0) ? width : 1000);
+        for (const RollupBucket& bucket : rollups.Query(resolution, now - window, now)) {
+          bucket.AppendJSONLine(history);
+        }
+        channel = resolution ? resolution + 1 : 0;
+      }
+      broadcaster_.Subscribe(
+          std::unique_ptr<BroadcastSink>(new ChunkedResponseSink(std::move(r))), end, channel, history);
+    });
+    Register("/layout/meta", [this](Request r) { meta_response_(std::move(r)); });
+    Register("/layout", [this](Request r) { layout_response_(std::move(r)); });
     // The "./static/" directory should be a symlink to "Web/build" or "Web/build-dev".
-    FileSystem::ScanDir("./static/", [&port](const std::string& filename) {
+    // The precompressed `<file>.br` files are served as the brotli variants of `<file>`, not on their own.
+    // With `--demo_fast_start`, the files are only listed here, and are loaded on their first request,
+    // or in the background with `--demo_warm_static_files`, so that the time to start does not depend on them.
+    std::set<std::string> filenames;
+    FileSystem::ScanDir("./static/", [&filenames](const std::string& filename) { filenames.insert(filename); });
+    std::vector<LazyStaticFiles::Entry> lazy_files;
+    for (const std::string& filename : filenames) {
+      const size_t length = filename.length();
+      const bool is_brotli = (length > 3 && filename.compare(length - 3, 3, ".br") == 0);
+      if (is_brotli && filenames.count(filename.substr(0, length - 3))) {
+        continue;
+      }
       const std::string filepath = "./static/" + filename;
       std::string fileurl = "/static/" + filename;
       // The default route points to the frontend entry point file.
       if (filename == "index.html") {
         fileurl = "/";
       }
-      // Hack with string ownership.
-      // TODO(dkorolev): Make this cleaner.
-      const std::string* contentType = new std::string(GetFileMimeType(filename));
-      std::string* content = new std::string();
-      *content = FileSystem::ReadFileAsString(filepath);
-      HTTP(port).Register(fileurl, [content, contentType](Request r) {
-        r.connection.SendHTTPResponse(*content, HTTPResponseCode::OK, *contentType);
+      const bool has_brotli = filenames.count(filename + ".br");
+      if (FLAGS_demo_fast_start) {
+        lazy_files.push_back(
+            {fileurl, filepath, GetFileMimeType(filename), has_brotli ? filepath + ".br" : std::string()});
+        continue;
+      }
+      const std::string brotli = has_brotli ? FileSystem::ReadFileAsString(filepath + ".br") : "";
+      const StaticFile& file =
+          static_files_.Add(fileurl, GetFileMimeType(filename), FileSystem::ReadFileAsString(filepath), brotli);
+      Register(fileurl, [&file](Request r) { file.Serve(std::move(r)); });
+    }
+    if (FLAGS_demo_fast_start) {
+      // All the lazily loaded files share one entry in `/metrics` and one limit of the concurrent requests.
+      lazy_static_files_.reset(new LazyStaticFiles(lazy_files));
+      Executor::Route& limits = executor_.AddRoute();
+      lazy_static_files_->ForEach([this, &limits](const std::string& url, const LazyStaticFile& file) {
+        RegisterAs(url, "/static/*", [&file](Request r) { file.Serve(std::move(r)); }, limits);
       });
+      if (FLAGS_demo_warm_static_files) {
+        warmer_ = std::thread([this]() {
+          lazy_static_files_->ForEach([this](const std::string&, const LazyStaticFile& file) {
+            if (!stop_) {
+              file.Warm();
+            }
+          });
+        });
+      }
+    }
+    // Rendering the SVG of the points and scoring the bulk uploads take a while, so these get half the threads.
+    const size_t half = std::max(executor_.ThreadsCount() / 2, static_cast<size_t>(1));
+    Register("/demo_id", [this](Request r) { state_.DemoRequest(std::move(r)); }, half);
+    Register("/score", [this](Request r) { state_.Score(std::move(r)); }, half);
+    // `/data?name=<name>` is `/demo_id` of the named dataset, which the first POST to it creates.
+    // With sharding, the request is forwarded to the owner of the dataset, unless it was forwarded already.
+    Register("/data", [this](Request r) {
+      const std::string name = r.url.query["name"];
+      if (!DatasetRegistry::IsValidName(name)) {
+        Respond(r, "Invalid dataset name.\n", HTTPResponseCode::BadRequest);
+        return;
+      }
+      const bool forwarded = !r.url.query["forwarded"].empty();
+      std::string owner = forwarded ? "" : OtherOwner(name);
+      if (!owner.empty()) {
+        ForwardData(owner, std::move(r));
+        return;
+      }
+      const bool create = (r.http.Method() == "POST");
+      auto dataset = std::make_shared<DatasetRegistry::Pin>(datasets_.Acquire(name, create));
+      // The ring may have changed meanwhile, and the dataset been handed over, or be in the middle of it.
+      // The handover waits for the pinned datasets, so either this request is done before it starts,
+      // or it sees the new ring here.
+      owner = forwarded ? "" : OtherOwner(name);
+      if (!owner.empty()) {
+        dataset.reset();
+        ForwardData(owner, std::move(r));
+        return;
+      }
+      if (!*dataset) {
+        if (create) {
+          Respond(r, "Too many datasets.\n", HTTPResponseCode::ServiceUnavailable);
+        } else {
+          Respond(r, "No such dataset.\n", HTTPResponseCode::NotFound);
+        }
+        return;
+      }
+      // The response with all the points may be sent in steps, holding on to the dataset till the last one.
+      (*dataset)->DemoRequest(std::move(r), dataset);
+    });
+    // GET responds with the nodes of the ring. POST `?nodes=<host:port>,...` changes them, and hands over
+    // the datasets this node no longer owns to their new owners. Each node should be told about the change.
+    Register("/ring", [this](Request r) {
+      RingMembership membership;
+      if (r.http.Method() == "POST") {
+        std::atomic_store(&ring_, std::make_shared<const HashRing>(HashRing::FromList(r.url.query["nodes"])));
+        config_response_.Invalidate();
+        membership.moved = HandOverDatasets();
+      }
+      membership.nodes = std::atomic_load(&ring_)->Nodes();
+      membership.self = self_;
+      Respond(r, membership, "ring");
+    });
+    if (keep_alive_port) {
+      ServeKeepAlive(keep_alive_port);
+    }
+  }
+
+  ~DemoServer() {
+    for (const std::string& route : routes_) {
+      HTTP(port_).UnRegister(route);
+    }
+    stop_ = true;
+    producer_.join();
+    if (warmer_.joinable()) {
+      warmer_.join();
+    }
+  }
+
+  // Registers the handler on the port of the server, instrumented for `/metrics`. The requests are handled
+  // by the threads of `executor_`, up to `max_running` at once, all of them for 0, and with 503 once
+  // too many are waiting.
+  template <typename F>
+  void Register(const std::string& route, F&& handler, size_t max_running = 0) {
+    RegisterAs(route, route, std::forward<F>(handler), executor_.AddRoute(max_running));
+  }
+
+  // Registers the handler under the entry in `/metrics` and the limits shared by the group of routes.
+  template <typename F>
+  void RegisterAs(const std::string& route, const std::string& group, F&& handler, Executor::Route& limits) {
+    const std::function<void(Request)> instrumented = metrics_.Instrument(group, std::forward<F>(handler));
+    RouteMetrics& metrics = metrics_.Route(group);
+    HTTP(port_).Register(route, [this, instrumented, &limits, &metrics](Request r) {
+      const auto request = std::make_shared<Request>(std::move(r));
+      if (!executor_.Submit([instrumented, request]() { instrumented(std::move(*request)); }, &limits)) {
+        RequestRecorder recorder(metrics, *request);
+        Respond(*request, "Overloaded.\n", HTTPResponseCode::ServiceUnavailable);
+        recorder.Returned();
+      }
     });
-    HTTP(port).Register("/demo_id", [this](Request r) { state_.DemoRequest(std::move(r)); });
+    routes_.push_back(route);
   }
 
   void Join() {
@@ -219,8 +491,198 @@ class DemoServer {
   }
 
  private:
+  // The node that owns the dataset, empty if it is this one.
+  std::string OtherOwner(const std::string& name) const {
+    const std::shared_ptr<const HashRing> ring = std::atomic_load(&ring_);
+    return (ring->Empty() || ring->Owner(name) == self_) ? std::string() : ring->Owner(name);
+  }
+
+  // The forwarded requests are not forwarded again, and, with at most half of the threads waiting on
+  // the other nodes, there are always threads left to serve the requests forwarded here.
+  void ForwardData(const std::string& owner, Request r) {
+    if (++forwarding_ > std::max(executor_.ThreadsCount() / 2, static_cast<size_t>(1))) {
+      Respond(r, "Overloaded.\n", HTTPResponseCode::ServiceUnavailable);
+    } else {
+      Forward(owner, std::move(r));
+    }
+    --forwarding_;
+  }
+
+  // Relays the request to the node that owns the dataset, and its response back, over a pooled connection.
+  void Forward(const std::string& owner, Request r) {
+    std::string url = owner + "/data?forwarded=1";
+    for (const auto& parameter : r.url.query) {
+      if (parameter.first != "forwarded") {
+        url += '&' + EncodeURIComponent(parameter.first) + '=' + EncodeURIComponent(parameter.second);
+      }
+    }
+    try {
+      if (r.http.Method() != "POST") {
+        Relay(peers_.GET(url), r);
+      } else if (!r.http.HasBody()) {
+        Relay(peers_.POST(url), r);
+      } else {
+        Relay(peers_.POST(url, r.http.Body(), impl::HeaderValue(r.http.headers(), "Content-Type")), r);
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Can not forward to " << owner << ": " << e.what() << std::endl;
+      Respond(r, "The owner of the dataset is unreachable.\n", HTTPResponseCode::BadGateway);
+    }
+  }
+
+  static void Relay(const PooledHTTPResponse& response, Request& r) {
+    const HTTPResponseCode code = static_cast<HTTPResponseCode>(response.code);
+    if (response.content_type.empty()) {
+      Respond(r, response.body, code);
+    } else {
+      Respond(r, response.body, code, response.content_type);
+    }
+  }
+
+  // Posts the points of each dataset owned by another node now to that node, and removes the local copy,
+  // so that it does not come back stale should the dataset move back here. Returns the number of moved ones.
+  // The new requests for these datasets are forwarded to their new owners by now, and each dataset is
+  // detached once the requests still using it are done, so that the points sent over are all there are.
+  // A dataset that stays in use, or fails to be sent, is kept until the next change of the ring.
+  size_t HandOverDatasets() {
+    std::lock_guard<std::mutex> lock(handover_mutex_);
+    const std::shared_ptr<const HashRing> ring = std::atomic_load(&ring_);
+    size_t moved = 0;
+    for (const std::string& name : datasets_.Names()) {
+      if (ring->Empty() || ring->Owner(name) == self_) {
+        continue;
+      }
+      std::unique_ptr<State> dataset = datasets_.Detach(name, std::chrono::seconds(1));
+      if (!dataset) {
+        std::cerr << "Can not hand over `" << name << "`: it is in use." << std::endl;
+        continue;
+      }
+      std::string body;
+      dataset->points.GetSnapshot().ForEach([&body](const Point& point) { AppendBinaryPoint(point, body); });
+      const std::string url =
+          ring->Owner(name) + "/data?forwarded=1&format=binary&name=" + EncodeURIComponent(name);
+      try {
+        if (peers_.POST(url, body, "application/octet-stream").code == 200) {
+          datasets_.Drop(name, std::move(dataset));
+          ++moved;
+          continue;
+        }
+        std::cerr << "Can not hand over `" << name << "`: the new owner has refused it." << std::endl;
+      } catch (const std::exception& e) {
+        std::cerr << "Can not hand over `" << name << "`: " << e.what() << std::endl;
+      }
+      datasets_.Restore(name, std::move(dataset));
+    }
+    return moved;
+  }
+
+  // Serves `/ok`, `/uptime` and the single points of `POST /demo_id?x=&y=&label=` on `port` too, where a client
+  // keeps its connection and may pipeline its requests. These are quick enough to be handled by the polling
+  // thread itself, and are instrumented under the same routes in `/metrics`.
+  void ServeKeepAlive(int port) {
+    std::map<std::string, KeepAliveServer::Handler> routes;
+    routes["/ok"] = [](const KeepAliveRequest&, KeepAliveResponse& response) { response.body = "OK\n"; };
+    routes["/uptime"] = [this](const KeepAliveRequest&, KeepAliveResponse& response) {
+      response.content_type = "application/json; charset=utf-8";
+      response.body = JSON(UptimeTracker::ResponseJSON(Now() - uptime_.start_ms_), "uptime") + '\n';
+    };
+    routes["/demo_id"] = [this](const KeepAliveRequest& request, KeepAliveResponse& response) {
+      if (request.method != "POST" || !request.body.empty() || request.query.count("format")) {
+        response.code = 400;
+        response.body = "Only the single points of `POST /demo_id?x=&y=&label=` are served on this port.\n";
+        return;
+      }
+      const State::AddResponse added = state_.AddQueryPoint([&request](const char* name) {
+        const auto it = request.query.find(name);
+        return (it != request.query.end()) ? it->second : std::string();
+      });
+      response.code = static_cast<int>(added.code);
+      response.body = added.body;
+    };
+    for (auto& route : routes) {
+      RouteMetrics& metrics = metrics_.Route(route.first);
+      const KeepAliveServer::Handler handler = route.second;
+      route.second = [&metrics, handler](const KeepAliveRequest& request, KeepAliveResponse& response) {
+        const auto begin = std::chrono::steady_clock::now();
+        const auto record = [&](int code) {
+          metrics.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now() - begin).count(),
+                         request.body.length(),
+                         code,
+                         response.body.length());
+        };
+        try {
+          handler(request, response);
+        } catch (...) {
+          record(500);
+          throw;
+        }
+        record(response.code);
+      };
+    }
+    keep_alive_.reset(new KeepAliveServer(port, std::move(routes)));
+    metrics_.Gauge("demo_keep_alive_connections", "The number of open keep-alive connections.", [this]() {
+      return static_cast<double>(keep_alive_->ConnectionsCount());
+    });
+  }
+
+  // The named datasets are many and small, so their spatial index and live ring are smaller than of `state_`.
+  static StateOptions DatasetOptions() {
+    StateOptions options;
+    options.index_cells_per_side = 64;
+    options.live_capacity_log2 = 12;
+    options.max_points = FLAGS_demo_dataset_max_points;
+    return options;
+  }
+
+  // Generates each point of the real-time data feed once, for all the `/layout/data` subscribers.
+  void ProduceRealtimeData() {
+    const double begin = static_cast<double>(Now());
+    while (!stop_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 100 + 100));
+      const double x = static_cast<double>(Now());
+      realtime_feed_.Publish(x, sin(5e-3 * (x - begin)));
+    }
+  }
+
+  std::vector<std::string> routes_;
+  Metrics metrics_;
+  UptimeTracker uptime_;
+  HTTPClientPool peers_;  // Keeps the connections to the other nodes of the ring.
+  std::shared_ptr<const HashRing> ring_;  // Replaced as a whole via `std::atomic_store()`.
+  const std::string self_;
   State state_;
+  DatasetRegistry datasets_;
+  StaticFileCache static_files_;
+  std::unique_ptr<const LazyStaticFiles> lazy_static_files_;  // With `--demo_fast_start`.
+  // The responses of the constant JSON endpoints, serialized once.
+  CachedResponse config_response_{[this]() {
+    ExampleConfig config;
+    config.data_hostnames = std::atomic_load(&ring_)->Nodes();
+    return CachedResponse::JSONBody(config, "config");
+  }};
+  CachedResponse meta_response_{[]() { return CachedResponse::JSONBody(ExampleMeta(), "meta"); }};
+  CachedResponse layout_response_{[]() {
+    LayoutItem layout;
+    LayoutItem row;
+    layout.col.push_back(row);
+    return CachedResponse::JSONBody(layout, "layout");
+  }};
   const int port_;
+  Broadcaster broadcaster_{static_cast<size_t>(std::max(FLAGS_demo_stream_writers, 1)),
+                           1 << 14,
+                           0,
+                           static_cast<double>(FLAGS_demo_stream_send_timeout_ms)};
+  PointFeed point_feed_{state_.live, broadcaster_, []() { return static_cast<double>(Now()); }};
+  RealtimeFeed realtime_feed_{broadcaster_};
+  // Declared after all it runs the requests against, so that it finishes them before these are gone.
+  Executor executor_;
+  std::unique_ptr<KeepAliveServer> keep_alive_;  // With a `keep_alive_port`, also runs the requests.
+  std::atomic_size_t forwarding_{0};  // The number of threads waiting on the other nodes.
+  std::mutex handover_mutex_;  // One change of the ring at a time hands over the datasets.
+  std::atomic_bool stop_;
+  std::thread producer_;
+  std::thread warmer_;  // Loads the static files in the background.
 };
 
 }  // namespace demo
@@ -0,0 +1,301 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `Executor`, the bounded pool of threads the handlers of `DemoServer` run on, so that a slow
+// request does not hold up the others, and a burst of requests does not spawn threads without limit.
+//
+// Each worker thread has a queue of its own. A worker takes the oldest task from its queue, and once it is
+// empty, steals the newest task from the queue of another worker, so that the tasks queued behind a long one
+// get taken by the idle workers. The tasks submitted from a worker go to its own queue.
+//
+// The number of the queued tasks is bounded, and past the bound `Submit()` refuses the task, for the caller
+// to shed the load, with a 503 for the HTTP requests, instead of queueing them up without limit.
+// A `Route` also limits how many of its tasks run at once, and how many of them wait for their turn,
+// so that one slow route can not take up all the workers.
+//
+// A long task, such as streaming a large response, runs in steps via `Continue()`. Each step is a task of its
+// own, queued behind the tasks already there, so that the thread is shared with them instead of being parked.
+
+#ifndef DEMO_EXECUTOR_H
+#define DEMO_EXECUTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace demo {
+
+class Executor final {
+ public:
+  typedef std::function<void()> Task;
+  // One step of a long task, returns true while there is more to do.
+  typedef std::function<bool()> Step;
+
+  // Limits the tasks of one route. Owned by the `Executor`.
+  class Route final {
+   public:
+    size_t RunningCount() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return running_;
+    }
+    size_t WaitingCount() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return waiting_.size();
+    }
+
+   private:
+    friend class Executor;
+    Route(size_t max_running, size_t max_waiting) : max_running_(max_running), max_waiting_(max_waiting) {}
+
+    const size_t max_running_;
+    const size_t max_waiting_;
+    mutable std::mutex mutex_;
+    size_t running_ = 0;  // Guarded by `mutex_`. Including the steps of the tasks, which run one at a time.
+    std::deque<Task> waiting_;  // Guarded by `mutex_`.
+  };
+
+  Executor(size_t threads, size_t max_queued) : max_queued_(max_queued) {
+    threads = std::max(threads, static_cast<size_t>(1));
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back(new Worker(*this, i));
+    }
+    for (auto& worker : workers_) {
+      worker->thread = std::thread(&Executor::WorkerThread, this, worker.get());
+    }
+  }
+
+  // Runs the tasks queued, and the steps they continue with, before returning.
+  ~Executor() {
+    stop_ = true;
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex_);
+    }
+    idle_cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker->thread.join();
+    }
+  }
+
+  // Up to `max_running` of the tasks of the route run at once, all the threads for 0, and up to `max_waiting`
+  // more wait for their turn.
+  Route& AddRoute(size_t max_running = 0, size_t max_waiting = 256) {
+    std::lock_guard<std::mutex> lock(routes_mutex_);
+    routes_.emplace_back(new Route(max_running ? max_running : workers_.size(), max_waiting));
+    return *routes_.back();
+  }
+
+  // Queues the task, as one of the `route`, unless it is null. Returns false, leaving the task untouched,
+  // if there is no room for it.
+  bool Submit(Task&& task, Route* route = nullptr) {
+    if (route) {
+      std::lock_guard<std::mutex> lock(route->mutex_);
+      if (route->running_ >= route->max_running_) {
+        if (route->waiting_.size() >= route->max_waiting_) {
+          ++shed_;
+          return false;
+        }
+        route->waiting_.push_back(std::move(task));
+        return true;
+      }
+      if (queued_ >= max_queued_) {
+        ++shed_;
+        return false;
+      }
+      ++route->running_;
+    } else if (queued_ >= max_queued_) {
+      ++shed_;
+      return false;
+    }
+    Push(Item{std::move(task), std::make_shared<Slot>(*this, route)});
+    return true;
+  }
+
+  // Runs `step` until it returns false, one step per task, holding on to the place of the current task
+  // within its route. Outside the threads of an executor, runs all the steps right away.
+  static void Continue(Step step) {
+    Worker* worker = CurrentWorker();
+    if (!worker) {
+      while (step()) {
+      }
+      return;
+    }
+    worker->executor.Push(Item{[step]() mutable {
+                                 if (step()) {
+                                   Continue(std::move(step));
+                                 }
+                               },
+                               worker->slot});
+  }
+
+  size_t ThreadsCount() const { return workers_.size(); }
+
+  // The number of the tasks waiting for a thread, not counting those waiting for their turn within a route.
+  size_t QueuedCount() const { return queued_; }
+
+  // The number of the tasks refused.
+  size_t ShedCount() const { return shed_; }
+
+ private:
+  // Held by a task of a route, and by the steps it continues with. Once the last of them is done,
+  // the next task waiting within the route takes the place.
+  struct Slot final {
+    Executor& executor;
+    Route* const route;
+    Slot(Executor& executor, Route* route) : executor(executor), route(route) {}
+    ~Slot() {
+      if (route) {
+        executor.Finish(*route);
+      }
+    }
+  };
+
+  struct Item final {
+    Task task;
+    std::shared_ptr<Slot> slot;
+  };
+
+  struct Worker final {
+    Executor& executor;
+    const size_t index;
+    std::mutex mutex;
+    std::deque<Item> queue;  // Guarded by `mutex`.
+    std::shared_ptr<Slot> slot;  // Of the task being run.
+    std::thread thread;
+    Worker(Executor& executor, size_t index) : executor(executor), index(index) {}
+  };
+
+  static Worker*& CurrentWorker() {
+    static thread_local Worker* worker = nullptr;
+    return worker;
+  }
+
+  void Finish(Route& route) {
+    Task next;
+    {
+      std::lock_guard<std::mutex> lock(route.mutex_);
+      if (route.waiting_.empty()) {
+        --route.running_;
+        return;
+      }
+      next = std::move(route.waiting_.front());
+      route.waiting_.pop_front();
+    }
+    Push(Item{std::move(next), std::make_shared<Slot>(*this, &route)});
+  }
+
+  void Push(Item&& item) {
+    Worker* worker = CurrentWorker();
+    if (!worker || &worker->executor != this) {
+      worker = workers_[next_worker_++ % workers_.size()].get();
+    }
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->queue.push_back(std::move(item));
+      ++queued_;
+    }
+    if (sleeping_) {
+      {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+      }
+      idle_cv_.notify_one();
+    }
+  }
+
+  // Takes the oldest task of the worker, or steals the newest one of another worker.
+  bool Take(Worker* worker, Item& item) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      if (!worker->queue.empty()) {
+        item = std::move(worker->queue.front());
+        worker->queue.pop_front();
+        --queued_;
+        return true;
+      }
+    }
+    for (size_t i = 1; i < workers_.size(); ++i) {
+      Worker* victim = workers_[(worker->index + i) % workers_.size()].get();
+      std::lock_guard<std::mutex> lock(victim->mutex);
+      if (!victim->queue.empty()) {
+        item = std::move(victim->queue.back());
+        victim->queue.pop_back();
+        --queued_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void WorkerThread(Worker* worker) {
+    CurrentWorker() = worker;
+    while (true) {
+      {
+        Item item;
+        if (Take(worker, item)) {
+          worker->slot = std::move(item.slot);
+          try {
+            item.task();
+          } catch (const std::exception& e) {
+            std::cerr << "Exception in executor thread: " << e.what() << std::endl;
+          }
+          // Releases the place within the route, unless the task has continued, outside the lock.
+          worker->slot.reset();
+          continue;
+        }
+      }
+      std::unique_lock<std::mutex> lock(idle_mutex_);
+      ++sleeping_;
+      idle_cv_.wait(lock, [this]() { return queued_ > 0 || stop_; });
+      --sleeping_;
+      if (stop_ && !queued_) {
+        return;
+      }
+    }
+  }
+
+  const size_t max_queued_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic_size_t next_worker_{0};
+  std::atomic_size_t queued_{0};
+  std::atomic_size_t shed_{0};
+  std::atomic_size_t sleeping_{0};
+  std::atomic_bool stop_{false};
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cv_;
+  std::mutex routes_mutex_;
+  std::vector<std::unique_ptr<Route>> routes_;  // Guarded by `routes_mutex_`.
+
+  Executor(const Executor&) = delete;
+  void operator=(const Executor&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_EXECUTOR_H
@@ -0,0 +1,338 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `GorillaEncoder`, which packs the points of a time series, the millisecond timestamps
+// and the values, into a few bytes each, and class `GorillaDecoder`, which unpacks them back, bit exact.
+//
+// The encoding follows Gorilla, the in-memory time series database at Facebook: the timestamps are stored
+// as the deltas of their deltas, which are mostly zero or small for points that come at a steady pace,
+// and the values as the XOR with the previous value, of which only the bits between the leading and the
+// trailing zeros are stored, reusing the previous window of these bits when the new ones fit into it.
+//
+// For streaming, each point is a record on its own padded to whole bytes, so that it goes out as soon
+// as it is added, and the records are framed into blocks of `kBlockSize` points. Each block begins with
+// a key record of the point as is, so that a client can start decoding at the beginning of any block.
+//   Key record:   the byte 0x80, then the timestamp and the bits of the value, eight bytes each, big endian.
+//   Delta record: the bit 0, then the delta of delta of the timestamp, then the XOR of the value.
+// The delta of delta `d` is `0` for zero, `10` and 7 bits for -63..64, `110` and 9 bits for -255..256,
+// `1110` and 12 bits for -2047..2048, and `1111` and 32 bits for the rest, with a key record instead
+// of the delta one if it does not fit. The XOR is `0` for the same value, `10` and the bits in the
+// previous window, or `11`, 5 bits of the number of leading zeros, 6 bits of the number of bits
+// in the window less one, and the bits.
+//
+// On the series of the `/layout/data` stream of the demo, `bench/stream_encoding.cc` measures 10.1 bytes
+// per point against 45.3 bytes of JSON, 4.5x less, and 9.1 bytes, 5x less, when the points come at a steady
+// pace. See the top-level `README.md` for the numbers.
+
+#ifndef DEMO_GORILLA_H
+#define DEMO_GORILLA_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace demo {
+
+namespace impl {
+
+// The arithmetic of the timestamps wraps around instead of overflowing, so that any of them round trip.
+inline int64_t WrappingAdd(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+}
+
+inline int64_t WrappingSubtract(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+}
+
+}  // namespace impl
+
+class GorillaEncoder final {
+ public:
+  enum { kBlockSize = 64, kMaxRecordLength = 17 };
+
+  // Whether the next point begins a new block, so that the stream can be joined from it on.
+  bool AtBlockStart() const { return count_ == 0; }
+
+  // Writes the record of the point into `output`, which must have room for `kMaxRecordLength` bytes.
+  // Returns the number of bytes written.
+  size_t Add(int64_t timestamp, double value, char* output) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const int64_t delta = impl::WrappingSubtract(timestamp, timestamp_);
+    const int64_t delta_of_delta = impl::WrappingSubtract(delta, delta_);
+    const bool key = (count_ == 0 || delta_of_delta < -2147483647 || delta_of_delta > 2147483648ll);
+    count_ = (count_ + 1) % kBlockSize;
+    timestamp_ = timestamp;
+    if (key) {
+      output[0] = static_cast<char>(0x80);
+      PutBigEndian(static_cast<uint64_t>(timestamp), output + 1);
+      PutBigEndian(bits, output + 9);
+      delta_ = 0;
+      bits_ = bits;
+      window_ = false;
+      return 17;
+    }
+    delta_ = delta;
+    BitWriter writer(output);
+    writer.Write(0, 1);
+    if (delta_of_delta == 0) {
+      writer.Write(0, 1);
+    } else if (delta_of_delta >= -63 && delta_of_delta <= 64) {
+      writer.Write(0x2, 2);
+      writer.Write(static_cast<uint64_t>(delta_of_delta + 63), 7);
+    } else if (delta_of_delta >= -255 && delta_of_delta <= 256) {
+      writer.Write(0x6, 3);
+      writer.Write(static_cast<uint64_t>(delta_of_delta + 255), 9);
+    } else if (delta_of_delta >= -2047 && delta_of_delta <= 2048) {
+      writer.Write(0xe, 4);
+      writer.Write(static_cast<uint64_t>(delta_of_delta + 2047), 12);
+    } else {
+      writer.Write(0xf, 4);
+      writer.Write(static_cast<uint64_t>(delta_of_delta + 2147483647), 32);
+    }
+    const uint64_t xor_bits = bits ^ bits_;
+    bits_ = bits;
+    if (!xor_bits) {
+      writer.Write(0, 1);
+    } else {
+      const int leading = std::min(__builtin_clzll(xor_bits), 31);
+      const int trailing = __builtin_ctzll(xor_bits);
+      if (window_ && leading >= leading_ && trailing >= trailing_) {
+        writer.Write(0x2, 2);
+        writer.Write(xor_bits >> trailing_, 64 - leading_ - trailing_);
+      } else {
+        leading_ = leading;
+        trailing_ = trailing;
+        window_ = true;
+        writer.Write(0x3, 2);
+        writer.Write(static_cast<uint64_t>(leading), 5);
+        writer.Write(static_cast<uint64_t>(63 - leading - trailing), 6);
+        writer.Write(xor_bits >> trailing, 64 - leading - trailing);
+      }
+    }
+    return writer.Bytes();
+  }
+
+ private:
+  // Appends the bits to the output, most significant first, zeroing the bytes as it goes.
+  class BitWriter final {
+   public:
+    explicit BitWriter(char* output) : output_(reinterpret_cast<uint8_t*>(output)) {}
+    void Write(uint64_t value, int bits) {
+      while (bits > 0) {
+        if (!(used_ & 7)) {
+          output_[used_ >> 3] = 0;
+        }
+        const int room = 8 - static_cast<int>(used_ & 7);
+        const int take = std::min(room, bits);
+        bits -= take;
+        const uint8_t chunk = static_cast<uint8_t>((value >> bits) & ((1u << take) - 1));
+        output_[used_ >> 3] |= static_cast<uint8_t>(chunk << (room - take));
+        used_ += take;
+      }
+    }
+    size_t Bytes() const { return (used_ + 7) >> 3; }
+
+   private:
+    uint8_t* const output_;
+    size_t used_ = 0;
+  };
+
+  static void PutBigEndian(uint64_t value, char* output) {
+    for (int i = 7; i >= 0; --i) {
+      output[i] = static_cast<char>(value & 0xff);
+      value >>= 8;
+    }
+  }
+
+  size_t count_ = 0;  // The number of points in the current block.
+  int64_t timestamp_ = 0;
+  int64_t delta_ = 0;
+  uint64_t bits_ = 0;
+  bool window_ = false;  // Whether `leading_` and `trailing_` hold the window of the previous XOR.
+  int leading_ = 0;
+  int trailing_ = 0;
+};
+
+class GorillaDecoder final {
+ public:
+  // Decodes the records in `data`, which may end and begin anywhere within a record, calling
+  // `f(timestamp, value)` for each point. Returns false on data that is not a valid stream, which
+  // must begin with a key record.
+  template <typename F>
+  bool Feed(const char* data, size_t size, F&& f) {
+    buffer_.append(data, size);
+    size_t offset = 0;
+    while (offset < buffer_.length()) {
+      const size_t length = Decode(offset, f);
+      if (length == kInvalid) {
+        buffer_.clear();
+        return false;
+      }
+      if (!length) {
+        break;
+      }
+      offset += length;
+    }
+    buffer_.erase(0, offset);
+    return true;
+  }
+
+ private:
+  enum : size_t { kInvalid = ~size_t(0) };
+
+  // Reads the bits of the buffer from the given offset, most significant first, failing past its end.
+  class BitReader final {
+   public:
+    BitReader(const std::string& buffer, size_t offset)
+        : data_(reinterpret_cast<const uint8_t*>(buffer.data()) + offset), size_(buffer.length() - offset) {}
+    bool Read(int bits, uint64_t& value) {
+      if (used_ + bits > size_ * 8) {
+        return false;
+      }
+      value = 0;
+      while (bits > 0) {
+        const int room = 8 - static_cast<int>(used_ & 7);
+        const int take = std::min(room, bits);
+        value = (value << take) | ((data_[used_ >> 3] >> (room - take)) & ((1u << take) - 1));
+        used_ += take;
+        bits -= take;
+      }
+      return true;
+    }
+    size_t Bytes() const { return (used_ + 7) >> 3; }
+
+   private:
+    const uint8_t* const data_;
+    const size_t size_;
+    size_t used_ = 0;
+  };
+
+  // Decodes the record at `offset`, returns its length, 0 if it is not complete yet, or `kInvalid`.
+  template <typename F>
+  size_t Decode(size_t offset, F&& f) {
+    BitReader reader(buffer_, offset);
+    uint64_t value = 0;
+    reader.Read(1, value);
+    if (value) {
+      uint64_t timestamp;
+      uint64_t bits;
+      if (!reader.Read(7, value) || !reader.Read(64, timestamp) || !reader.Read(64, bits)) {
+        return 0;
+      }
+      if (value) {
+        return kInvalid;
+      }
+      timestamp_ = static_cast<int64_t>(timestamp);
+      delta_ = 0;
+      bits_ = bits;
+      window_ = false;
+      key_ = true;
+      Emit(f);
+      return reader.Bytes();
+    }
+    if (!key_) {
+      return kInvalid;
+    }
+    // The delta of delta, with the prefix of up to four bits telling how many bits it takes.
+    static const int widths[] = {0, 7, 9, 12, 32};
+    static const int64_t offsets[] = {0, 63, 255, 2047, 2147483647};
+    size_t size = 0;
+    while (size < 4) {
+      if (!reader.Read(1, value)) {
+        return 0;
+      }
+      if (!value) {
+        break;
+      }
+      ++size;
+    }
+    uint64_t stored = 0;
+    if (size && !reader.Read(widths[size], stored)) {
+      return 0;
+    }
+    const int64_t delta_of_delta = static_cast<int64_t>(stored) - offsets[size];
+    // The XOR of the value.
+    bool window = window_;
+    int leading = leading_;
+    int trailing = trailing_;
+    uint64_t xor_bits = 0;
+    if (!reader.Read(1, value)) {
+      return 0;
+    }
+    if (value) {
+      if (!reader.Read(1, value)) {
+        return 0;
+      }
+      if (value) {
+        uint64_t leading_bits;
+        uint64_t length_bits;
+        if (!reader.Read(5, leading_bits) || !reader.Read(6, length_bits)) {
+          return 0;
+        }
+        leading = static_cast<int>(leading_bits);
+        trailing = 63 - leading - static_cast<int>(length_bits);
+        if (trailing < 0) {
+          return kInvalid;
+        }
+        window = true;
+      } else if (!window) {
+        return kInvalid;
+      }
+      if (!reader.Read(64 - leading - trailing, xor_bits)) {
+        return 0;
+      }
+      xor_bits <<= trailing;
+    }
+    delta_ = impl::WrappingAdd(delta_, delta_of_delta);
+    timestamp_ = impl::WrappingAdd(timestamp_, delta_);
+    bits_ ^= xor_bits;
+    window_ = window;
+    leading_ = leading;
+    trailing_ = trailing;
+    Emit(f);
+    return reader.Bytes();
+  }
+
+  template <typename F>
+  void Emit(F&& f) {
+    double value;
+    memcpy(&value, &bits_, sizeof(value));
+    f(timestamp_, value);
+  }
+
+  std::string buffer_;  // The beginning of the record not decoded yet.
+  bool key_ = false;  // Whether a key record has been seen.
+  int64_t timestamp_ = 0;
+  int64_t delta_ = 0;
+  uint64_t bits_ = 0;
+  bool window_ = false;
+  int leading_ = 0;
+  int trailing_ = 0;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_GORILLA_H
@@ -0,0 +1,105 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `HashRing`, which assigns the named datasets to the nodes sharing them by consistent hashing.
+//
+// Each node is placed on a ring of 64-bit hashes at `virtual_nodes` pseudo-random points, and a key belongs
+// to the node of the first point at or after the hash of the key, wrapping around. Adding a node to N nodes
+// only moves about 1/(N+1) of the keys, all of them to the new node. The nodes are sorted and deduplicated,
+// so all the nodes agree on the owners whatever order they were listed in.
+
+#ifndef DEMO_HASH_RING_H
+#define DEMO_HASH_RING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace demo {
+
+class HashRing final {
+ public:
+  explicit HashRing(std::vector<std::string> nodes = std::vector<std::string>(), size_t virtual_nodes = 160)
+      : nodes_(std::move(nodes)) {
+    std::sort(nodes_.begin(), nodes_.end());
+    nodes_.erase(std::unique(nodes_.begin(), nodes_.end()), nodes_.end());
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      for (size_t v = 0; v < virtual_nodes; ++v) {
+        points_.emplace_back(Hash(nodes_[i] + '#' + std::to_string(v)), i);
+      }
+    }
+    std::sort(points_.begin(), points_.end());
+  }
+
+  // Splits the comma-separated list of nodes, skipping the empty entries.
+  static HashRing FromList(const std::string& list) {
+    std::vector<std::string> nodes;
+    size_t begin = 0;
+    while (begin <= list.length()) {
+      size_t end = list.find(',', begin);
+      if (end == std::string::npos) {
+        end = list.length();
+      }
+      if (end > begin) {
+        nodes.push_back(list.substr(begin, end - begin));
+      }
+      begin = end + 1;
+    }
+    return HashRing(nodes);
+  }
+
+  bool Empty() const { return nodes_.empty(); }
+  const std::vector<std::string>& Nodes() const { return nodes_; }
+
+  // The ring must not be empty.
+  const std::string& Owner(const std::string& key) const {
+    const uint64_t hash = Hash(key);
+    auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash, static_cast<size_t>(0)));
+    if (it == points_.end()) {
+      it = points_.begin();
+    }
+    return nodes_[it->second];
+  }
+
+  // FNV-1a, finished off with the mixer of SplitMix64, since FNV alone spreads similar short strings poorly.
+  static uint64_t Hash(const std::string& key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+  }
+
+ private:
+  std::vector<std::string> nodes_;
+  std::vector<std::pair<uint64_t, size_t>> points_;  // The hash of each virtual node, and its node.
+};
+
+}  // namespace demo
+
+#endif  // DEMO_HASH_RING_H
@@ -0,0 +1,382 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `HTTPClientPool`, the HTTP/1.1 client `DemoServer` talks to the other nodes with.
+// It keeps the connection of each request open for the next request to the same host, so that a node
+// forwarding many small requests to another one does not open a new connection for each of them.
+//
+// A pooled connection may have been closed by the other side meanwhile, in which case the request is retried
+// once over a new connection, as long as no response to it has been received.
+//
+// `Pipeline()` sends many requests in one write and reads their responses in order, for the load benchmark
+// to measure the keep-alive port of `DemoServer` with.
+
+#ifndef DEMO_HTTP_CLIENT_POOL_H
+#define DEMO_HTTP_CLIENT_POOL_H
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace demo {
+
+struct PooledHTTPResponse {
+  int code = 0;
+  std::string content_type;  // Empty if the response has none.
+  std::string body;
+};
+
+// The request to `target`, the path with the query, on `host`, with the extra `headers` (each ending with
+// "\r\n") and the body, if any.
+inline std::string MakeHTTPRequest(const std::string& method,
+                                   const std::string& target,
+                                   const std::string& host,
+                                   const std::string& headers = "",
+                                   const std::string& body = "") {
+  std::string request = method + ' ' + target + " HTTP/1.1\r\nHost: " + host + "\r\n" + headers;
+  if (method == "POST" || !body.empty()) {
+    request += "Content-Length: " + std::to_string(body.length()) + "\r\n";
+  }
+  return request + "\r\n" + body;
+}
+
+class HTTPClientPool final {
+ public:
+  explicit HTTPClientPool(size_t max_idle_per_host = 8, int timeout_ms = 10000)
+      : max_idle_per_host_(max_idle_per_host), timeout_ms_(timeout_ms) {}
+
+  ~HTTPClientPool() {
+    for (const auto& host : idle_) {
+      for (int fd : host.second) {
+        close(fd);
+      }
+    }
+  }
+
+  // The `url` is "[http://]host[:port][/path[?query]]". Throws `std::runtime_error` if the request fails.
+  PooledHTTPResponse GET(const std::string& url) { return Send("GET", url, "", ""); }
+  PooledHTTPResponse POST(const std::string& url,
+                          const std::string& body = "",
+                          const std::string& content_type = "") {
+    return Send("POST", url, body, content_type);
+  }
+
+  // Sends the `count` requests made by `MakeHTTPRequest()` and concatenated in `requests` to `authority`,
+  // the "host[:port]", in one write over one connection, and returns their responses in order.
+  std::vector<PooledHTTPResponse> Pipeline(const std::string& authority,
+                                           const std::string& requests,
+                                           size_t count) {
+    return Exchange(authority, requests, count);
+  }
+
+  // The number of connections opened so far, fewer than the requests once these are reused.
+  uint64_t ConnectionsOpened() const { return opened_; }
+
+ private:
+  enum class Outcome { Done, Stale, Failed };
+
+  // The response is read through this, and only the connections it has read all of are reused.
+  struct Reader {
+    int fd;
+    std::string buffer;
+    size_t pos = 0;
+    bool closed = false;  // By the other side, as opposed to a timeout.
+
+    bool Fill() {
+      char data[1 << 14];
+      ssize_t n;
+      while ((n = read(fd, data, sizeof(data))) < 0 && errno == EINTR) {
+      }
+      if (n <= 0) {
+        closed = (n == 0 || errno == ECONNRESET);
+        return false;
+      }
+      buffer.append(data, n);
+      return true;
+    }
+
+    // The next line, without its "\r\n".
+    bool Line(std::string& line) {
+      size_t end;
+      while ((end = buffer.find("\r\n", pos)) == std::string::npos) {
+        if (!Fill()) {
+          return false;
+        }
+      }
+      line.assign(buffer, pos, end - pos);
+      pos = end + 2;
+      return true;
+    }
+
+    bool Bytes(size_t count, std::string& out) {
+      while (buffer.length() - pos < count) {
+        if (!Fill()) {
+          return false;
+        }
+      }
+      out.append(buffer, pos, count);
+      pos += count;
+      return true;
+    }
+  };
+
+  PooledHTTPResponse Send(const std::string& method,
+                          const std::string& url,
+                          const std::string& body,
+                          const std::string& content_type) {
+    const size_t begin = (url.compare(0, 7, "http://") == 0) ? 7 : 0;
+    const size_t slash = std::min(url.find('/', begin), url.length());
+    const std::string authority = url.substr(begin, slash - begin);
+    const std::string target = (slash < url.length()) ? url.substr(slash) : "/";
+    const std::string headers = content_type.empty() ? "" : "Content-Type: " + content_type + "\r\n";
+    return Exchange(authority, MakeHTTPRequest(method, target, authority, headers, body), 1).front();
+  }
+
+  std::vector<PooledHTTPResponse> Exchange(const std::string& authority,
+                                           const std::string& request,
+                                           size_t count) {
+    const size_t colon = authority.rfind(':');
+    const std::string host = authority.substr(0, colon);
+    const std::string port = (colon != std::string::npos) ? authority.substr(colon + 1) : "80";
+    const std::string key = host + ':' + port;
+    for (bool retry = true;; retry = false) {
+      int fd = TakeIdle(key);
+      const bool pooled = (fd >= 0);
+      if (!pooled) {
+        fd = Connect(host, port);
+      }
+      std::vector<PooledHTTPResponse> responses(count);
+      bool reusable = false;
+      const Outcome outcome = Exchange(fd, request, responses, reusable);
+      if (outcome == Outcome::Done) {
+        if (reusable) {
+          PutIdle(key, fd);
+        } else {
+          close(fd);
+        }
+        return responses;
+      }
+      close(fd);
+      if (!(outcome == Outcome::Stale && pooled && retry)) {
+        throw std::runtime_error("The request to " + key + " has failed.");
+      }
+    }
+  }
+
+  // Sends `request`, and reads as many responses as there are in `responses`, one after another.
+  Outcome Exchange(int fd,
+                   const std::string& request,
+                   std::vector<PooledHTTPResponse>& responses,
+                   bool& reusable) {
+    for (size_t sent = 0; sent < request.length();) {
+      const ssize_t n = send(fd, request.data() + sent, request.length() - sent, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return (sent || errno == EAGAIN) ? Outcome::Failed : Outcome::Stale;
+      }
+      sent += n;
+    }
+    Reader reader;
+    reader.fd = fd;
+    bool keep_alive = true;
+    for (PooledHTTPResponse& response : responses) {
+      if (!keep_alive) {
+        return Outcome::Failed;
+      }
+      const Outcome outcome = ReadResponse(reader, response, keep_alive);
+      if (outcome != Outcome::Done) {
+        return outcome;
+      }
+    }
+    reusable = keep_alive && reader.pos == reader.buffer.length();
+    return Outcome::Done;
+  }
+
+  Outcome ReadResponse(Reader& reader, PooledHTTPResponse& response, bool& keep_alive) {
+    std::string line;
+    if (!reader.Line(line)) {
+      // A timeout is not retried, the server may have got the request.
+      return (reader.buffer.empty() && reader.closed) ? Outcome::Stale : Outcome::Failed;
+    }
+    // "HTTP/1.1 200 OK".
+    if (line.compare(0, 5, "HTTP/") || line.length() < 12) {
+      return Outcome::Failed;
+    }
+    response.code = atoi(line.c_str() + 9);
+    keep_alive = (line.compare(0, 8, "HTTP/1.0") != 0);
+    bool chunked = false;
+    long long content_length = -1;
+    while (true) {
+      if (!reader.Line(line)) {
+        return Outcome::Failed;
+      }
+      if (line.empty()) {
+        break;
+      }
+      const size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = line.substr(0, colon);
+      for (char& c : name) {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+      }
+      const size_t value_begin = line.find_first_not_of(" \t", colon + 1);
+      if (name == "content-type" && value_begin != std::string::npos) {
+        response.content_type = line.substr(value_begin);
+      }
+      std::string value = line.substr(colon + 1);
+      for (char& c : value) {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+      }
+      if (name == "content-length") {
+        content_length = atoll(value.c_str());
+      } else if (name == "transfer-encoding") {
+        chunked = (value.find("chunked") != std::string::npos);
+      } else if (name == "connection") {
+        if (value.find("close") != std::string::npos) {
+          keep_alive = false;
+        } else if (value.find("keep-alive") != std::string::npos) {
+          keep_alive = true;
+        }
+      }
+    }
+    if (response.code == 204 || response.code == 304 || response.code / 100 == 1) {
+      content_length = 0;
+    }
+    if (chunked) {
+      while (true) {
+        if (!reader.Line(line)) {
+          return Outcome::Failed;
+        }
+        const size_t size = strtoul(line.c_str(), nullptr, 16);
+        if (!size) {
+          // The trailers, if any, up to the empty line.
+          while (reader.Line(line) && !line.empty()) {
+          }
+          break;
+        }
+        if (!reader.Bytes(size, response.body) || !reader.Line(line)) {
+          return Outcome::Failed;
+        }
+      }
+    } else if (content_length >= 0) {
+      if (!reader.Bytes(static_cast<size_t>(content_length), response.body)) {
+        return Outcome::Failed;
+      }
+    } else {
+      // Neither the length nor the chunks, so the response lasts until the connection is closed.
+      do {
+        response.body.append(reader.buffer, reader.pos, std::string::npos);
+        reader.pos = reader.buffer.length();
+      } while (reader.Fill());
+      keep_alive = false;
+    }
+    return Outcome::Done;
+  }
+
+  int Connect(const std::string& host, const std::string& port) {
+    addrinfo hints = addrinfo();
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses)) {
+      throw std::runtime_error("Can not resolve " + host + '.');
+    }
+    int fd = -1;
+    for (const addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen)) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+      throw std::runtime_error("Can not connect to " + host + ':' + port + '.');
+    }
+    const int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    timeval timeout;
+    timeout.tv_sec = timeout_ms_ / 1000;
+    timeout.tv_usec = (timeout_ms_ % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ++opened_;
+    return fd;
+  }
+
+  int TakeIdle(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<int>& fds = idle_[key];
+    if (fds.empty()) {
+      return -1;
+    }
+    const int fd = fds.back();
+    fds.pop_back();
+    return fd;
+  }
+
+  void PutIdle(const std::string& key, int fd) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::vector<int>& fds = idle_[key];
+      if (fds.size() < max_idle_per_host_) {
+        fds.push_back(fd);
+        return;
+      }
+    }
+    close(fd);
+  }
+
+  const size_t max_idle_per_host_;
+  const int timeout_ms_;
+  std::mutex mutex_;
+  std::map<std::string, std::vector<int>> idle_;  // Guarded by `mutex_`. Keyed by "host:port".
+  std::atomic<uint64_t> opened_{0};
+
+  HTTPClientPool(const HTTPClientPool&) = delete;
+  void operator=(const HTTPClientPool&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_HTTP_CLIENT_POOL_H
@@ -0,0 +1,249 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Parsers for bulk uploads of points: newline-delimited JSON and a packed little-endian binary array.
+//
+// Both parsers walk the body in place and hand the points over in fixed-size batches, so that parsing
+// a body of any size makes no per-point allocations, and the store is locked once per batch.
+//
+// The NDJSON format is one `{"x":0.25,"y":-0.25,"label":true}` object per line, with the fields in any order.
+// The binary format is a sequence of 17-byte records: little-endian IEEE 754 `double x`, `double y`,
+// followed by one `uint8_t label`, which must be 0 or 1.
+
+#ifndef DEMO_INGEST_H
+#define DEMO_INGEST_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "../Bricks/cerealize/cerealize.h"
+
+#include "point.h"
+
+namespace demo {
+
+struct IngestResult {
+  size_t accepted = 0;
+  size_t rejected = 0;
+  template <typename A>
+  void save(A& ar) const {
+    ar(CEREAL_NVP(accepted), CEREAL_NVP(rejected));
+  }
+};
+
+enum { kBinaryPointRecordSize = 17 };
+
+namespace impl {
+
+// Collects the parsed points and passes them on to `add(const Point* begin, const Point* end)` in batches.
+template <typename F>
+class PointBatcher final {
+ public:
+  explicit PointBatcher(F& add) : add_(add) {}
+  void operator()(const Point& point) {
+    batch_[size_++] = point;
+    if (size_ == kBatchSize) {
+      Flush();
+    }
+  }
+  void Flush() {
+    if (size_) {
+      add_(batch_, batch_ + size_);
+      size_ = 0;
+    }
+  }
+
+ private:
+  enum { kBatchSize = 256 };
+  F& add_;
+  Point batch_[kBatchSize];
+  size_t size_ = 0;
+};
+
+inline const char* SkipWhitespace(const char* p, const char* end) {
+  while (p != end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+    ++p;
+  }
+  return p;
+}
+
+// Parses one `{"x":...,"y":...,"label":...}` object spanning exactly `[p, end)`.
+// Relies on `*end` being a non-numeric character, which holds for the newline or the terminating zero.
+inline bool ParseJSONPoint(const char* p, const char* end, Point& point) {
+  bool has_x = false, has_y = false, has_label = false;
+  p = SkipWhitespace(p, end);
+  if (p == end || *p++ != '{') {
+    return false;
+  }
+  while (true) {
+    p = SkipWhitespace(p, end);
+    if (p == end || *p++ != '"') {
+      return false;
+    }
+    const char* key = p;
+    while (p != end && *p != '"') {
+      ++p;
+    }
+    if (p == end) {
+      return false;
+    }
+    const size_t key_length = p++ - key;
+    p = SkipWhitespace(p, end);
+    if (p == end || *p++ != ':') {
+      return false;
+    }
+    p = SkipWhitespace(p, end);
+    if (key_length == 5 && !memcmp(key, "label", 5)) {
+      if (end - p >= 4 && !memcmp(p, "true", 4)) {
+        point.label = true;
+        p += 4;
+      } else if (end - p >= 5 && !memcmp(p, "false", 5)) {
+        point.label = false;
+        p += 5;
+      } else if (p != end && (*p == '0' || *p == '1')) {
+        point.label = (*p++ == '1');
+      } else {
+        return false;
+      }
+      has_label = true;
+    } else if (key_length == 1 && (*key == 'x' || *key == 'y')) {
+      char* number_end;
+      const double value = strtod(p, &number_end);
+      if (number_end == p || number_end > end || !std::isfinite(value)) {
+        return false;
+      }
+      p = number_end;
+      if (*key == 'x') {
+        point.x = value;
+        has_x = true;
+      } else {
+        point.y = value;
+        has_y = true;
+      }
+    } else {
+      return false;
+    }
+    p = SkipWhitespace(p, end);
+    if (p == end) {
+      return false;
+    }
+    if (*p == '}') {
+      return SkipWhitespace(p + 1, end) == end && has_x && has_y && has_label;
+    }
+    if (*p++ != ',') {
+      return false;
+    }
+  }
+}
+
+inline double DecodeLittleEndianDouble(const unsigned char* p) {
+  uint64_t bits = 0;
+  for (int i = 7; i >= 0; --i) {
+    bits = (bits << 8) | p[i];
+  }
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+}  // namespace impl
+
+// Parses `body` as newline-delimited JSON points. Empty lines are skipped, malformed ones are rejected.
+template <typename F>
+IngestResult ParseNDJSONPoints(const std::string& body, F&& add) {
+  IngestResult result;
+  impl::PointBatcher<F> batcher(add);
+  const char* p = body.c_str();
+  const char* const end = p + body.length();
+  while (p < end) {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (!eol) {
+      eol = end;
+    }
+    if (impl::SkipWhitespace(p, eol) != eol) {
+      Point point;
+      if (impl::ParseJSONPoint(p, eol, point)) {
+        batcher(point);
+        ++result.accepted;
+      } else {
+        ++result.rejected;
+      }
+    }
+    p = eol + 1;
+  }
+  batcher.Flush();
+  return result;
+}
+
+// Parses `length` bytes at `data` as packed binary point records.
+// A trailing incomplete record counts as one rejected point.
+template <typename F>
+IngestResult ParseBinaryPoints(const char* data, size_t length, F&& add) {
+  IngestResult result;
+  impl::PointBatcher<F> batcher(add);
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  const size_t records = length / kBinaryPointRecordSize;
+  for (size_t i = 0; i < records; ++i, p += kBinaryPointRecordSize) {
+    const Point point(impl::DecodeLittleEndianDouble(p), impl::DecodeLittleEndianDouble(p + 8), p[16] == 1);
+    if (p[16] <= 1 && std::isfinite(point.x) && std::isfinite(point.y)) {
+      batcher(point);
+      ++result.accepted;
+    } else {
+      ++result.rejected;
+    }
+  }
+  batcher.Flush();
+  if (length % kBinaryPointRecordSize) {
+    ++result.rejected;
+  }
+  return result;
+}
+
+template <typename F>
+IngestResult ParseBinaryPoints(const std::string& body, F&& add) {
+  return ParseBinaryPoints(body.data(), body.length(), std::forward<F>(add));
+}
+
+// Appends the binary record of `point` to `output`, the inverse of what `ParseBinaryPoints()` reads.
+inline void AppendBinaryPoint(const Point& point, std::string& output) {
+  unsigned char record[kBinaryPointRecordSize];
+  const double values[2] = {point.x, point.y};
+  for (int j = 0; j < 2; ++j) {
+    uint64_t bits;
+    memcpy(&bits, &values[j], sizeof(bits));
+    for (int i = 0; i < 8; ++i, bits >>= 8) {
+      record[j * 8 + i] = static_cast<unsigned char>(bits & 0xff);
+    }
+  }
+  record[16] = point.label ? 1 : 0;
+  output.append(reinterpret_cast<const char*>(record), kBinaryPointRecordSize);
+}
+
+}  // namespace demo
+
+#endif  // DEMO_INGEST_H
@@ -0,0 +1,449 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `KeepAliveServer`, which serves the small requests of `DemoServer` over persistent HTTP/1.1
+// connections, so that a client sending many of them does not pay for a new connection each time.
+//
+// One thread polls the listening socket and all the connections. Whatever a connection has sent is parsed
+// into as many complete requests as there are, a client may send the next ones without waiting for the
+// responses to the previous ones, and the responses to all of them are sent in order with a single write.
+// The handlers run on the polling thread, so they should be quick, and are not for streaming responses.
+//
+// A connection is closed once asked for via `Connection: close`, after a malformed request, or once it has
+// been idle for a while.
+
+#ifndef DEMO_KEEP_ALIVE_H
+#define DEMO_KEEP_ALIVE_H
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace demo {
+
+struct KeepAliveRequest {
+  std::string method;
+  std::string path;
+  std::map<std::string, std::string> query;  // Percent-decoded.
+  std::string body;
+};
+
+struct KeepAliveResponse {
+  int code = 200;
+  std::string content_type = "text/plain";
+  std::string body;
+};
+
+namespace impl {
+
+// Whether `name` is `expected`, which is in lowercase, ignoring the case of `name`.
+inline bool IsHeaderName(const char* name, size_t length, const char* expected) {
+  for (size_t i = 0; i < length; ++i) {
+    if (!expected[i] || tolower(static_cast<unsigned char>(name[i])) != expected[i]) {
+      return false;
+    }
+  }
+  return !expected[length];
+}
+
+inline bool HasToken(const std::string& value, const char* token) {
+  std::string lowercase(value);
+  for (char& c : lowercase) {
+    c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+  }
+  return lowercase.find(token) != std::string::npos;
+}
+
+inline std::string DecodeURIComponent(const char* begin, const char* end) {
+  std::string result;
+  result.reserve(end - begin);
+  for (const char* p = begin; p < end; ++p) {
+    if (*p == '+') {
+      result += ' ';
+    } else if (*p == '%' && end - p > 2 && isxdigit(static_cast<unsigned char>(p[1])) &&
+               isxdigit(static_cast<unsigned char>(p[2]))) {
+      const char hex[3] = {p[1], p[2], '\0'};
+      result += static_cast<char>(strtol(hex, nullptr, 16));
+      p += 2;
+    } else {
+      result += *p;
+    }
+  }
+  return result;
+}
+
+inline void ParseQuery(const char* begin, const char* end, std::map<std::string, std::string>& query) {
+  while (begin < end) {
+    const char* amp = std::find(begin, end, '&');
+    const char* eq = std::find(begin, amp, '=');
+    if (eq != begin) {
+      query[DecodeURIComponent(begin, eq)] = (eq < amp) ? DecodeURIComponent(eq + 1, amp) : std::string();
+    }
+    begin = (amp < end) ? amp + 1 : end;
+  }
+}
+
+inline const char* ReasonPhrase(int code) {
+  switch (code) {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 413:
+      return "Request Entity Too Large";
+    case 500:
+      return "Internal Server Error";
+    case 501:
+      return "Not Implemented";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Unknown";
+  }
+}
+
+inline void AppendResponse(const KeepAliveResponse& response, bool close, std::string& out) {
+  out += "HTTP/1.1 ";
+  out += std::to_string(response.code);
+  out += ' ';
+  out += ReasonPhrase(response.code);
+  out += "\r\nContent-Type: ";
+  out += response.content_type;
+  out += "\r\nContent-Length: ";
+  out += std::to_string(response.body.length());
+  out += close ? "\r\nConnection: close\r\n\r\n" : "\r\n\r\n";
+  out += response.body;
+}
+
+}  // namespace impl
+
+class KeepAliveServer final {
+ public:
+  typedef std::function<void(const KeepAliveRequest&, KeepAliveResponse&)> Handler;
+
+  enum { kMaxRequestLength = 1 << 16, kMaxConnections = 1024, kIdleTimeoutSeconds = 30 };
+
+  // Listens on `port`, or on any free port for 0, and serves the `routes`, keyed by path.
+  // Should the port be taken, logs it and serves nothing, see `Port()`.
+  KeepAliveServer(int port, std::map<std::string, Handler> routes) : routes_(std::move(routes)) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    const int yes = 1;
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    socklen_t length = sizeof(address);
+    if (listen_fd_ < 0 || setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) ||
+        bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) || listen(listen_fd_, 1024) ||
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address), &length) || pipe(wake_)) {
+      std::cerr << "Can not listen on port " << port << ": " << strerror(errno) << std::endl;
+      if (listen_fd_ >= 0) {
+        close(listen_fd_);
+      }
+      return;
+    }
+    SetNonBlocking(listen_fd_);
+    port_ = ntohs(address.sin_port);
+    thread_ = std::thread(&KeepAliveServer::Loop, this);
+  }
+
+  ~KeepAliveServer() {
+    if (thread_.joinable()) {
+      const char stop = 0;
+      while (write(wake_[1], &stop, 1) < 0 && errno == EINTR) {
+      }
+      thread_.join();
+      for (const Connection& connection : connections_) {
+        close(connection.fd);
+      }
+      close(listen_fd_);
+      close(wake_[0]);
+      close(wake_[1]);
+    }
+  }
+
+  // The port listened on, zero if none.
+  int Port() const { return port_; }
+
+  uint64_t RequestsCount() const { return requests_; }
+  // The number of writes the responses took, fewer than the requests once these are pipelined.
+  uint64_t WritesCount() const { return writes_; }
+  uint64_t AcceptedCount() const { return accepted_; }
+  size_t ConnectionsCount() const { return connections_count_; }
+
+ private:
+  struct Connection {
+    int fd;
+    std::string in;  // Received, not parsed yet.
+    std::string out;  // The responses yet to be sent, from `sent` on.
+    size_t sent = 0;
+    bool close = false;  // Once `out` is sent.
+    std::chrono::steady_clock::time_point active;
+  };
+
+  static void SetNonBlocking(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK); }
+
+  void Loop() {
+    const std::chrono::seconds idle_timeout(kIdleTimeoutSeconds);
+    std::vector<pollfd> fds;
+    while (true) {
+      fds.clear();
+      fds.push_back(pollfd{wake_[0], POLLIN, 0});
+      // Past `kMaxConnections`, the new connections wait in the backlog of the listening socket.
+      const bool accepting = (connections_.size() < kMaxConnections);
+      fds.push_back(pollfd{listen_fd_, static_cast<short>(accepting ? POLLIN : 0), 0});
+      for (const Connection& connection : connections_) {
+        fds.push_back(pollfd{connection.fd, static_cast<short>(connection.out.empty() ? POLLIN : POLLOUT), 0});
+      }
+      if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+        std::cerr << "Can not poll: " << strerror(errno) << std::endl;
+        return;
+      }
+      if (fds[0].revents) {
+        return;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      // Backwards, so that a closed connection is replaced by one already taken care of, or just accepted.
+      for (size_t i = fds.size() - 2; i-- > 0;) {
+        Connection& connection = connections_[i];
+        const short events = fds[i + 2].revents;
+        bool keep = true;
+        if (events) {
+          connection.active = now;
+          keep = (events & POLLOUT) ? Flush(connection) : Receive(connection);
+        } else if (connection.out.empty() && now - connection.active > idle_timeout) {
+          keep = false;
+        }
+        if (!keep) {
+          close(connection.fd);
+          connections_[i] = std::move(connections_.back());
+          connections_.pop_back();
+        }
+      }
+      if (fds[1].revents & POLLIN) {
+        Accept(now);
+      }
+      connections_count_ = connections_.size();
+    }
+  }
+
+  void Accept(std::chrono::steady_clock::time_point now) {
+    int fd;
+    while (connections_.size() < kMaxConnections && (fd = accept(listen_fd_, nullptr, nullptr)) >= 0) {
+      SetNonBlocking(fd);
+      // The responses are written whole, so there is nothing to gain from waiting for more of them.
+      const int yes = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+      connections_.emplace_back();
+      connections_.back().fd = fd;
+      connections_.back().active = now;
+      ++accepted_;
+    }
+  }
+
+  // Reads what has arrived, handles all the complete requests, and sends their responses.
+  // Returns false once the connection is to be closed.
+  bool Receive(Connection& connection) {
+    char buffer[1 << 14];
+    while (true) {
+      const ssize_t n = read(connection.fd, buffer, sizeof(buffer));
+      if (n > 0) {
+        connection.in.append(buffer, n);
+        if (static_cast<size_t>(n) < sizeof(buffer)) {
+          break;
+        }
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      } else {
+        return false;
+      }
+    }
+    size_t offset = 0;
+    size_t length;
+    while (!connection.close && (length = HandleOne(connection, offset))) {
+      offset += length;
+    }
+    connection.in.erase(0, offset);
+    if (!connection.close && connection.in.length() > kMaxRequestLength) {
+      KeepAliveResponse response;
+      response.code = 413;
+      response.body = "Request too large.\n";
+      impl::AppendResponse(response, true, connection.out);
+      connection.close = true;
+    }
+    if (connection.close) {
+      connection.in.clear();
+    }
+    return Flush(connection);
+  }
+
+  // Handles the request at `offset` of the received data, returns its length, or zero if it is incomplete.
+  size_t HandleOne(Connection& connection, size_t offset) {
+    const std::string& in = connection.in;
+    const size_t headers_end = in.find("\r\n\r\n", offset);
+    if (headers_end == std::string::npos) {
+      return 0;
+    }
+    const char* p = in.data() + offset;
+    const char* const end = in.data() + headers_end;
+    const char* line_end = std::search(p, end + 2, "\r\n", "\r\n" + 2);
+    const char* space1 = std::find(p, line_end, ' ');
+    const char* space2 = std::find(std::min(space1 + 1, line_end), line_end, ' ');
+    KeepAliveRequest request;
+    KeepAliveResponse response;
+    if (space1 == line_end || space2 == line_end) {
+      response.code = 400;
+      response.body = "Malformed request.\n";
+      impl::AppendResponse(response, true, connection.out);
+      connection.close = true;
+      return headers_end + 4 - offset;
+    }
+    request.method.assign(p, space1);
+    const char* question = std::find(space1 + 1, space2, '?');
+    request.path.assign(space1 + 1, question);
+    if (question < space2) {
+      impl::ParseQuery(question + 1, space2, request.query);
+    }
+    const std::string version(space2 + 1, line_end);
+    bool keep_alive = (version == "HTTP/1.1");
+    size_t content_length = 0;
+    bool chunked = false;
+    for (p = line_end + 2; p < end; p = line_end + 2) {
+      line_end = std::search(p, end + 2, "\r\n", "\r\n" + 2);
+      const char* colon = std::find(p, line_end, ':');
+      if (colon == line_end) {
+        continue;
+      }
+      const char* value = colon + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t')) {
+        ++value;
+      }
+      if (impl::IsHeaderName(p, colon - p, "content-length")) {
+        content_length = strtoull(value, nullptr, 10);
+      } else if (impl::IsHeaderName(p, colon - p, "transfer-encoding")) {
+        chunked = true;
+      } else if (impl::IsHeaderName(p, colon - p, "connection")) {
+        const std::string connection_header(value, line_end);
+        if (impl::HasToken(connection_header, "close")) {
+          keep_alive = false;
+        } else if (impl::HasToken(connection_header, "keep-alive")) {
+          keep_alive = true;
+        }
+      }
+    }
+    const size_t body_begin = headers_end + 4;
+    if (chunked || content_length > kMaxRequestLength) {
+      response.code = chunked ? 501 : 413;
+      response.body = chunked ? "Chunked requests are not supported here.\n" : "Request too large.\n";
+      impl::AppendResponse(response, true, connection.out);
+      connection.close = true;
+      return in.length() - offset;
+    }
+    if (in.length() < body_begin + content_length) {
+      return 0;
+    }
+    request.body.assign(in, body_begin, content_length);
+    const auto route = routes_.find(request.path);
+    if (route == routes_.end()) {
+      response.code = 404;
+      response.body = "<h1>NOT FOUND</h1>\n";
+    } else {
+      try {
+        route->second(request, response);
+      } catch (const std::exception& e) {
+        std::cerr << "Unhandled exception for " << request.path << ": " << e.what() << std::endl;
+        response = KeepAliveResponse();
+        response.code = 500;
+        response.body = "<h1>INTERNAL SERVER ERROR</h1>\n";
+      }
+    }
+    ++requests_;
+    impl::AppendResponse(response, !keep_alive, connection.out);
+    connection.close = !keep_alive;
+    return body_begin + content_length - offset;
+  }
+
+  // Sends as much of the pending responses as the connection takes, in one write.
+  // Returns false once the connection is to be closed.
+  bool Flush(Connection& connection) {
+    if (connection.out.empty()) {
+      return !connection.close;
+    }
+    const ssize_t n =
+        send(connection.fd, connection.out.data() + connection.sent, connection.out.length() - connection.sent,
+             MSG_NOSIGNAL);
+    ++writes_;
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    connection.sent += n;
+    if (connection.sent == connection.out.length()) {
+      connection.out.clear();
+      connection.sent = 0;
+      return !connection.close;
+    }
+    return true;
+  }
+
+  const std::map<std::string, Handler> routes_;
+  int listen_fd_ = -1;
+  int port_ = 0;
+  int wake_[2] = {-1, -1};  // Written to by the destructor to stop the polling thread.
+  std::vector<Connection> connections_;  // Only used by the polling thread.
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> writes_{0};
+  std::atomic<uint64_t> accepted_{0};
+  std::atomic_size_t connections_count_{0};
+  std::thread thread_;
+
+  KeepAliveServer(const KeepAliveServer&) = delete;
+  void operator=(const KeepAliveServer&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_KEEP_ALIVE_H
@@ -0,0 +1,445 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `Metrics`, the per-route request instrumentation exported at `/metrics`.
+//
+// Each route has request, error, request and response byte counters, and counters of the responses by the class
+// of their code, and a log-linear latency histogram in the spirit
+// of HdrHistogram: eight linear sub-buckets per power of two of nanoseconds, which keeps the relative error
+// within 12.5% from nanoseconds to minutes in a few hundred buckets. All of these are striped across threads,
+// the same way `PointStore` shards are, so recording a request is a handful of relaxed atomic increments
+// on a cache line that is, most of the time, owned by the current thread only. The stripes are summed
+// when the metrics are scraped.
+//
+// The handlers send their responses via `Respond()`, which records the code and the size of the response for
+// the instrumented handler running on the same thread.
+//
+// The gauges are callbacks evaluated at scrape time. `Render()` produces the Prometheus text format.
+
+#ifndef DEMO_METRICS_H
+#define DEMO_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../Bricks/cerealize/cerealize.h"
+#include "../Bricks/net/api/api.h"
+#include "../Bricks/net/http/codes.h"
+
+#include "number_format.h"
+
+namespace demo {
+
+// The bucket layout of the latency histograms, in nanoseconds.
+struct LatencyBuckets {
+  enum { kSubBucketBits = 3, kSubBuckets = 1 << kSubBucketBits, kMaxExponent = 40 };
+  enum { kCount = (kMaxExponent - kSubBucketBits + 2) * kSubBuckets };
+
+  static size_t Index(uint64_t ns) {
+    if (ns < kSubBuckets) {
+      return static_cast<size_t>(ns);
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > kMaxExponent) {
+      return kCount - 1;
+    }
+    const uint64_t mantissa = ns >> (exponent - kSubBucketBits);  // In `[kSubBuckets, 2 * kSubBuckets)`.
+    return static_cast<size_t>((exponent - kSubBucketBits + 1) * kSubBuckets + (mantissa - kSubBuckets));
+  }
+
+  // The smallest value that goes into the next bucket.
+  static uint64_t UpperBound(size_t index) {
+    if (index < kSubBuckets) {
+      return index + 1;
+    }
+    const size_t exponent = index / kSubBuckets + kSubBucketBits - 1;
+    const uint64_t mantissa = index % kSubBuckets + kSubBuckets;
+    return (mantissa + 1) << (exponent - kSubBucketBits);
+  }
+};
+
+// The index of the class of the response code among the response counters, 0 for no or an invalid code.
+inline size_t ResponseClass(int code) {
+  return (code >= 100 && code < 600) ? static_cast<size_t>(code / 100) : 0;
+}
+
+// The totals of one route, summed over the stripes.
+struct RouteStats {
+  enum { kResponseClasses = 6 };
+  uint64_t requests = 0;
+  uint64_t errors = 0;  // The responses with a 4xx or 5xx code, and the requests not responded to.
+  uint64_t request_bytes = 0;
+  uint64_t response_bytes = 0;
+  uint64_t responses[kResponseClasses] = {0, 0, 0, 0, 0, 0};  // By `ResponseClass()`.
+  uint64_t latency_sum_ns = 0;
+  std::vector<uint64_t> latency_buckets = std::vector<uint64_t>(LatencyBuckets::kCount);
+
+  // The upper bound of the bucket the `q`-th quantile of the latency falls into, in nanoseconds.
+  uint64_t LatencyQuantile(double q) const {
+    const uint64_t rank = static_cast<uint64_t>(q * requests);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < latency_buckets.size(); ++i) {
+      seen += latency_buckets[i];
+      if (seen > rank) {
+        return LatencyBuckets::UpperBound(i);
+      }
+    }
+    return requests ? LatencyBuckets::UpperBound(latency_buckets.size() - 1) : 0;
+  }
+};
+
+class RouteMetrics final {
+ public:
+  explicit RouteMetrics(size_t stripes = std::thread::hardware_concurrency()) {
+    stripes_.resize(std::max(stripes, static_cast<size_t>(1)));
+    for (auto& stripe : stripes_) {
+      stripe.reset(new Stripe());
+    }
+  }
+
+  // Records a request responded to with the HTTP `code`, 0 if it was not responded to.
+  void Record(uint64_t latency_ns, uint64_t request_bytes, int code, uint64_t response_bytes = 0) {
+    Stripe& stripe = CurrentThreadStripe();
+    stripe.requests.fetch_add(1, std::memory_order_relaxed);
+    stripe.latency_sum_ns.fetch_add(latency_ns, std::memory_order_relaxed);
+    stripe.latency_buckets[LatencyBuckets::Index(latency_ns)].fetch_add(1, std::memory_order_relaxed);
+    stripe.responses[ResponseClass(code)].fetch_add(1, std::memory_order_relaxed);
+    if (request_bytes) {
+      stripe.request_bytes.fetch_add(request_bytes, std::memory_order_relaxed);
+    }
+    if (response_bytes) {
+      stripe.response_bytes.fetch_add(response_bytes, std::memory_order_relaxed);
+    }
+  }
+
+  RouteStats Stats() const {
+    RouteStats stats;
+    for (const auto& stripe : stripes_) {
+      stats.requests += stripe->requests.load(std::memory_order_relaxed);
+      stats.request_bytes += stripe->request_bytes.load(std::memory_order_relaxed);
+      stats.response_bytes += stripe->response_bytes.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < RouteStats::kResponseClasses; ++i) {
+        stats.responses[i] += stripe->responses[i].load(std::memory_order_relaxed);
+      }
+      stats.latency_sum_ns += stripe->latency_sum_ns.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < LatencyBuckets::kCount; ++i) {
+        stats.latency_buckets[i] += stripe->latency_buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+    stats.errors = stats.responses[0] + stats.responses[4] + stats.responses[5];
+    return stats;
+  }
+
+ private:
+  struct Stripe {
+    char padding[64];  // Keeps the counters of different stripes on different cache lines.
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> request_bytes{0};
+    std::atomic<uint64_t> response_bytes{0};
+    std::atomic<uint64_t> latency_sum_ns{0};
+    std::atomic<uint64_t> responses[RouteStats::kResponseClasses];
+    std::atomic<uint64_t> latency_buckets[LatencyBuckets::kCount];
+    Stripe() {
+      for (auto& count : responses) {
+        count.store(0, std::memory_order_relaxed);
+      }
+      for (auto& bucket : latency_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  Stripe& CurrentThreadStripe() {
+    static std::atomic_size_t next_thread_index(0);
+    thread_local const size_t thread_index = next_thread_index++;
+    return *stripes_[thread_index % stripes_.size()];
+  }
+
+  std::vector<std::unique_ptr<Stripe>> stripes_;
+};
+
+// The code and the body size of the response sent to the request being handled on this thread.
+struct ResponseRecord {
+  int code = 0;
+  uint64_t bytes = 0;
+
+  // The record of the instrumented handler running on this thread, null outside of them.
+  static ResponseRecord*& Current() {
+    static thread_local ResponseRecord* current = nullptr;
+    return current;
+  }
+
+  // Records the response, or, with `code` of 0, more of the chunks of its body.
+  static void Sent(int code, uint64_t bytes) {
+    if (ResponseRecord* record = Current()) {
+      if (code) {
+        record->code = code;
+      }
+      record->bytes += bytes;
+    }
+  }
+};
+
+// Records the request into `metrics` once destroyed, with the response sent meanwhile on this thread.
+// Unless `Returned()` is called, as when the handler has thrown, the request is recorded as a 500.
+class RequestRecorder final {
+ public:
+  RequestRecorder(RouteMetrics& metrics, const bricks::net::api::Request& r)
+      : metrics_(metrics),
+        begin_(std::chrono::steady_clock::now()),
+        request_bytes_(r.http.HasBody() ? r.http.Body().length() : 0),
+        previous_(ResponseRecord::Current()) {
+    ResponseRecord::Current() = &response_;
+  }
+
+  void Returned() { returned_ = true; }
+
+  ~RequestRecorder() {
+    ResponseRecord::Current() = previous_;
+    metrics_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - begin_).count(),
+                    request_bytes_,
+                    returned_ ? response_.code : 500,
+                    response_.bytes);
+  }
+
+ private:
+  RouteMetrics& metrics_;
+  const std::chrono::steady_clock::time_point begin_;
+  const uint64_t request_bytes_;
+  ResponseRecord* const previous_;
+  ResponseRecord response_;
+  bool returned_ = false;
+
+  RequestRecorder(const RequestRecorder&) = delete;
+  void operator=(const RequestRecorder&) = delete;
+};
+
+// Sends the response via `r.connection` the same way `SendHTTPResponse()` does, recording it for `/metrics`.
+inline void Respond(bricks::net::api::Request& r, const std::string& body) {
+  ResponseRecord::Sent(static_cast<int>(bricks::net::HTTPResponseCode::OK), body.length());
+  r.connection.SendHTTPResponse(body);
+}
+
+template <typename... A>
+void Respond(bricks::net::api::Request& r,
+             const std::string& body,
+             bricks::net::HTTPResponseCode code,
+             A&&... content_type_and_headers) {
+  ResponseRecord::Sent(static_cast<int>(code), body.length());
+  r.connection.SendHTTPResponse(body, code, std::forward<A>(content_type_and_headers)...);
+}
+
+// The object as JSON, as `SendHTTPResponse(object, name)` sends it.
+template <typename T>
+void Respond(bricks::net::api::Request& r, const T& object, const std::string& name) {
+  Respond(r,
+          bricks::cerealize::JSON(object, name) + '\n',
+          bricks::net::HTTPResponseCode::OK,
+          "application/json; charset=utf-8",
+          bricks::net::HTTPHeaders{{"Access-Control-Allow-Origin", "*"}});
+}
+
+// Starts the chunked response. Only the code is recorded, the chunks are recorded via `RespondChunk()`.
+template <typename... A>
+bricks::net::HTTPServerConnection::ChunkedResponseSender RespondChunked(bricks::net::api::Request& r,
+                                                                        bricks::net::HTTPResponseCode code,
+                                                                        A&&... content_type_and_headers) {
+  ResponseRecord::Sent(static_cast<int>(code), 0);
+  return r.connection.SendChunkedHTTPResponse(code, std::forward<A>(content_type_and_headers)...);
+}
+
+// Sends the chunk of the response started via `RespondChunked()`. The chunks are only recorded while
+// the handler is running, those streamed after it returns are counted by the streams themselves.
+template <typename S>
+void RespondChunk(S& response, const std::string& chunk) {
+  ResponseRecord::Sent(0, chunk.length());
+  response.Send(chunk);
+}
+
+class Metrics final {
+ public:
+  // The metrics of the route, created on first use. The reference stays valid for the lifetime of `Metrics`.
+  RouteMetrics& Route(const std::string& route) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<RouteMetrics>& metrics = routes_[route];
+    if (!metrics) {
+      metrics.reset(new RouteMetrics());
+    }
+    return *metrics;
+  }
+
+  // Wraps the HTTP handler to record its latency, request body size, and the code and size of its response
+  // under `route`. The exceptions are rethrown, for the HTTP server to respond with an error.
+  template <typename F>
+  std::function<void(bricks::net::api::Request)> Instrument(const std::string& route, F handler) {
+    RouteMetrics& metrics = Route(route);
+    return [&metrics, handler](bricks::net::api::Request r) mutable {
+      RequestRecorder recorder(metrics, r);
+      handler(std::move(r));
+      recorder.Returned();
+    };
+  }
+
+  // Adds a value computed at scrape time. The `type` is "gauge" or "counter".
+  void Gauge(const std::string& name,
+             const std::string& help,
+             std::function<double()> value,
+             const std::string& type = "gauge") {
+    std::lock_guard<std::mutex> lock(mutex_);
+    gauges_.push_back(GaugeInfo{name, help, type, value});
+  }
+
+  // The metrics in the Prometheus text exposition format.
+  std::string Render() const {
+    std::vector<std::pair<std::string, RouteStats>> routes;
+    std::vector<GaugeInfo> gauges;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& route : routes_) {
+        routes.emplace_back(route.first, route.second->Stats());
+      }
+      gauges = gauges_;
+    }
+    std::string output;
+    const auto counter = [&output, &routes](const char* name, const char* help, uint64_t RouteStats::*field) {
+      Header(name, help, "counter", output);
+      for (const auto& route : routes) {
+        output += std::string(name) + "{route=\"" + Escape(route.first) + "\"} ";
+        AppendUnsigned(route.second.*field, output);
+        output += '\n';
+      }
+    };
+    counter("demo_http_requests_total", "The number of requests served.", &RouteStats::requests);
+    counter("demo_http_errors_total",
+            "The number of requests responded to with a 4xx or 5xx code, or not at all.",
+            &RouteStats::errors);
+    counter("demo_http_request_bytes_total", "The total size of request bodies.", &RouteStats::request_bytes);
+    counter(
+        "demo_http_response_bytes_total", "The total size of response bodies.", &RouteStats::response_bytes);
+    static const char* const kResponseClassNames[] = {"none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+    const char* responses = "demo_http_responses_total";
+    Header(responses, "The number of responses by the class of their code.", "counter", output);
+    for (const auto& route : routes) {
+      for (size_t i = 0; i < RouteStats::kResponseClasses; ++i) {
+        if (route.second.responses[i]) {
+          output += std::string(responses) + "{route=\"" + Escape(route.first) + "\",code=\"" +
+                    kResponseClassNames[i] + "\"} ";
+          AppendUnsigned(route.second.responses[i], output);
+          output += '\n';
+        }
+      }
+    }
+
+    // The `le` boundaries of the exported histograms, in seconds.
+    static const double kBucketBoundaries[] = {
+        1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2,
+        2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+    };
+    const char* histogram = "demo_http_request_duration_seconds";
+    Header(histogram, "The time spent in the handler.", "histogram", output);
+    for (const auto& route : routes) {
+      const RouteStats& stats = route.second;
+      const std::string labels = "{route=\"" + Escape(route.first) + "\"";
+      size_t bucket = 0;
+      uint64_t cumulative = 0;
+      for (const double le : kBucketBoundaries) {
+        // The bucket counts are approximate, as the histogram buckets do not align with the `le` boundaries.
+        while (bucket < LatencyBuckets::kCount && LatencyBuckets::UpperBound(bucket) <= le * 1e9) {
+          cumulative += stats.latency_buckets[bucket++];
+        }
+        output += std::string(histogram) + "_bucket" + labels + ",le=\"";
+        AppendNumber(le, output);
+        output += "\"} ";
+        AppendUnsigned(cumulative, output);
+        output += '\n';
+      }
+      output += std::string(histogram) + "_bucket" + labels + ",le=\"+Inf\"} ";
+      AppendUnsigned(stats.requests, output);
+      output += '\n' + std::string(histogram) + "_sum" + labels + "} ";
+      AppendNumber(stats.latency_sum_ns / 1e9, output);
+      output += '\n' + std::string(histogram) + "_count" + labels + "} ";
+      AppendUnsigned(stats.requests, output);
+      output += '\n';
+    }
+
+    for (const auto& gauge : gauges) {
+      Header(gauge.name.c_str(), gauge.help.c_str(), gauge.type.c_str(), output);
+      output += gauge.name + ' ';
+      AppendNumber(gauge.value(), output);
+      output += '\n';
+    }
+    return output;
+  }
+
+ private:
+  struct GaugeInfo {
+    std::string name;
+    std::string help;
+    std::string type;
+    std::function<double()> value;
+  };
+
+  static void Header(const char* name, const char* help, const char* type, std::string& output) {
+    output += std::string("# HELP ") + name + ' ' + help + "\n# TYPE " + name + ' ' + type + '\n';
+  }
+
+  static void AppendNumber(double value, std::string& output) {
+    char buffer[kMaxFormattedNumberLength];
+    output.append(buffer, FormatDouble(value, buffer));
+  }
+
+  static void AppendUnsigned(uint64_t value, std::string& output) {
+    char buffer[kMaxFormattedNumberLength];
+    output.append(buffer, FormatUnsigned(value, buffer));
+  }
+
+  static std::string Escape(const std::string& label) {
+    std::string result;
+    for (const char c : label) {
+      if (c == '\\' || c == '"') {
+        result += '\\';
+      }
+      result += (c == '\n') ? ' ' : c;
+    }
+    return result;
+  }
+
+  mutable std::mutex mutex_;
+  std::map<std::string, std::unique_ptr<RouteMetrics>> routes_;
+  std::vector<GaugeInfo> gauges_;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_METRICS_H
@@ -0,0 +1,112 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Fast allocation-free formatting of numbers for the hand-written JSON serializers of the demo.
+//
+// `FormatDouble()` writes the shortest decimal with up to 15 fractional digits that parses back
+// into exactly the same `double`, which is what most of the real-world data needs, and falls back
+// to `printf("%.17g")` for the rest. Non-finite values are written as `null`, since JSON has no NaN.
+
+#ifndef DEMO_NUMBER_FORMAT_H
+#define DEMO_NUMBER_FORMAT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+namespace demo {
+
+// The buffer for the longest number `FormatDouble()` can write, with some room to spare.
+enum { kMaxFormattedNumberLength = 32 };
+
+// Writes the decimal digits of `value` into `output`, returns the number of characters written.
+inline size_t FormatUnsigned(uint64_t value, char* output) {
+  char digits[20];
+  size_t length = 0;
+  do {
+    digits[length++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  for (size_t i = 0; i < length; ++i) {
+    output[i] = digits[length - 1 - i];
+  }
+  return length;
+}
+
+// Writes `value` into `output`, which must have room for `kMaxFormattedNumberLength` characters.
+// Returns the number of characters written, no terminating zero is added.
+inline size_t FormatDouble(double value, char* output) {
+  static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                         1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+  if (!std::isfinite(value)) {
+    output[0] = 'n';
+    output[1] = 'u';
+    output[2] = 'l';
+    output[3] = 'l';
+    return 4;
+  }
+  char* p = output;
+  double magnitude = value;
+  if (std::signbit(value)) {
+    *p++ = '-';
+    magnitude = -value;
+  }
+  for (int digits = 0; digits < 16; ++digits) {
+    const double scaled = magnitude * powers_of_ten[digits];
+    if (!(scaled < 9007199254740992.0)) {
+      break;  // Past 2^53, `scaled` can no longer be represented exactly.
+    }
+    const uint64_t mantissa = static_cast<uint64_t>(scaled + 0.5);
+    // Both operands are exact, and IEEE division rounds correctly, so on equality the printed decimal
+    // parses back into the very same `double`.
+    if (static_cast<double>(mantissa) / powers_of_ten[digits] == magnitude) {
+      char buffer[20];
+      const size_t length = FormatUnsigned(mantissa, buffer);
+      if (static_cast<int>(length) <= digits) {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = static_cast<int>(length); i < digits; ++i) {
+          *p++ = '0';
+        }
+        for (size_t i = 0; i < length; ++i) {
+          *p++ = buffer[i];
+        }
+      } else {
+        const size_t integer_length = length - digits;
+        for (size_t i = 0; i < length; ++i) {
+          if (i == integer_length) {
+            *p++ = '.';
+          }
+          *p++ = buffer[i];
+        }
+      }
+      return p - output;
+    }
+  }
+  return snprintf(output, kMaxFormattedNumberLength, "%.17g", value);
+}
+
+}  // namespace demo
+
+#endif  // DEMO_NUMBER_FORMAT_H
@@ -0,0 +1,213 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `PointFeed`, which streams the points added to the `State` to the live subscribers,
+// each one filtered its own way.
+//
+// One dispatcher thread follows the `PointRing` with a cursor per subscriber, formats the points that pass
+// the filter of the subscriber as NDJSON, and hands them over to the `Broadcaster`, the writers of which
+// send them.
+// A subscriber that can not keep up, so that its buffer in the `Broadcaster` overflows or the ring laps it,
+// is either dropped, or moved to a downsampled feed of every second, fourth, etc. point, and moved back
+// once it has kept up for a while.
+
+#ifndef DEMO_POINT_FEED_H
+#define DEMO_POINT_FEED_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "broadcaster.h"
+#include "point.h"
+#include "point_ring.h"
+#include "points_json.h"
+
+namespace demo {
+
+struct PointFilter {
+  int label = -1;  // Either 0 or 1 to only pass the points with this label, -1 to pass all the points.
+  double x0 = -std::numeric_limits<double>::infinity();
+  double y0 = -std::numeric_limits<double>::infinity();
+  double x1 = std::numeric_limits<double>::infinity();
+  double y1 = std::numeric_limits<double>::infinity();
+
+  bool Matches(const Point& point) const {
+    return (label < 0 || point.label == (label == 1)) && point.x >= x0 && point.x <= x1 && point.y >= y0 &&
+           point.y <= y1;
+  }
+};
+
+enum class LagPolicy { Drop, Downsample };
+
+class PointFeed final {
+ public:
+  // `now_ms` is the clock the ends of the subscriptions are compared against.
+  PointFeed(PointRing& ring, Broadcaster& broadcaster, std::function<double()> now_ms)
+      : ring_(ring), broadcaster_(broadcaster), now_ms_(now_ms), dispatcher_(&PointFeed::Dispatch, this) {}
+
+  ~PointFeed() {
+    stop_ = true;
+    dispatcher_.join();
+  }
+
+  // Streams the points added from now on until `end_ms`.
+  void Subscribe(std::unique_ptr<BroadcastSink> sink,
+                 double end_ms,
+                 const PointFilter& filter,
+                 LagPolicy policy = LagPolicy::Downsample) {
+    Subscriber subscriber;
+    subscriber.handle = broadcaster_.Subscribe(std::move(sink), end_ms, Broadcaster::kNoChannel);
+    subscriber.end_ms = end_ms;
+    subscriber.filter = filter;
+    subscriber.policy = policy;
+    subscriber.cursor = ring_.Head();
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.push_back(subscriber);
+  }
+
+  size_t SubscribersCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return subscribers_.size();
+  }
+
+  // The number of times some subscriber has fallen behind, and was dropped or downsampled.
+  size_t LagCount() const { return lag_count_; }
+
+ private:
+  struct Subscriber {
+    Broadcaster::Handle handle;
+    double end_ms;
+    PointFilter filter;
+    LagPolicy policy;
+    uint64_t cursor;  // The next point in the ring.
+    uint64_t stride = 1;  // Only every `stride`-th point that passes the filter is sent.
+    uint64_t matched = 0;
+    size_t rounds_kept_up = 0;
+  };
+
+  enum { kBatchSize = 1 << 12, kMaxStride = 1 << 10, kRoundsToRecover = 64 };
+
+  void Dispatch() {
+    char batch[kBatchSize];
+    while (!stop_) {
+      uint64_t wait_for = ring_.Head();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const double now_ms = now_ms_();
+        for (size_t i = 0; i < subscribers_.size();) {
+          if (Forward(subscribers_[i], now_ms, batch)) {
+            wait_for = std::min(wait_for, subscribers_[i].cursor);
+            ++i;
+          } else {
+            subscribers_[i] = std::move(subscribers_.back());
+            subscribers_.pop_back();
+          }
+        }
+      }
+      // Wakes up periodically to end the subscriptions that have expired while no points were added.
+      ring_.Wait(wait_for, std::chrono::milliseconds(100));
+    }
+  }
+
+  // Sends the new points to the subscriber, returns false once it is over.
+  bool Forward(Subscriber& s, double now_ms, char* batch) {
+    if (now_ms >= s.end_ms) {
+      broadcaster_.Close(s.handle);
+      return false;
+    }
+    bool over = false;
+    bool lagging = false;
+    size_t length = 0;
+    const auto flush = [&]() {
+      if (length) {
+        const Broadcaster::PublishResult result = broadcaster_.PublishTo(s.handle, batch, length, now_ms);
+        over |= (result == Broadcaster::PublishResult::Over);
+        lagging |= (result == Broadcaster::PublishResult::Dropped);
+        length = 0;
+      }
+    };
+    Point point;
+    while (!over) {
+      const PointRing::ReadResult read = ring_.Read(s.cursor, point);
+      if (read == PointRing::ReadResult::NotYet) {
+        break;
+      }
+      if (read == PointRing::ReadResult::Overwritten) {
+        // Skip ahead past the points lost, leaving some room before the writers lap the cursor again.
+        s.cursor = ring_.Head() - ring_.Capacity() / 2;
+        lagging = true;
+        continue;
+      }
+      ++s.cursor;
+      if (!s.filter.Matches(point) || (s.matched++ % s.stride)) {
+        continue;
+      }
+      if (length + kMaxPointJSONLength + 1 > kBatchSize) {
+        flush();
+      }
+      length += FormatPointJSON(point, batch + length);
+      batch[length++] = '\n';
+    }
+    flush();
+    if (over) {
+      return false;
+    }
+    if (lagging) {
+      ++lag_count_;
+      if (s.policy == LagPolicy::Drop) {
+        broadcaster_.Close(s.handle);
+        return false;
+      }
+      s.stride = std::min<uint64_t>(s.stride * 2, kMaxStride);
+      s.rounds_kept_up = 0;
+    } else if (s.stride > 1 && ++s.rounds_kept_up >= kRoundsToRecover) {
+      s.stride /= 2;
+      s.rounds_kept_up = 0;
+    }
+    return true;
+  }
+
+  PointRing& ring_;
+  Broadcaster& broadcaster_;
+  const std::function<double()> now_ms_;
+  mutable std::mutex mutex_;
+  std::vector<Subscriber> subscribers_;  // Guarded by `mutex_`.
+  std::atomic_size_t lag_count_{0};
+  std::atomic_bool stop_{false};
+  std::thread dispatcher_;
+
+  PointFeed(const PointFeed&) = delete;
+  void operator=(const PointFeed&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_POINT_FEED_H
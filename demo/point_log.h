@@ -0,0 +1,556 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `PointLog`, the durable append-only log of the points added to the `State`.
+//
+// The log is a directory of segment files, `points.<N>.log`, and snapshot files, `points.<N>.snapshot`.
+// Both start with an 8-byte magic header followed by the 17-byte records of the binary ingest format.
+//
+// Appends only encode the records into a memory buffer. A background writer thread writes whatever has
+// accumulated with one `write()` call, and syncs it to disk every `fsync_every_records` records or
+// `fsync_interval_ms` milliseconds, whichever comes first. `Flush()` waits until all the points appended
+// so far are durable. Once a segment grows past `max_segment_bytes`, a new one is started, and after
+// `compact_after_segments` segments have been closed, they get merged with the latest snapshot into a new one.
+//
+// The snapshot `points.<N>.snapshot` covers all the segments up to and including `N`, so on startup only
+// the latest snapshot and the segments after it are replayed, even if a compaction was interrupted midway.
+// `Replay()` memory-maps the files and decodes them from multiple threads in parallel, and hands the points
+// over in the order they were appended in.
+
+#ifndef DEMO_POINT_LOG_H
+#define DEMO_POINT_LOG_H
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ingest.h"
+#include "point.h"
+
+namespace demo {
+
+struct PointLogException : std::runtime_error {
+  explicit PointLogException(const std::string& what) : std::runtime_error(what) {}
+};
+
+// A failed `fsync()`. The kernel may have dropped the pages it failed to write by then, so a retry that
+// succeeds would not mean the data is on disk, and the writer thread gives up instead.
+struct PointLogSyncException : PointLogException {
+  explicit PointLogSyncException(const std::string& what) : PointLogException(what) {}
+};
+
+struct PointLogOptions {
+  size_t fsync_every_records = 4096;
+  size_t fsync_interval_ms = 50;
+  size_t max_segment_bytes = 64 << 20;
+  size_t compact_after_segments = 4;
+};
+
+class PointLog final {
+ public:
+  explicit PointLog(const std::string& dir, const PointLogOptions& options = PointLogOptions())
+      : dir_(dir), options_(options), segment_(0) {
+    ::mkdir(dir.c_str(), 0755);
+    segment_ = LatestFileNumber(dir) + 1;
+    OpenSegment();
+    writer_ = std::thread(&PointLog::WriterThread, this);
+    compactor_ = std::thread(&PointLog::CompactorThread, this);
+  }
+
+  ~PointLog() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_compactor_ = true;
+    }
+    compaction_cv_.notify_all();
+    compactor_.join();
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  // Throws `PointLogException` once the writer thread has given up, see `WriterThread()`.
+  template <typename IT>
+  void Append(IT begin, IT end) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!error_.empty()) {
+      throw PointLogException(error_);
+    }
+    const size_t before = pending_.length();
+    for (IT it = begin; it != end; ++it) {
+      AppendBinaryPoint(*it, pending_);
+    }
+    appended_ += pending_.length() - before;
+    cv_.notify_one();
+  }
+
+  // Blocks until all the points appended so far are synced to disk. Throws `PointLogException` if they
+  // never will be.
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const uint64_t target = appended_;
+    flush_requested_ = true;
+    cv_.notify_one();
+    durable_cv_.wait(lock, [this, target]() { return durable_ >= target || !error_.empty(); });
+    if (durable_ < target) {
+      throw PointLogException(error_);
+    }
+  }
+
+  // Merges all the closed segments and the latest snapshot into a new snapshot, and removes the merged files.
+  void Compact() {
+    std::lock_guard<std::mutex> compaction_lock(compaction_mutex_);
+    uint64_t current_segment;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      current_segment = segment_;
+    }
+    const Files files = ListFiles(dir_);
+    // The segments up to the latest snapshot are already in it, and are only still there if the compaction
+    // that made the snapshot was interrupted before removing them, so they are removed and not merged again.
+    std::vector<uint64_t> merged;
+    for (uint64_t n : files.segments) {
+      if (n <= files.snapshot) {
+        ::unlink(SegmentPath(dir_, n).c_str());
+      } else if (n < current_segment) {
+        merged.push_back(n);
+      }
+    }
+    for (uint64_t n : files.stale_snapshots) {
+      ::unlink(SnapshotPath(dir_, n).c_str());
+    }
+    if (merged.empty()) {
+      return;
+    }
+    const uint64_t snapshot = merged.back();
+    const std::string tmp = SnapshotPath(dir_, snapshot) + ".tmp";
+    const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      throw PointLogException("Can not create `" + tmp + "`.");
+    }
+    try {
+      WriteAll(fd, Magic(), kHeaderSize);
+      if (files.snapshot) {
+        CopyRecords(SnapshotPath(dir_, files.snapshot), fd);
+      }
+      for (uint64_t n : merged) {
+        CopyRecords(SegmentPath(dir_, n), fd);
+      }
+      Sync(fd);
+    } catch (const PointLogException&) {
+      ::close(fd);
+      ::unlink(tmp.c_str());
+      throw;
+    }
+    ::close(fd);
+    if (::rename(tmp.c_str(), SnapshotPath(dir_, snapshot).c_str())) {
+      throw PointLogException("Can not rename `" + tmp + "`.");
+    }
+    SyncDirectory(dir_);
+    // From this moment on the new snapshot supersedes the merged files, so it's safe to remove them.
+    if (files.snapshot) {
+      ::unlink(SnapshotPath(dir_, files.snapshot).c_str());
+    }
+    for (uint64_t n : merged) {
+      ::unlink(SegmentPath(dir_, n).c_str());
+    }
+  }
+
+  // Calls `add(const Point* begin, const Point* end)` for all the points in the log in `dir`, in the order they
+  // were appended in, from the calling thread. The files are decoded by up to `threads` threads at once, and
+  // each decoded range is added as soon as the ones before it have been. Returns the number of points replayed.
+  // A missing directory is an empty log.
+  template <typename F>
+  static size_t Replay(const std::string& dir, F&& add, size_t threads = std::thread::hardware_concurrency()) {
+    const Files files = ListFiles(dir);
+    std::vector<std::string> paths;
+    if (files.snapshot) {
+      paths.push_back(SnapshotPath(dir, files.snapshot));
+    }
+    for (uint64_t n : files.segments) {
+      if (n > files.snapshot) {
+        paths.push_back(SegmentPath(dir, n));
+      }
+    }
+    threads = std::max(threads, static_cast<size_t>(1));
+    size_t total = 0;
+    for (const std::string& path : paths) {
+      const int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        throw PointLogException("Can not open `" + path + "`.");
+      }
+      struct stat st;
+      if (::fstat(fd, &st) || static_cast<size_t>(st.st_size) < kHeaderSize) {
+        // A segment that crashed before its header made it to disk has no points.
+        ::close(fd);
+        continue;
+      }
+      const size_t size = static_cast<size_t>(st.st_size);
+      void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapped == MAP_FAILED) {
+        throw PointLogException("Can not mmap `" + path + "`.");
+      }
+      const char* data = static_cast<const char*>(mapped);
+      if (memcmp(data, Magic(), kHeaderSize)) {
+        ::munmap(mapped, size);
+        throw PointLogException("`" + path + "` is not a point log file.");
+      }
+      // A torn record at the very end, if any, is the append that did not make it to disk; ignore it.
+      const size_t records = (size - kHeaderSize) / kBinaryPointRecordSize;
+      const size_t per_thread = std::max((records + threads - 1) / threads, static_cast<size_t>(1));
+      std::vector<std::vector<Point>> decoded((records + per_thread - 1) / per_thread);
+      std::vector<std::thread> workers;
+      for (size_t i = 0; i < decoded.size(); ++i) {
+        const size_t begin = i * per_thread;
+        const size_t end = std::min(begin + per_thread, records);
+        std::vector<Point>& points = decoded[i];
+        workers.emplace_back([data, begin, end, &points]() {
+          points.reserve(end - begin);
+          ParseBinaryPoints(data + kHeaderSize + begin * kBinaryPointRecordSize,
+                            (end - begin) * kBinaryPointRecordSize,
+                            [&points](const Point* b, const Point* e) { points.insert(points.end(), b, e); });
+        });
+      }
+      size_t joined = 0;
+      try {
+        for (; joined < workers.size(); ++joined) {
+          workers[joined].join();
+          std::vector<Point>& points = decoded[joined];
+          if (!points.empty()) {
+            add(points.data(), points.data() + points.size());
+            total += points.size();
+          }
+          std::vector<Point>().swap(points);
+        }
+      } catch (...) {
+        for (++joined; joined < workers.size(); ++joined) {
+          workers[joined].join();
+        }
+        ::munmap(mapped, size);
+        throw;
+      }
+      ::munmap(mapped, size);
+    }
+    return total;
+  }
+
+ private:
+  enum { kHeaderSize = 8 };
+  static const char* Magic() { return "KSPOINTS"; }
+
+  struct Files {
+    uint64_t snapshot = 0;  // The latest snapshot, zero if there is none.
+    std::vector<uint64_t> stale_snapshots;  // Superseded by `snapshot`, left over by an interrupted compaction.
+    std::vector<uint64_t> segments;  // Sorted.
+  };
+
+  static std::string SegmentPath(const std::string& dir, uint64_t n) {
+    return dir + "/points." + std::to_string(n) + ".log";
+  }
+
+  static std::string SnapshotPath(const std::string& dir, uint64_t n) {
+    return dir + "/points." + std::to_string(n) + ".snapshot";
+  }
+
+  static Files ListFiles(const std::string& dir) {
+    Files files;
+    if (DIR* d = ::opendir(dir.c_str())) {
+      while (struct dirent* entry = ::readdir(d)) {
+        const std::string name = entry->d_name;
+        unsigned long long n;
+        char suffix[16];
+        if (sscanf(name.c_str(), "points.%llu.%15s", &n, suffix) == 2) {
+          if (!strcmp(suffix, "log")) {
+            files.segments.push_back(n);
+          } else if (!strcmp(suffix, "snapshot")) {
+            files.stale_snapshots.push_back(n);
+          }
+        }
+      }
+      ::closedir(d);
+    }
+    std::sort(files.segments.begin(), files.segments.end());
+    std::sort(files.stale_snapshots.begin(), files.stale_snapshots.end());
+    if (!files.stale_snapshots.empty()) {
+      files.snapshot = files.stale_snapshots.back();
+      files.stale_snapshots.pop_back();
+    }
+    return files;
+  }
+
+  static uint64_t LatestFileNumber(const std::string& dir) {
+    const Files files = ListFiles(dir);
+    return std::max(files.snapshot, files.segments.empty() ? 0 : files.segments.back());
+  }
+
+  static void WriteAll(int fd, const char* data, size_t length) {
+    while (length) {
+      const ssize_t written = ::write(fd, data, length);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw PointLogException("Write to the point log failed: " + std::string(strerror(errno)));
+      }
+      data += written;
+      length -= written;
+    }
+  }
+
+  // Throws `PointLogSyncException` if the data written to `fd` may not be on disk.
+  static void Sync(int fd) {
+#ifdef __linux__
+    const int result = ::fdatasync(fd);
+#else
+    const int result = ::fsync(fd);
+#endif
+    if (result) {
+      throw PointLogSyncException("Sync of the point log failed: " + std::string(strerror(errno)));
+    }
+  }
+
+  // Makes the creation, renaming, and removal of the files in `dir` durable.
+  static void SyncDirectory(const std::string& dir) {
+    const int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw PointLogSyncException("Can not open `" + dir + "` to sync it: " + std::string(strerror(errno)));
+    }
+    const int result = ::fsync(fd);
+    const int error = errno;
+    ::close(fd);
+    if (result) {
+      throw PointLogSyncException("Sync of `" + dir + "` failed: " + std::string(strerror(error)));
+    }
+  }
+
+  // Appends the complete records of the file at `path` to `fd`.
+  static void CopyRecords(const std::string& path, int fd) {
+    const int input = ::open(path.c_str(), O_RDONLY);
+    if (input < 0) {
+      throw PointLogException("Can not open `" + path + "`.");
+    }
+    struct stat st;
+    ::fstat(input, &st);
+    const size_t size = static_cast<size_t>(st.st_size);
+    if (size > kHeaderSize) {
+      size_t remaining = (size - kHeaderSize) / kBinaryPointRecordSize * kBinaryPointRecordSize;
+      ::lseek(input, kHeaderSize, SEEK_SET);
+      std::vector<char> buffer(1 << 20);
+      while (remaining) {
+        const ssize_t read = ::read(input, &buffer[0], std::min(buffer.size(), remaining));
+        if (read <= 0) {
+          ::close(input);
+          throw PointLogException("Can not read `" + path + "`.");
+        }
+        WriteAll(fd, &buffer[0], read);
+        remaining -= read;
+      }
+    }
+    ::close(input);
+  }
+
+  // Must be called from the constructor or from the writer thread.
+  void OpenSegment() {
+    const std::string path = SegmentPath(dir_, segment_);
+    // A retry after a failure starts the segment over.
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd_ < 0) {
+      throw PointLogException("Can not create `" + path + "`.");
+    }
+    try {
+      WriteAll(fd_, Magic(), kHeaderSize);
+      Sync(fd_);
+      SyncDirectory(dir_);
+    } catch (const PointLogException&) {
+      ::close(fd_);
+      fd_ = -1;
+      throw;
+    }
+    segment_bytes_ = kHeaderSize;
+  }
+
+  // Writes the appended records, and retries those that failed to be written. A failed write may have
+  // written some of the records, or a part of one, so the segment is first truncated back to where it was,
+  // to neither duplicate nor misalign the records. Should that fail too, a sync fail, or a write fail after
+  // `stop_`, the writer gives up, and reports the error via `Append()` and `Flush()`, without marking
+  // the records since the last successful sync as durable.
+  void WriterThread() {
+    std::string batch;
+    size_t unsynced_records = 0;
+    auto last_sync = std::chrono::steady_clock::now();
+    const auto interval = std::chrono::milliseconds(options_.fsync_interval_ms);
+    uint64_t written = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait_for(lock, interval, [this]() { return stop_ || flush_requested_ || !pending_.empty(); });
+      batch.swap(pending_);
+      const bool flush = flush_requested_ || stop_;
+      flush_requested_ = false;
+      const bool stop = stop_;
+      lock.unlock();
+      bool rotated = false;
+      std::string error;
+      try {
+        if (fd_ < 0) {
+          OpenSegment();
+        }
+        if (!batch.empty()) {
+          WriteAll(fd_, batch.data(), batch.length());
+          unsynced_records += batch.length() / kBinaryPointRecordSize;
+          segment_bytes_ += batch.length();
+          written += batch.length();
+          batch.clear();
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (unsynced_records &&
+            (flush || unsynced_records >= options_.fsync_every_records || now - last_sync >= interval)) {
+          Sync(fd_);
+          unsynced_records = 0;
+          last_sync = now;
+        }
+        if (segment_bytes_ >= options_.max_segment_bytes) {
+          Sync(fd_);
+          ::close(fd_);
+          fd_ = -1;
+          {
+            std::lock_guard<std::mutex> segment_lock(mutex_);
+            ++segment_;
+          }
+          OpenSegment();
+          rotated = true;
+        }
+      } catch (const PointLogSyncException& e) {
+        error = e.what();
+      } catch (const std::exception& e) {
+        // Keep the data that did not make it to disk, and retry with the next batch.
+        std::cerr << "Exception in point log writer thread: " << e.what() << std::endl;
+        if (!batch.empty() && fd_ >= 0 && ::ftruncate(fd_, segment_bytes_)) {
+          error = "Can not truncate the point log after a failed write: " + std::string(strerror(errno));
+        } else if (stop) {
+          error = std::string("Gave up on writing the point log: ") + e.what();
+        } else {
+          std::this_thread::sleep_for(interval);
+        }
+      }
+      lock.lock();
+      if (!error.empty()) {
+        std::cerr << error << std::endl;
+        error_ = error;
+        durable_cv_.notify_all();
+        return;
+      }
+      if (!batch.empty()) {
+        pending_.insert(0, batch);
+        batch.clear();
+      }
+      if (!unsynced_records) {
+        durable_ = written;
+        durable_cv_.notify_all();
+      }
+      if (rotated && ++closed_segments_ >= options_.compact_after_segments) {
+        closed_segments_ = 0;
+        compaction_requested_ = true;
+        compaction_cv_.notify_one();
+      }
+      if (stop && pending_.empty()) {
+        return;
+      }
+    }
+  }
+
+  void CompactorThread() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        compaction_cv_.wait(lock, [this]() { return compaction_requested_ || stop_compactor_; });
+        if (stop_compactor_) {
+          return;
+        }
+        compaction_requested_ = false;
+      }
+      try {
+        Compact();
+      } catch (const std::exception& e) {
+        std::cerr << "Exception in point log compaction thread: " << e.what() << std::endl;
+      }
+    }
+  }
+
+  const std::string dir_;
+  const PointLogOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable durable_cv_;
+  std::string pending_;  // The encoded records not yet handed over to the writer thread.
+  uint64_t appended_ = 0;  // The number of bytes ever appended.
+  uint64_t durable_ = 0;  // The number of bytes ever synced to disk.
+  bool flush_requested_ = false;
+  bool stop_ = false;
+  std::string error_;  // Why the writer thread has given up, empty while it has not.
+  uint64_t segment_;  // The number of the segment being written. Guarded by `mutex_` for `Compact()`.
+  size_t closed_segments_ = 0;
+  bool compaction_requested_ = false;
+
+  // Only touched by the writer thread after construction.
+  int fd_ = -1;
+  size_t segment_bytes_ = 0;
+
+  std::condition_variable compaction_cv_;  // Used with `mutex_`.
+  bool stop_compactor_ = false;
+  std::mutex compaction_mutex_;  // Only one compaction at a time.
+
+  std::thread writer_;
+  std::thread compactor_;
+
+  PointLog(const PointLog&) = delete;
+  void operator=(const PointLog&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_POINT_LOG_H
@@ -0,0 +1,155 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `PointRing`, the lock-free ring buffer the points added to the `State` are published into
+// for the live subscribers.
+//
+// Any number of threads may `Push()`, and any number of readers may follow the ring, each from its own cursor,
+// without taking locks and without the writers knowing about the readers. Every point gets the next sequence
+// number; its slot is stamped with an odd value while being written and an even one once done, seqlock-style,
+// so a reader that has fallen more than the capacity behind finds its slot stamped for a later lap,
+// and learns that it has lost the points in between.
+
+#ifndef DEMO_POINT_RING_H
+#define DEMO_POINT_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "point.h"
+
+namespace demo {
+
+class PointRing final {
+ public:
+  enum class ReadResult { Ready, NotYet, Overwritten };
+
+  explicit PointRing(size_t capacity_log2 = 16)
+      : mask_((static_cast<uint64_t>(1) << capacity_log2) - 1), slots_(new Slot[mask_ + 1]) {}
+
+  uint64_t Capacity() const { return mask_ + 1; }
+
+  // The sequence number the next point will get.
+  uint64_t Head() const { return next_; }
+
+  void Push(const Point& point) {
+    const uint64_t i = next_++;
+    Slot& slot = slots_[i & mask_];
+    // Should the writer of the previous lap of this slot still be in progress, wait for it.
+    const uint64_t previous = (i > mask_) ? Stamp(i - mask_ - 1) : 0;
+    while (slot.stamp.load(std::memory_order_acquire) != previous) {
+      std::this_thread::yield();
+    }
+    slot.stamp.store(Stamp(i) - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.x.store(Bits(point.x), std::memory_order_relaxed);
+    slot.y.store(Bits(point.y), std::memory_order_relaxed);
+    slot.label.store(point.label, std::memory_order_relaxed);
+    slot.stamp.store(Stamp(i));
+    if (waiting_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+  }
+
+  template <typename IT>
+  void Push(IT begin, IT end) {
+    for (IT it = begin; it != end; ++it) {
+      Push(*it);
+    }
+  }
+
+  // Reads the point number `cursor` if it is there.
+  ReadResult Read(uint64_t cursor, Point& point) const {
+    const Slot& slot = slots_[cursor & mask_];
+    const uint64_t stamp = slot.stamp.load(std::memory_order_acquire);
+    if (stamp < Stamp(cursor)) {
+      return ReadResult::NotYet;
+    }
+    point.x = Double(slot.x.load(std::memory_order_relaxed));
+    point.y = Double(slot.y.load(std::memory_order_relaxed));
+    point.label = slot.label.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (stamp != Stamp(cursor) || slot.stamp.load(std::memory_order_relaxed) != stamp) {
+      return ReadResult::Overwritten;
+    }
+    return ReadResult::Ready;
+  }
+
+  // Blocks until the point number `cursor` is there or overwritten, for up to `timeout`.
+  void Wait(uint64_t cursor, std::chrono::milliseconds timeout) {
+    const Slot& slot = slots_[cursor & mask_];
+    ++waiting_;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait_for(lock, timeout, [&slot, cursor, this]() { return slot.stamp.load() >= Stamp(cursor); });
+    }
+    --waiting_;
+  }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> stamp{0};
+    std::atomic<uint64_t> x{0};
+    std::atomic<uint64_t> y{0};
+    std::atomic_bool label{false};
+  };
+
+  // The stamp of the slot once the point number `i` is written, one less while it is being written.
+  static uint64_t Stamp(uint64_t i) { return 2 * (i + 1); }
+
+  static uint64_t Bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  }
+
+  static double Double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  const uint64_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> next_{0};
+
+  // Readers out of data sleep on `cv_`; the writers only take the mutex to wake them up.
+  std::atomic_size_t waiting_{0};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+  PointRing(const PointRing&) = delete;
+  void operator=(const PointRing&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_POINT_RING_H
@@ -0,0 +1,428 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `PointStore`, the sharded append-only storage of `Point`-s that is safe to use concurrently.
+//
+// Writers append to one of the shards, so that concurrent ingest does not contend on a single lock. A writer
+// takes the shard written to last if it is free, and the shard assigned to its thread round-robin otherwise.
+// Each shard is a linked list of fixed-size chunks, which never move once allocated. A writer first stores
+// the point and then publishes the new size of the shard with release semantics.
+//
+// To keep the points in the order they were added across the shards, each batch takes a range of a global
+// sequence number. A shard records the runs of its points with contiguous sequence numbers, and the readers
+// merge the runs of the shards by their sequence numbers. As the writers that do not overlap in time all
+// write into the same shard, sequential ingest makes a single run and costs nothing extra.
+//
+// The chunks are columnar: the `x`-s and the `y`-s are two cache-aligned arrays of doubles, and the labels
+// are a bitmap, so a point takes 16 bytes and a bit instead of the 24 bytes of a padded `Point`, and a scan
+// only pulls in the columns it looks at. `Snapshot::ForEachBlock()` exposes the columns directly, while
+// `ForEach()` assembles the `Point`-s, so the rest of the code keeps working with them.
+//
+// Readers take a `Snapshot`, which is the list of shard heads and sizes as of that moment. Taking a snapshot
+// never blocks the writers, and the points it covers are neither modified nor freed while the store is alive,
+// so the snapshot stays consistent while new points keep coming in.
+
+#ifndef DEMO_POINT_STORE_H
+#define DEMO_POINT_STORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "point.h"
+
+namespace demo {
+
+class PointStore final {
+ private:
+  enum { kChunkSize = 1024, kRunChunkSize = 256, kCacheLine = 64 };
+
+  // Plain `new` does not respect the alignment above 16 bytes before C++17.
+  struct CacheAligned {
+    static void* operator new(size_t size) {
+      void* p;
+      if (posix_memalign(&p, kCacheLine, size)) {
+        throw std::bad_alloc();
+      }
+      return p;
+    }
+    static void operator delete(void* p) { free(p); }
+  };
+
+  struct Chunk : CacheAligned {
+    alignas(kCacheLine) double x[kChunkSize];
+    alignas(kCacheLine) double y[kChunkSize];
+    // Only set by the writer of the shard, before the size covering the point is published.
+    std::atomic<uint64_t> labels[kChunkSize / 64];
+    Chunk* next = nullptr;  // Set before the size covering its first point is published.
+
+    Chunk() {
+      for (auto& word : labels) {
+        word.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  // The points of a shard from `begin` on, up to the next run, have the sequence numbers from `seq` on.
+  struct Run {
+    size_t begin;
+    uint64_t seq;
+  };
+
+  struct RunChunk : CacheAligned {
+    alignas(kCacheLine) Run runs[kRunChunkSize];
+    RunChunk* next = nullptr;  // Set before the number of runs covering its first run is published.
+  };
+
+  struct Shard {
+    std::mutex mutex;  // Serializes the writers of this shard; readers never take it.
+    Chunk* head;  // Never changes after construction.
+    Chunk* tail;  // Guarded by `mutex`.
+    RunChunk* runs_head;  // Never changes after construction.
+    RunChunk* runs_tail;  // Guarded by `mutex`.
+    uint64_t end_seq = 0;  // The sequence number after the last point, guarded by `mutex`.
+    std::atomic_size_t runs;  // Published before the size covering the first point of the run.
+    std::atomic_size_t size;
+    char padding[64];  // Keeps the `size`-s of different shards on different cache lines.
+    Shard()
+        : head(new Chunk()), tail(head), runs_head(new RunChunk()), runs_tail(runs_head), runs(0), size(0) {}
+    ~Shard() {
+      for (Chunk* chunk = head; chunk;) {
+        Chunk* next = chunk->next;
+        delete chunk;
+        chunk = next;
+      }
+      for (RunChunk* chunk = runs_head; chunk;) {
+        RunChunk* next = chunk->next;
+        delete chunk;
+        chunk = next;
+      }
+    }
+  };
+
+ public:
+  class Snapshot final {
+   private:
+    struct ShardSnapshot {
+      const Chunk* head;
+      const RunChunk* runs_head;
+      size_t size;
+      size_t runs;  // May count a few runs that start at or after `size`, those are never visited.
+    };
+
+    // Where a walk over a shard has got to.
+    struct Position {
+      const Chunk* chunk;  // The chunk of the points from `base` on.
+      size_t base;
+      const RunChunk* runs;  // The chunk of the run `run`.
+      size_t run;  // The run of the point at `offset`, once `offset` is within the snapshot.
+      size_t offset;
+    };
+
+   public:
+    size_t Size() const {
+      size_t total = 0;
+      for (const auto& shard : shards_) {
+        total += shard.size;
+      }
+      return total;
+    }
+
+    // A run of the points stored contiguously, from `begin` to `end` within the arrays.
+    struct Block {
+      const double* x;
+      const double* y;
+      const std::atomic<uint64_t>* labels;  // The bitmap, starting from the point at index 0.
+      size_t begin;
+      size_t end;
+      bool Label(size_t i) const { return (labels[i / 64].load(std::memory_order_relaxed) >> (i % 64)) & 1; }
+    };
+
+    // Calls `f(const Block&)` for each run of the points in the snapshot, in the order they were added.
+    template <typename F>
+    void ForEachBlock(F&& f) const {
+      std::vector<Position> positions = Start();
+      WalkBlocks(positions, static_cast<size_t>(-1), f);
+    }
+
+    template <typename F>
+    void ForEach(F&& f) const {
+      std::vector<Position> positions = Start();
+      Walk(positions, static_cast<size_t>(-1), f);
+    }
+
+    // Visits only the points that were added after `previous` was taken from the same store.
+    template <typename F>
+    void ForEachSince(const Snapshot& previous, F&& f) const {
+      std::vector<Position> positions = Start();
+      for (size_t i = 0; i < shards_.size() && i < previous.shards_.size(); ++i) {
+        Seek(shards_[i], previous.shards_[i].size, positions[i]);
+      }
+      Walk(positions, static_cast<size_t>(-1), f);
+    }
+
+    // Where `ForEachFrom()` has stopped, to continue from there.
+    class Cursor final {
+     private:
+      friend class Snapshot;
+      std::vector<Position> positions_;  // Empty before the first call.
+    };
+
+    // Visits up to `count` points from `cursor` on, and moves it past them. Returns false once all
+    // the points have been visited.
+    template <typename F>
+    bool ForEachFrom(Cursor& cursor, size_t count, F&& f) const {
+      if (cursor.positions_.empty()) {
+        cursor.positions_ = Start();
+      }
+      Walk(cursor.positions_, count, f);
+      for (size_t i = 0; i < shards_.size(); ++i) {
+        if (cursor.positions_[i].offset < shards_[i].size) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    std::vector<Point> ToVector() const {
+      std::vector<Point> result;
+      result.reserve(Size());
+      ForEach([&result](const Point& p) { result.push_back(p); });
+      return result;
+    }
+
+   private:
+    friend class PointStore;
+
+    std::vector<Position> Start() const {
+      std::vector<Position> positions;
+      positions.reserve(shards_.size());
+      for (const auto& shard : shards_) {
+        positions.push_back(Position{shard.head, 0, shard.runs_head, 0, 0});
+      }
+      return positions;
+    }
+
+    // The run after the one of `position`, which must exist.
+    static const Run& NextRun(const Position& position) {
+      const size_t i = (position.run + 1) % kRunChunkSize;
+      return i ? position.runs->runs[i] : position.runs->next->runs[0];
+    }
+
+    // Moves `position` to the run of its point, which must be within the snapshot.
+    static void FindRun(const ShardSnapshot& shard, Position& position) {
+      while (position.run + 1 < shard.runs && NextRun(position).begin <= position.offset) {
+        if ((position.run + 1) % kRunChunkSize == 0) {
+          position.runs = position.runs->next;
+        }
+        ++position.run;
+      }
+    }
+
+    // Moves the fresh `position` to `offset`, skipping the chunks of runs before it as a whole.
+    static void Seek(const ShardSnapshot& shard, size_t offset, Position& position) {
+      position.offset = offset;
+      if (offset < shard.size) {
+        while (position.run + kRunChunkSize < shard.runs && position.runs->next->runs[0].begin <= offset) {
+          position.runs = position.runs->next;
+          position.run += kRunChunkSize;
+        }
+        FindRun(shard, position);
+      }
+    }
+
+    // Calls `f(const Block&)` for up to `count` points from `positions` on, in the order they were added,
+    // and moves `positions` past them. The sequence numbers of the runs of different shards never overlap,
+    // so the shard with the smallest sequence number next gets its whole run visited.
+    template <typename F>
+    void WalkBlocks(std::vector<Position>& positions, size_t count, F&& f) const {
+      while (count) {
+        size_t next = shards_.size();
+        uint64_t next_seq = 0;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+          Position& position = positions[i];
+          if (position.offset < shards_[i].size) {
+            FindRun(shards_[i], position);
+            const Run& run = position.runs->runs[position.run % kRunChunkSize];
+            const uint64_t seq = run.seq + (position.offset - run.begin);
+            if (next == shards_.size() || seq < next_seq) {
+              next = i;
+              next_seq = seq;
+            }
+          }
+        }
+        if (next == shards_.size()) {
+          return;
+        }
+        const ShardSnapshot& shard = shards_[next];
+        Position& position = positions[next];
+        size_t end = shard.size;
+        if (position.run + 1 < shard.runs) {
+          end = std::min(end, NextRun(position).begin);
+        }
+        if (end - position.offset > count) {
+          end = position.offset + count;
+        }
+        count -= end - position.offset;
+        while (position.offset < end) {
+          // The `next` of the last chunk may be being set by the writer, so it is only read when covered.
+          while (position.offset >= position.base + kChunkSize) {
+            position.chunk = position.chunk->next;
+            position.base += kChunkSize;
+          }
+          const size_t to = std::min(end, position.base + kChunkSize);
+          const Chunk& chunk = *position.chunk;
+          f(Block{chunk.x, chunk.y, chunk.labels, position.offset - position.base, to - position.base});
+          position.offset = to;
+        }
+      }
+    }
+
+    template <typename F>
+    void Walk(std::vector<Position>& positions, size_t count, F& f) const {
+      WalkBlocks(positions, count, [&f](const Block& block) {
+        for (size_t i = block.begin; i < block.end; ++i) {
+          f(Point(block.x[i], block.y[i], block.Label(i)));
+        }
+      });
+    }
+
+    std::vector<ShardSnapshot> shards_;
+  };
+
+  explicit PointStore(size_t shards = std::thread::hardware_concurrency()) {
+    shards_.resize(std::max(shards, static_cast<size_t>(1)));
+    for (auto& shard : shards_) {
+      shard.reset(new Shard());
+    }
+    last_shard_ = shards_.front().get();
+  }
+
+  void Add(const Point& point) { Add(&point, &point + 1); }
+
+  // Appends a batch of points under one lock acquisition.
+  template <typename IT>
+  void Add(IT begin, IT end) {
+    const size_t count = static_cast<size_t>(std::distance(begin, end));
+    if (!count) {
+      return;
+    }
+    Shard* last = last_shard_.load(std::memory_order_relaxed);
+    if (!last->mutex.try_lock()) {
+      last = &CurrentThreadShard();
+      last->mutex.lock();
+    }
+    Shard& shard = *last;
+    std::lock_guard<std::mutex> lock(shard.mutex, std::adopt_lock);
+    last_shard_.store(&shard, std::memory_order_relaxed);
+    size_t size = shard.size.load(std::memory_order_relaxed);
+    // Taken under the lock, so that a batch added after another one has returned gets the later numbers.
+    const uint64_t seq = next_seq_.fetch_add(count, std::memory_order_relaxed);
+    const size_t runs = shard.runs.load(std::memory_order_relaxed);
+    if (!runs || shard.end_seq != seq) {
+      const size_t i = runs % kRunChunkSize;
+      if (i == 0 && runs) {
+        shard.runs_tail->next = new RunChunk();
+        shard.runs_tail = shard.runs_tail->next;
+      }
+      shard.runs_tail->runs[i] = Run{size, seq};
+      shard.runs.store(runs + 1, std::memory_order_release);
+    }
+    shard.end_seq = seq + count;
+    for (IT it = begin; it != end; ++it) {
+      const size_t i = size % kChunkSize;
+      if (i == 0 && size) {
+        shard.tail->next = new Chunk();
+        shard.tail = shard.tail->next;
+      }
+      const Point& point = *it;
+      Chunk& chunk = *shard.tail;
+      chunk.x[i] = point.x;
+      chunk.y[i] = point.y;
+      if (point.label) {
+        std::atomic<uint64_t>& word = chunk.labels[i / 64];
+        word.store(word.load(std::memory_order_relaxed) | (uint64_t(1) << (i % 64)), std::memory_order_relaxed);
+      }
+      shard.size.store(++size, std::memory_order_release);
+    }
+  }
+
+  size_t Size() const {
+    size_t total = 0;
+    for (const auto& shard : shards_) {
+      total += shard->size.load(std::memory_order_acquire);
+    }
+    return total;
+  }
+
+  // The memory taken by the chunks of the points and of their runs.
+  size_t BytesAllocated() const {
+    size_t bytes = 0;
+    for (const auto& shard : shards_) {
+      const size_t size = shard->size.load(std::memory_order_relaxed);
+      const size_t runs = shard->runs.load(std::memory_order_relaxed);
+      bytes += std::max(static_cast<size_t>(1), (size + kChunkSize - 1) / kChunkSize) * sizeof(Chunk);
+      bytes += std::max(static_cast<size_t>(1), (runs + kRunChunkSize - 1) / kRunChunkSize) * sizeof(RunChunk);
+    }
+    return bytes;
+  }
+
+  Snapshot GetSnapshot() const {
+    Snapshot snapshot;
+    snapshot.shards_.reserve(shards_.size());
+    for (const auto& shard : shards_) {
+      // The runs are loaded after the size, so that all the runs of the points covered are.
+      const size_t size = shard->size.load(std::memory_order_acquire);
+      const size_t runs = shard->runs.load(std::memory_order_acquire);
+      snapshot.shards_.push_back(Snapshot::ShardSnapshot{shard->head, shard->runs_head, size, runs});
+    }
+    return snapshot;
+  }
+
+ private:
+  Shard& CurrentThreadShard() {
+    static std::atomic_size_t next_thread_index(0);
+    thread_local const size_t thread_index = next_thread_index++;
+    return *shards_[thread_index % shards_.size()];
+  }
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<Shard*> last_shard_;  // The shard written to last, tried first by the next writer.
+  std::atomic<uint64_t> next_seq_{0};
+
+  PointStore(const PointStore&) = delete;
+  void operator=(const PointStore&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_POINT_STORE_H
@@ -0,0 +1,164 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Streaming JSON serialization of large sets of points.
+//
+// `PointsJSONWriter` appends the points into one buffer of a fixed capacity and hands it over to the
+// `send(const std::string&)` callback every time it fills up, so that serializing any number of points
+// takes constant memory, and the first bytes go out before the last points are even looked at.
+
+#ifndef DEMO_POINTS_JSON_H
+#define DEMO_POINTS_JSON_H
+
+#include <string>
+#include <utility>
+
+#include "number_format.h"
+#include "point.h"
+#include "point_store.h"
+
+namespace demo {
+
+enum { kMaxPointJSONLength = 2 * kMaxFormattedNumberLength + 32 };
+
+// Writes `{"x":...,"y":...,"label":...}`, the way the cerealized `Point` looks, into `output`,
+// which must have room for `kMaxPointJSONLength` characters. Returns the number of characters written.
+inline size_t FormatPointJSON(const Point& point, char* output) {
+  char* p = output;
+  const auto append = [&p](const char* s, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+      *p++ = s[i];
+    }
+  };
+  append("{\"x\":", 5);
+  p += FormatDouble(point.x, p);
+  append(",\"y\":", 5);
+  p += FormatDouble(point.y, p);
+  if (point.label) {
+    append(",\"label\":true}", 14);
+  } else {
+    append(",\"label\":false}", 15);
+  }
+  return p - output;
+}
+
+enum { kMaxXYJSONLineLength = 2 * kMaxFormattedNumberLength + 16 };
+
+// Writes `{"x":...,"y":...}` and a newline, a line of the real-time data feed, into `output`,
+// which must have room for `kMaxXYJSONLineLength` characters. Returns the number of characters written.
+inline size_t FormatXYJSONLine(double x, double y, char* output) {
+  char* p = output;
+  const auto append = [&p](const char* s, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+      *p++ = s[i];
+    }
+  };
+  append("{\"x\":", 5);
+  p += FormatDouble(x, p);
+  append(",\"y\":", 5);
+  p += FormatDouble(y, p);
+  append("}\n", 2);
+  return p - output;
+}
+
+inline void AppendPointJSON(const Point& point, std::string& output) {
+  char buffer[kMaxPointJSONLength];
+  output.append(buffer, FormatPointJSON(point, buffer));
+}
+
+template <typename F>
+class PointsJSONWriter final {
+ public:
+  // Starts the output with `prefix`, which should open the JSON array the points go into.
+  PointsJSONWriter(F& send, const char* prefix, size_t chunk_size = 1 << 16) : send_(send), chunk_size_(chunk_size) {
+    buffer_.reserve(chunk_size + kMaxPointJSONLength);
+    buffer_ = prefix;
+  }
+
+  void operator()(const Point& point) {
+    if (!first_) {
+      buffer_ += ',';
+    }
+    first_ = false;
+    AppendPointJSON(point, buffer_);
+    if (buffer_.length() >= chunk_size_) {
+      send_(static_cast<const std::string&>(buffer_));
+      buffer_.clear();
+    }
+  }
+
+  // Sends the rest of the data, ending with `suffix`, which should close the array and the enclosing objects.
+  void Finish(const char* suffix) {
+    buffer_ += suffix;
+    send_(static_cast<const std::string&>(buffer_));
+    buffer_.clear();
+  }
+
+ private:
+  F& send_;
+  const size_t chunk_size_;
+  std::string buffer_;
+  bool first_ = true;
+};
+
+// Sends the points of `snapshot` as `{"state":{"points":[...]}}`, the same JSON the cerealized `State` is.
+template <typename F>
+void StreamStateJSON(const PointStore::Snapshot& snapshot, F&& send, size_t chunk_size = 1 << 16) {
+  PointsJSONWriter<F> writer(send, "{\"state\":{\"points\":[", chunk_size);
+  snapshot.ForEach([&writer](const Point& point) { writer(point); });
+  writer.Finish("]}}\n");
+}
+
+// Sends the same JSON as `StreamStateJSON()` does, a few points at a time, to continue from where it has
+// stopped once the other tasks have had their turn.
+template <typename F>
+class StateJSONStream final {
+ public:
+  StateJSONStream(PointStore::Snapshot snapshot, F send, size_t chunk_size = 1 << 16)
+      : snapshot_(std::move(snapshot)),
+        send_(std::move(send)),
+        writer_(send_, "{\"state\":{\"points\":[", chunk_size) {}
+
+  // Sends up to `count` more points, returns false once all of the JSON has been sent.
+  bool Step(size_t count) {
+    if (snapshot_.ForEachFrom(cursor_, count, [this](const Point& point) { writer_(point); })) {
+      return true;
+    }
+    writer_.Finish("]}}\n");
+    return false;
+  }
+
+ private:
+  const PointStore::Snapshot snapshot_;
+  PointStore::Snapshot::Cursor cursor_;
+  F send_;
+  PointsJSONWriter<F> writer_;
+
+  StateJSONStream(const StateJSONStream&) = delete;
+  void operator=(const StateJSONStream&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_POINTS_JSON_H
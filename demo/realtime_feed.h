@@ -0,0 +1,102 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `RealtimeFeed`, which publishes each point of the real-time data feed of `/layout/data`
+// into the `Broadcaster` in all the forms it is streamed in.
+//
+// Channel 0 carries the raw points as JSON lines, channel `r + 1` the completed buckets of rollup resolution
+// `r`, and `kGorillaChannel` the records of `GorillaEncoder`. All the buffers publishing a point needs are
+// owned by the feed, so in the steady state it does not allocate memory.
+
+#ifndef DEMO_REALTIME_FEED_H
+#define DEMO_REALTIME_FEED_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "broadcaster.h"
+#include "gorilla.h"
+#include "points_json.h"
+#include "rollup.h"
+
+namespace demo {
+
+class RealtimeFeed final {
+ public:
+  // The channel of the `/layout/data?encoding=gorilla` stream, past those of the rollups.
+  enum : size_t { kGorillaChannel = Broadcaster::kNoChannel - 1 };
+
+  explicit RealtimeFeed(Broadcaster& broadcaster)
+      : broadcaster_(broadcaster), completed_(rollups_.Resolutions().size()) {
+    gorilla_block_.reserve(GorillaEncoder::kBlockSize * GorillaEncoder::kMaxRecordLength);
+  }
+
+  // Publishes the point `(x, y)`, where `x` is the time in milliseconds. Called from one thread at a time.
+  void Publish(double x, double y) {
+    const size_t completed = rollups_.Add(x, y, completed_.data());
+    for (size_t i = 0; i < completed; ++i) {
+      char line[RollupBucket::kMaxJSONLineLength];
+      broadcaster_.Publish(line, completed_[i].bucket.FormatJSONLine(line), x, completed_[i].resolution + 1);
+    }
+    char line[kMaxXYJSONLineLength];
+    broadcaster_.Publish(line, FormatXYJSONLine(x, y, line), x);
+    // The records are published under the lock, so that a new subscriber gets each of them once,
+    // either within `gorilla_block_` or published.
+    std::lock_guard<std::mutex> lock(gorilla_mutex_);
+    if (gorilla_encoder_.AtBlockStart()) {
+      gorilla_block_.clear();
+    }
+    char record[GorillaEncoder::kMaxRecordLength];
+    const size_t length = gorilla_encoder_.Add(static_cast<int64_t>(x), y, record);
+    gorilla_block_.append(record, length);
+    broadcaster_.Publish(record, length, x, kGorillaChannel);
+  }
+
+  // Subscribes `sink` to the Gorilla-encoded stream, starting with the block being streamed now,
+  // which begins with a key record.
+  void SubscribeGorilla(std::unique_ptr<BroadcastSink> sink, double end_ms) {
+    std::lock_guard<std::mutex> lock(gorilla_mutex_);
+    broadcaster_.Subscribe(std::move(sink), end_ms, kGorillaChannel, gorilla_block_, true);
+  }
+
+  const RollupStore& Rollups() const { return rollups_; }
+
+ private:
+  Broadcaster& broadcaster_;
+  RollupStore rollups_;
+  std::vector<RollupStore::Completed> completed_;  // Only used by `Publish()`.
+  std::mutex gorilla_mutex_;
+  GorillaEncoder gorilla_encoder_;  // Guarded by `gorilla_mutex_`.
+  std::string gorilla_block_;  // Guarded by `gorilla_mutex_`. The records of the current block so far.
+
+  RealtimeFeed(const RealtimeFeed&) = delete;
+  void operator=(const RealtimeFeed&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_REALTIME_FEED_H
@@ -0,0 +1,201 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `RollupStore`, the multi-resolution downsampling of a time series.
+//
+// Each value added goes into one bucket at each of the resolutions, and each bucket keeps the min, max,
+// sum and count of its values. Every resolution is a ring of a fixed number of buckets, so the memory use
+// is bounded no matter how long the series runs. The buckets are updated incrementally as the values come in.
+//
+// `Resolution()` picks the finest resolution that needs at most one bucket per pixel to cover the time window,
+// and still has the beginning of the window in its ring, so that the amount of data to send is bounded by
+// the width of the screen rather than by the length of the window.
+
+#ifndef DEMO_ROLLUP_H
+#define DEMO_ROLLUP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "number_format.h"
+
+namespace demo {
+
+struct RollupBucket {
+  double begin_ms = 0;  // The beginning of the time range of this bucket.
+  double min = 0;
+  double max = 0;
+  double sum = 0;
+  uint64_t count = 0;
+
+  double Mean() const { return count ? sum / count : 0; }
+
+  enum { kMaxJSONLineLength = 4 * kMaxFormattedNumberLength + 64 };
+
+  // Writes `{"x":...,"y":...,"min":...,"max":...,"count":...}\n`, with the mean as `y`, into `output`,
+  // which must have room for `kMaxJSONLineLength` characters. Returns the number of characters written.
+  size_t FormatJSONLine(char* output) const {
+    char* p = output;
+    const auto append = [&p](const char* s) {
+      while (*s) {
+        *p++ = *s++;
+      }
+    };
+    append("{\"x\":");
+    p += FormatDouble(begin_ms, p);
+    append(",\"y\":");
+    p += FormatDouble(Mean(), p);
+    append(",\"min\":");
+    p += FormatDouble(min, p);
+    append(",\"max\":");
+    p += FormatDouble(max, p);
+    append(",\"count\":");
+    p += FormatUnsigned(count, p);
+    append("}\n");
+    return p - output;
+  }
+
+  void AppendJSONLine(std::string& output) const {
+    char buffer[kMaxJSONLineLength];
+    output.append(buffer, FormatJSONLine(buffer));
+  }
+};
+
+class RollupStore final {
+ public:
+  explicit RollupStore(const std::vector<uint64_t>& resolutions_ms = {100, 1000, 10000, 60000, 600000, 3600000},
+                       size_t buckets_per_resolution = 4096)
+      : resolutions_ms_(resolutions_ms),
+        rings_(resolutions_ms.size(), std::vector<RollupBucket>(buckets_per_resolution)),
+        latest_begin_(resolutions_ms.size()) {}
+
+  const std::vector<uint64_t>& Resolutions() const { return resolutions_ms_; }
+
+  // A bucket completed by `Add()`, and the index of its resolution.
+  struct Completed {
+    size_t resolution;
+    RollupBucket bucket;
+  };
+
+  // Adds the value to the buckets of all the resolutions. For every resolution at which `t_ms` starts
+  // a new bucket, writes the previous, now complete, one into `completed`, which must have room for
+  // `Resolutions().size()` of them, unless it is null. Returns the number of the completed buckets.
+  // Values too old to fit into the ring of some resolution are ignored at that resolution.
+  size_t Add(double t_ms, double value, Completed* completed = nullptr) {
+    size_t count = 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t r = 0; r < rings_.size(); ++r) {
+      const double begin = BucketBegin(r, t_ms);
+      if (has_data_) {
+        if (begin > latest_begin_[r]) {
+          if (completed) {
+            completed[count].resolution = r;
+            completed[count].bucket = Slot(r, latest_begin_[r]);
+          }
+          ++count;
+        } else if (begin < OldestBegin(r)) {
+          continue;
+        }
+      }
+      RollupBucket& bucket = Slot(r, begin);
+      if (!bucket.count || bucket.begin_ms != begin) {
+        bucket = RollupBucket();
+        bucket.begin_ms = begin;
+        bucket.min = bucket.max = value;
+      }
+      bucket.min = std::min(bucket.min, value);
+      bucket.max = std::max(bucket.max, value);
+      bucket.sum += value;
+      ++bucket.count;
+      if (!has_data_ || begin > latest_begin_[r]) {
+        latest_begin_[r] = begin;
+      }
+    }
+    has_data_ = true;
+    return count;
+  }
+
+  // The index of the resolution to show the window from `begin_ms` to `end_ms` on `width` pixels.
+  size_t Resolution(double begin_ms, double end_ms, size_t width) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const double window = std::max(end_ms - begin_ms, 0.0);
+    width = std::max(width, static_cast<size_t>(1));
+    for (size_t r = 0; r < resolutions_ms_.size(); ++r) {
+      if (window / resolutions_ms_[r] <= width && (!has_data_ || OldestBegin(r) <= begin_ms)) {
+        return r;
+      }
+    }
+    return resolutions_ms_.size() - 1;
+  }
+
+  // The complete non-empty buckets of the given resolution that overlap with `[begin_ms, end_ms)`,
+  // oldest first. The most recent bucket is not returned, since it is still being filled.
+  std::vector<RollupBucket> Query(size_t resolution, double begin_ms, double end_ms) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<RollupBucket> result;
+    if (has_data_) {
+      const double step = static_cast<double>(resolutions_ms_[resolution]);
+      const double first = std::max(BucketBegin(resolution, begin_ms), OldestBegin(resolution));
+      const double last = std::min(end_ms, latest_begin_[resolution]);
+      for (double t = first; t < last; t += step) {
+        const RollupBucket& bucket = rings_[resolution][Index(resolution, t)];
+        if (bucket.count && bucket.begin_ms == t) {
+          result.push_back(bucket);
+        }
+      }
+    }
+    return result;
+  }
+
+ private:
+  double BucketBegin(size_t r, double t_ms) const {
+    const double step = static_cast<double>(resolutions_ms_[r]);
+    return std::floor(t_ms / step) * step;
+  }
+
+  // The beginning of the oldest bucket that can still be in the ring of the resolution.
+  double OldestBegin(size_t r) const {
+    return latest_begin_[r] - static_cast<double>(rings_[r].size() - 1) * resolutions_ms_[r];
+  }
+
+  size_t Index(size_t r, double begin) const {
+    return static_cast<size_t>(std::llround(begin / resolutions_ms_[r])) % rings_[r].size();
+  }
+
+  RollupBucket& Slot(size_t r, double begin) { return rings_[r][Index(r, begin)]; }
+
+  const std::vector<uint64_t> resolutions_ms_;
+  mutable std::mutex mutex_;
+  std::vector<std::vector<RollupBucket>> rings_;
+  std::vector<double> latest_begin_;  // The beginning of the most recent bucket of each resolution.
+  bool has_data_ = false;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_ROLLUP_H
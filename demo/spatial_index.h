@@ -0,0 +1,263 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `SpatialIndex`, the uniform grid over the points for region and nearest neighbor queries.
+//
+// The square `[min, max)^2` is split into `cells_per_side^2` cells, and each cell keeps its points in
+// the structure-of-arrays layout: the `x`-s, the `y`-s and the labels in three contiguous arrays, so that
+// scanning a cell is a tight loop over plain doubles the compiler can vectorize. The cells on the border of
+// the grid extend to infinity, and hold the points outside the square. The points with a NaN coordinate are
+// not indexed, since no query can match them. The cells are guarded by a fixed set of striped
+// mutexes, so the writers adding points to different cells rarely contend. The queries copy the matching
+// points of each cell out under its lock, and call back with them after releasing it.
+//
+// A query only looks at the cells that overlap with the region, so its cost is proportional to the area
+// of the region, not to the total number of points. The `k` nearest neighbors are found by scanning
+// the rings of cells around the query point, outwards, until the next ring can not be any closer.
+//
+// The index keeps its own copy of each point, 17 bytes of it, on top of the 16 bytes and a bit in `PointStore`.
+// The cells could hold the positions of the points in the store instead, which would save a third of the
+// memory, but then a scan would chase the points across the chunks of all the shards of the store instead of
+// reading three contiguous arrays, and the positions would take 8 bytes per point of their own anyway.
+
+#ifndef DEMO_SPATIAL_INDEX_H
+#define DEMO_SPATIAL_INDEX_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "point.h"
+
+namespace demo {
+
+class SpatialIndex final {
+ public:
+  explicit SpatialIndex(double min = -1, double max = 1, size_t cells_per_side = 256)
+      : min_(min),
+        cell_size_((max - min) / cells_per_side),
+        side_(cells_per_side),
+        cells_(cells_per_side * cells_per_side),
+        mutexes_(kStripes) {}
+
+  void Add(const Point& point) { Add(&point, &point + 1); }
+
+  template <typename IT>
+  void Add(IT begin, IT end) {
+    for (IT it = begin; it != end; ++it) {
+      const Point& point = *it;
+      if (std::isnan(point.x) || std::isnan(point.y)) {
+        continue;
+      }
+      const size_t index = CellIndex(point.x, point.y);
+      std::lock_guard<std::mutex> lock(mutexes_[index % kStripes]);
+      Cell& cell = cells_[index];
+      cell.x.push_back(point.x);
+      cell.y.push_back(point.y);
+      cell.label.push_back(point.label);
+      ++size_;
+    }
+  }
+
+  // The number of points indexed.
+  size_t Size() const { return size_; }
+
+  // Calls `f(const Point&)` for each point with `x0 <= x <= x1` and `y0 <= y <= y1`, in no particular order.
+  template <typename F>
+  void ForEachInBox(double x0, double y0, double x1, double y1, F&& f) const {
+    std::vector<Point> found;
+    ForEachCell(x0, y0, x1, y1, [&](size_t index, bool inside) {
+      found.clear();
+      const Cell& cell = cells_[index];
+      std::lock_guard<std::mutex> lock(mutexes_[index % kStripes]);
+      if (inside) {
+        for (size_t i = 0; i < cell.x.size(); ++i) {
+          found.emplace_back(cell.x[i], cell.y[i], cell.label[i]);
+        }
+      } else {
+        for (size_t i = 0; i < cell.x.size(); ++i) {
+          if ((cell.x[i] >= x0) & (cell.x[i] <= x1) & (cell.y[i] >= y0) & (cell.y[i] <= y1)) {
+            found.emplace_back(cell.x[i], cell.y[i], cell.label[i]);
+          }
+        }
+      }
+    }, [&]() {
+      for (const Point& point : found) {
+        f(point);
+      }
+    });
+  }
+
+  // Calls `f(const Point&)` for each point within the distance `r` from `(x, y)`, in no particular order.
+  template <typename F>
+  void ForEachInRadius(double x, double y, double r, F&& f) const {
+    const double r2 = r * r;
+    std::vector<Point> found;
+    ForEachCell(x - r, y - r, x + r, y + r, [&](size_t index, bool) {
+      found.clear();
+      const Cell& cell = cells_[index];
+      std::lock_guard<std::mutex> lock(mutexes_[index % kStripes]);
+      for (size_t i = 0; i < cell.x.size(); ++i) {
+        const double dx = cell.x[i] - x;
+        const double dy = cell.y[i] - y;
+        if (dx * dx + dy * dy <= r2) {
+          found.emplace_back(cell.x[i], cell.y[i], cell.label[i]);
+        }
+      }
+    }, [&]() {
+      for (const Point& point : found) {
+        f(point);
+      }
+    });
+  }
+
+  // The `k` points closest to `(x, y)`, closest first. None if `(x, y)` is not a finite point.
+  std::vector<Point> Nearest(double x, double y, size_t k) const {
+    // A max-heap of the best candidates so far, by the squared distance.
+    std::vector<std::pair<double, Point>> best;
+    const auto less = [](const std::pair<double, Point>& a, const std::pair<double, Point>& b) {
+      return a.first < b.first;
+    };
+    const auto scan = [&](size_t index) {
+      const Cell& cell = cells_[index];
+      std::lock_guard<std::mutex> lock(mutexes_[index % kStripes]);
+      for (size_t i = 0; i < cell.x.size(); ++i) {
+        const double dx = cell.x[i] - x;
+        const double dy = cell.y[i] - y;
+        const double d2 = dx * dx + dy * dy;
+        if (best.size() < k) {
+          best.emplace_back(d2, Point(cell.x[i], cell.y[i], cell.label[i]));
+          std::push_heap(best.begin(), best.end(), less);
+        } else if (d2 < best.front().first) {
+          std::pop_heap(best.begin(), best.end(), less);
+          best.back() = std::make_pair(d2, Point(cell.x[i], cell.y[i], cell.label[i]));
+          std::push_heap(best.begin(), best.end(), less);
+        }
+      }
+    };
+    if (k && std::isfinite(x) && std::isfinite(y)) {
+      const int64_t cx = Clamp(Coordinate(x));
+      const int64_t cy = Clamp(Coordinate(y));
+      const int64_t side = static_cast<int64_t>(side_);
+      const int64_t rings = std::max(std::max(cx, side - 1 - cx), std::max(cy, side - 1 - cy));
+      for (int64_t ring = 0; ring <= rings; ++ring) {
+        // The points in the cells of this ring are at least `ring - 1` cell sizes away from `(x, y)`.
+        if (ring > 1 && best.size() == k && best.front().first <= Square((ring - 1) * cell_size_)) {
+          break;
+        }
+        for (int64_t j = cy - ring; j <= cy + ring; ++j) {
+          if (j < 0 || j >= side) {
+            continue;
+          }
+          // The full rows at the top and at the bottom of the ring, and only its ends in between.
+          const int64_t step = (j == cy - ring || j == cy + ring) ? 1 : std::max(2 * ring, int64_t(1));
+          for (int64_t i = cx - ring; i <= cx + ring; i += step) {
+            if (i >= 0 && i < side) {
+              scan(static_cast<size_t>(j * side + i));
+            }
+          }
+        }
+      }
+    }
+    std::sort_heap(best.begin(), best.end(), less);
+    std::vector<Point> result;
+    result.reserve(best.size());
+    for (const auto& candidate : best) {
+      result.push_back(candidate.second);
+    }
+    return result;
+  }
+
+ private:
+  enum { kStripes = 1024 };
+
+  struct Cell {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<uint8_t> label;
+  };
+
+  static double Square(double x) { return x * x; }
+
+  // The grid coordinate of `v`, unbounded. Zero for NaN, which has no place on the grid, and which
+  // `std::min()` and `std::max()` would pass through to the cast.
+  int64_t Coordinate(double v) const {
+    const double c = std::floor((v - min_) / cell_size_);
+    return std::isnan(c) ? 0 : static_cast<int64_t>(std::max(std::min(c, 1e18), -1e18));
+  }
+
+  int64_t Clamp(int64_t c) const { return std::max(std::min(c, static_cast<int64_t>(side_) - 1), int64_t(0)); }
+
+  size_t CellIndex(double x, double y) const {
+    return static_cast<size_t>(Clamp(Coordinate(y)) * static_cast<int64_t>(side_) + Clamp(Coordinate(x)));
+  }
+
+  // Calls `collect(index, inside)` and then `emit()` for each cell that overlaps with the box,
+  // with `inside` set if the cell is entirely within the box.
+  template <typename COLLECT, typename EMIT>
+  void ForEachCell(double x0, double y0, double x1, double y1, COLLECT&& collect, EMIT&& emit) const {
+    if (!(x0 <= x1 && y0 <= y1)) {
+      return;
+    }
+    const int64_t i0 = Clamp(Coordinate(x0));
+    const int64_t i1 = Clamp(Coordinate(x1));
+    const int64_t j0 = Clamp(Coordinate(y0));
+    const int64_t j1 = Clamp(Coordinate(y1));
+    const int64_t side = static_cast<int64_t>(side_);
+    // The margin keeps the points on the edges of the cells, which may have been rounded either way,
+    // from being taken as inside the box without checking them.
+    const double margin = cell_size_ * 1e-9;
+    const auto inside = [this, margin, side](int64_t c, double lo, double hi) {
+      return c > 0 && c < side - 1 && min_ + c * cell_size_ - margin >= lo &&
+             min_ + (c + 1) * cell_size_ + margin <= hi;
+    };
+    for (int64_t j = j0; j <= j1; ++j) {
+      const bool inside_y = inside(j, y0, y1);
+      for (int64_t i = i0; i <= i1; ++i) {
+        const bool inside_x = inside(i, x0, x1);
+        collect(static_cast<size_t>(j * side + i), inside_x && inside_y);
+        emit();
+      }
+    }
+  }
+
+  const double min_;
+  const double cell_size_;
+  const size_t side_;
+  std::vector<Cell> cells_;  // Row by row.
+  mutable std::vector<std::mutex> mutexes_;
+  std::atomic_size_t size_{0};
+
+  SpatialIndex(const SpatialIndex&) = delete;
+  void operator=(const SpatialIndex&) = delete;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_SPATIAL_INDEX_H
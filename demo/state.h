@@ -27,129 +27,331 @@ SOFTWARE.
 #ifndef DEMO_STATE_H
 #define DEMO_STATE_H
 
-#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "../Bricks/net/api/api.h"
 #include "../Bricks/net/http/codes.h"
 #include "../Bricks/cerealize/cerealize.h"
-#include "../Bricks/graph/gnuplot.h"
+
+#include "classifier.h"
+#include "executor.h"
+#include "ingest.h"
+#include "metrics.h"
+#include "point.h"
+#include "point_log.h"
+#include "point_ring.h"
+#include "point_store.h"
+#include "points_json.h"
+#include "spatial_index.h"
+#include "svg.h"
 
 namespace demo {
 
 using bricks::net::api::Request;
 using bricks::net::HTTPResponseCode;
+using bricks::net::HTTPServerConnection;
 using bricks::JSONParseException;
 using namespace bricks::cerealize;
-using namespace bricks::gnuplot;
+
+// The sizes of the parts of a `State`, and the limit of its points, so that many states fit into one process.
+struct StateOptions {
+  size_t index_cells_per_side = 256;
+  size_t live_capacity_log2 = 16;
+  size_t max_points = 0;  // Zero for no limit.
+};
 
 struct State {
-  struct Point {
-    double x;
-    double y;
-    bool label;
-    Point(double x = 0, double y = 0, bool label = false) : x(x), y(y), label(label) {}
-    template <typename A>
-    void serialize(A& ar) {
-      ar(CEREAL_NVP(x), CEREAL_NVP(y), CEREAL_NVP(label));
-    }
-  };
+  typedef demo::Point Point;
 
-  std::vector<Point> points;
+  // The most points `?query=knn` responds with, whatever its `k` is.
+  enum { kMaxNearest = 10000 };
+
+  PointStore points;
+  SpatialIndex index;  // The same points, for the region and nearest neighbor queries.
+  ClassifierEvaluator evaluator;  // How the labels of the points agree with `ClassBoundaries`.
+  PointRing live;  // The points added from now on, for the live subscribers. Not the replayed ones.
   template <typename A>
-  void serialize(A& ar) {
-    ar(CEREAL_NVP(points));
+  void save(A& ar) const {
+    const std::vector<Point> snapshot = points.GetSnapshot().ToVector();
+    ar(cereal::make_nvp("points", snapshot));
+  }
+
+  // Restores the points from the log in `log_dir`, and keeps logging all the new ones there.
+  // With an empty `log_dir`, the points only live in memory.
+  explicit State(const std::string& log_dir = "", const StateOptions& options = StateOptions())
+      : index(-1, 1, options.index_cells_per_side),
+        live(options.live_capacity_log2),
+        max_points_(options.max_points) {
+    if (!log_dir.empty()) {
+      PointLog::Replay(log_dir, [this](const Point* begin, const Point* end) {
+        points.Add(begin, end);
+        index.Add(begin, end);
+        evaluator.Add(begin, end);
+      });
+      reserved_ = points.Size();
+      log_.reset(new PointLog(log_dir));
+    }
   }
 
-  State() {}
+  // Merges the closed segments of the log into a snapshot, so that the next `State` of the same directory
+  // replays fewer files.
+  void CompactLog() {
+    if (log_) {
+      log_->Compact();
+    }
+  }
 
   static void ClassBoundaries(Request r) {
+    // The boundaries never change, so they are rendered once.
+    static const std::string svg = RenderClassBoundaries();
+    Respond(r, svg, HTTPResponseCode::OK, "image/svg+xml");
+  }
+
+  static std::string RenderClassBoundaries() {
     const size_t N = 60;
-    r.connection.SendHTTPResponse(GNUPlot()
-                                      .Title("Class boundaries")
-                                      .NoKey()
-                                      .XRange(-1.2, +1.2)
-                                      .YRange(-1.2, +1.2)
-                                      .Grid("back")
-                                      .Plot(WithMeta([](Plotter& p) {
-                                                       for (size_t i = 0; i < N; ++i) {
-                                                         const double t = M_PI * 2 * i / (N - 1);
-                                                         p(sin(t), cos(t));
-                                                       }
-                                                     })
-                                                .LineWidth(5)
-                                                .Color("rgb 'black'"))
-                                      .Plot(WithMeta([](Plotter& p) {
-                                                       for (size_t i = 0; i < N / 2; ++i) {
-                                                         const double t = M_PI * i / (N / 2 - 1);
-                                                         p(+sin(t) * 0.5, cos(t) * 0.5 + 0.5);
-                                                       }
-                                                     })
-                                                .LineWidth(5)
-                                                .Color("rgb 'black'"))
-                                      .Plot(WithMeta([](Plotter& p) {
-                                                       for (size_t i = 0; i < N / 2; ++i) {
-                                                         const double t = M_PI * i / (N / 2 - 1);
-                                                         p(-sin(t) * 0.5, cos(t) * 0.5 - 0.5);
-                                                       }
-                                                     })
-                                                .LineWidth(5)
-                                                .Color("rgb 'black'"))
-                                      .OutputFormat("svg"),
-                                  HTTPResponseCode::OK,
-                                  "image/svg+xml");
+    std::vector<std::pair<double, double>> circle, upper, lower;
+    for (size_t i = 0; i < N; ++i) {
+      const double t = M_PI * 2 * i / (N - 1);
+      circle.emplace_back(sin(t), cos(t));
+    }
+    for (size_t i = 0; i < N / 2; ++i) {
+      const double t = M_PI * i / (N / 2 - 1);
+      upper.emplace_back(+sin(t) * 0.5, cos(t) * 0.5 + 0.5);
+      lower.emplace_back(-sin(t) * 0.5, cos(t) * 0.5 - 0.5);
+    }
+    const SVGPlot plot = SVGPlot()
+                             .Title("Class boundaries")
+                             .NoKey()
+                             .XRange(-1.2, +1.2)
+                             .YRange(-1.2, +1.2)
+                             .Grid()
+                             .Plot(SVGPlot::Series().LineWidth(5).Color("black"))
+                             .Plot(SVGPlot::Series().LineWidth(5).Color("black"))
+                             .Plot(SVGPlot::Series().LineWidth(5).Color("black"));
+    std::vector<std::string> data(3);
+    plot.AppendLine(circle, data[0]);
+    plot.AppendLine(upper, data[1]);
+    plot.AppendLine(lower, data[2]);
+    return plot.Render(data);
+  }
+
+  bool Add(const Point& point) { return Add(&point, &point + 1) == 1; }
+
+  // Returns the number of points added, which is less than given once the `max_points` quota is reached.
+  template <typename IT>
+  size_t Add(IT begin, IT end) {
+    size_t count = std::distance(begin, end);
+    if (max_points_) {
+      size_t reserved = reserved_;
+      size_t allowed;
+      do {
+        allowed = std::min(count, max_points_ - std::min(reserved, max_points_));
+      } while (allowed && !reserved_.compare_exchange_weak(reserved, reserved + allowed));
+      if (allowed < count) {
+        count = allowed;
+        end = begin;
+        std::advance(end, count);
+      }
+      if (!count) {
+        return 0;
+      }
+    }
+    if (log_) {
+      log_->Append(begin, end);
+    }
+    points.Add(begin, end);
+    index.Add(begin, end);
+    evaluator.Add(begin, end);
+    live.Push(begin, end);
+    return count;
+  }
+
+  // The response to adding a single point, the same on the main and on the keep-alive port.
+  struct AddResponse {
+    HTTPResponseCode code;
+    const char* body;
+    explicit AddResponse(bool added)
+        : code(added ? HTTPResponseCode::OK : HTTPResponseCode::RequestEntityTooLarge),
+          body(added ? "ADDED\n" : "QUOTA EXCEEDED\n") {}
+  };
+
+  // Adds the point of `POST /demo_id?x=&y=&label=`, where `parameter(name)` is the value of the URL parameter.
+  template <typename F>
+  AddResponse AddQueryPoint(F&& parameter) {
+    return AddResponse(Add(Point(atof(parameter("x").c_str()),
+                                 atof(parameter("y").c_str()),
+                                 !!atoi(parameter("label").c_str()))));
   }
 
-  void DemoRequest(Request r) {
+  // GET responds with how the labels of all the points added so far agree with the class boundaries.
+  // POST scores the points of the body, as NDJSON or as `?format=binary`, without adding them.
+  void Score(Request r) {
+    Evaluation evaluation;
     if (r.http.Method() == "POST") {
+      if (r.http.HasBody()) {
+        const auto add = [&evaluation](const Point* begin, const Point* end) {
+          evaluation.confusion += ScorePoints(begin, end);
+        };
+        const std::string& body = r.http.Body();
+        evaluation.rejected = (r.url.query["format"] == "binary") ? ParseBinaryPoints(body, add).rejected
+                                                                   : ParseNDJSONPoints(body, add).rejected;
+      }
+    } else {
+      evaluation.confusion = evaluator.Matrix();
+    }
+    Respond(r, evaluation, "score");
+  }
+
+  // The `keep_alive` is held until the response is sent, which may be after this call returns.
+  void DemoRequest(Request r, std::shared_ptr<void> keep_alive = nullptr) {
+    if (r.http.Method() == "POST") {
+      const std::string format = r.url.query["format"];
       // TODO(dkorolev): This should get simpler once Bricks 1.0 is out, the `.http.` will go away.
-      if (!r.http.HasBody()) {
-        points.emplace_back(atof(r.url.query["x"].c_str()),
-                            atof(r.url.query["y"].c_str()),
-                            !!atoi(r.url.query["label"].c_str()));
-        r.connection.SendHTTPResponse("ADDED\n");
+      if (format == "ndjson" || format == "binary") {
+        // Bulk upload, the response is the number of accepted and rejected points.
+        // The points over the quota are rejected.
+        IngestResult result;
+        if (r.http.HasBody()) {
+          size_t over_quota = 0;
+          const auto add = [this, &over_quota](const Point* begin, const Point* end) {
+            over_quota += (end - begin) - Add(begin, end);
+          };
+          result = (format == "ndjson") ? ParseNDJSONPoints(r.http.Body(), add)
+                                        : ParseBinaryPoints(r.http.Body(), add);
+          result.accepted -= over_quota;
+          result.rejected += over_quota;
+        }
+        Respond(r, result, "result");
+      } else if (!r.http.HasBody()) {
+        const AddResponse response = AddQueryPoint([&r](const char* name) { return r.url.query[name]; });
+        Respond(r, response.body, response.code);
       } else {
         try {
-          points.push_back(std::move(JSONParse<Point>(r.http.Body())));
-          r.connection.SendHTTPResponse("ADDED\n");
+          const AddResponse response(Add(JSONParse<Point>(r.http.Body())));
+          Respond(r, response.body, response.code);
         } catch (const JSONParseException& e) {
           // For the purposes of this demo, don't do anything in `catch`.
           // The framework should return "<h1>INTERNAL SERVER ERROR</h1>\n".
         }
       }
+    } else if (!r.url.query["query"].empty()) {
+      Query(std::move(r));
     } else if (r.url.query["format"] == "svg") {
-      // TODO(dkorolev): Change colors, make it red vs. blue.
-      r.connection.SendHTTPResponse(GNUPlot()
-                                        .Title("State.")
-                                        .KeyTitle("Legend")
-                                        .XRange(-1.1, +1.1)
-                                        .YRange(-1.1, +1.1)
-                                        .Grid("back")
-                                        .Plot(WithMeta([this](Plotter& plotter) {
-                                                         for (const auto& p : points) {
-                                                           if (!p.label) {
-                                                             plotter(p.x, p.y);
-                                                           }
-                                                         }
-                                                       })
-                                                  .Name("Label \"false\"")
-                                                  .AsPoints())
-                                        .Plot(WithMeta([this](Plotter& plotter) {
-                                                         for (const auto& p : points) {
-                                                           if (p.label) {
-                                                             plotter(p.x, p.y);
-                                                           }
-                                                         }
-                                                       })
-                                                  .Name("Label \"true\"")
-                                                  .AsPoints())
-                                        .OutputFormat("svg"),
-                                    HTTPResponseCode::OK,
-                                    "image/svg+xml");
+      Respond(r, points_plot_.Render(points), HTTPResponseCode::OK, "image/svg+xml");
+    } else {
+      // Stream the JSON out in chunks as the snapshot is being walked, instead of building it in memory,
+      // and in steps, so that a large state does not keep the thread from the other requests meanwhile.
+      const auto response = std::make_shared<StateResponse>(std::move(r), points.GetSnapshot());
+      Executor::Continue(
+          [response, keep_alive]() { return response->json.Step(StateResponse::kPointsPerStep); });
+    }
+  }
+
+  // Responds with `{"points":[...]}` for one of:
+  //   `?query=bbox&x0=...&y0=...&x1=...&y1=...`, the points within the box,
+  //   `?query=radius&x=...&y=...&r=...`, the points within the distance `r` from `(x, y)`, and
+  //   `?query=knn&x=...&y=...&k=...`, the `k` points nearest to `(x, y)`, closest first, up to `kMaxNearest`.
+  // Responds with a 400 to an unknown query, or to the coordinates or the distance that are not finite numbers.
+  void Query(Request r) {
+    static const char* const kBoxParameters[] = {"x0", "y0", "x1", "y1"};
+    static const char* const kCircleParameters[] = {"x", "y", "r"};
+    auto& q = r.url.query;
+    const std::string query = q["query"];
+    if (query != "bbox" && query != "radius" && query != "knn") {
+      Respond(r, "Unknown query.\n", HTTPResponseCode::BadRequest);
+      return;
+    }
+    const bool box = (query == "bbox");
+    const size_t count = box ? 4 : (query == "radius") ? 3 : 2;
+    double v[4];
+    for (size_t i = 0; i < count; ++i) {
+      v[i] = atof(q[box ? kBoxParameters[i] : kCircleParameters[i]].c_str());
+      if (!std::isfinite(v[i])) {
+        Respond(r, "The query parameters should be finite numbers.\n", HTTPResponseCode::BadRequest);
+        return;
+      }
+    }
+    auto response = RespondChunked(r, HTTPResponseCode::OK, "application/json");
+    const auto send = [&response](const std::string& chunk) { RespondChunk(response, chunk); };
+    PointsJSONWriter<decltype(send)> writer(send, "{\"points\":[");
+    const auto emit = [&writer](const Point& point) { writer(point); };
+    if (box) {
+      index.ForEachInBox(v[0], v[1], v[2], v[3], emit);
+    } else if (query == "radius") {
+      index.ForEachInRadius(v[0], v[1], v[2], emit);
     } else {
-      r.connection.SendHTTPResponse(*this, "state", HTTPResponseCode::OK, "application/json");
+      const long k = strtol(q["k"].c_str(), nullptr, 10);
+      const size_t n = std::min(static_cast<size_t>(std::max(k, 1l)), static_cast<size_t>(kMaxNearest));
+      for (const Point& point : index.Nearest(v[0], v[1], n)) {
+        emit(point);
+      }
     }
+    writer.Finish("]}\n");
   }
+
+ private:
+  // The response with all the points, which outlives the call to `DemoRequest()`.
+  struct StateResponse final {
+    enum { kPointsPerStep = 1 << 14 };
+    Request request;
+    HTTPServerConnection::ChunkedResponseSender response;
+    StateJSONStream<std::function<void(const std::string&)>> json;
+    StateResponse(Request r, PointStore::Snapshot snapshot)
+        : request(std::move(r)),
+          response(RespondChunked(request, HTTPResponseCode::OK, "application/json")),
+          json(std::move(snapshot), [this](const std::string& chunk) { response.Send(chunk); }) {}
+  };
+
+  // Renders the points as SVG. Keeps the markup of the points of each label, and only appends
+  // the points added since the previous call to it, instead of re-rendering all of them.
+  class PointsPlot final {
+   public:
+    PointsPlot()
+        : plot_(SVGPlot()
+                    .Title("State.")
+                    .KeyTitle("Legend")
+                    .XRange(-1.1, +1.1)
+                    .YRange(-1.1, +1.1)
+                    .Grid()
+                    .Plot(SVGPlot::Series("Label \"false\"").AsPoints())
+                    .Plot(SVGPlot::Series("Label \"true\"").AsPoints())),
+          data_(2) {}
+
+    std::string Render(const PointStore& store) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const PointStore::Snapshot snapshot = store.GetSnapshot();
+      if (svg_.empty() || snapshot.Size() != rendered_.Size()) {
+        snapshot.ForEachSince(rendered_, [this](const Point& p) {
+          plot_.AppendPoint(p.label ? 1 : 0, p.x, p.y, data_[p.label ? 1 : 0]);
+        });
+        rendered_ = snapshot;
+        svg_ = plot_.Render(data_);
+      }
+      return svg_;
+    }
+
+   private:
+    const SVGPlot plot_;
+    std::mutex mutex_;
+    std::vector<std::string> data_;  // The markup of the points, one string per label.
+    PointStore::Snapshot rendered_;  // The points already in `data_`.
+    std::string svg_;
+  };
+
+  const size_t max_points_;
+  std::atomic_size_t reserved_{0};  // The number of points added or being added, for the quota.
+  std::unique_ptr<PointLog> log_;
+  PointsPlot points_plot_;
 };
 
 }  // namespace demo
@@ -0,0 +1,434 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `StaticFileCache`, which holds the static files of the frontend ready to be served.
+//
+// Each file is read, hashed and compressed once, at startup. The hash of the content makes a strong `ETag`,
+// so that a browser revalidating its cached copy with `If-None-Match` gets an empty `304 Not Modified`.
+// The compressed variants are different representations, so each has its own tag, the one of the identity
+// with the encoding appended; a tag of any of them revalidates the file, as they all change together.
+// The gzip variant is built with zlib and kept only when it is smaller; a brotli variant is picked up from
+// a precompressed `<file>.br` next to the file, if the frontend build produced one.
+// The bodies are owned by the cache and are sent by reference, with no per-request copies or allocations.
+//
+// For a fast start, `LazyStaticFiles` only lists the files at startup, and each file is mapped into memory,
+// hashed and compressed on its first request, or by `Warm()` ahead of it. The HTTP server routes by the exact
+// path, so each file still gets a route of its own, and the startup time still grows with the number of files,
+// but no longer with their size.
+// The identity body of a mapped file is only copied out of the mapping once a request needs it, since most
+// browsers take the compressed variants.
+
+#ifndef DEMO_STATIC_FILES_H
+#define DEMO_STATIC_FILES_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../Bricks/net/api/api.h"
+
+#include "metrics.h"
+
+namespace demo {
+
+namespace impl {
+
+inline bool EqualIgnoringCase(const std::string& a, const std::string& b) {
+  if (a.length() != b.length()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.length(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The value of the HTTP header, looked up case-insensitively, or an empty string.
+template <typename HEADERS>
+std::string HeaderValue(const HEADERS& headers, const std::string& name) {
+  for (const auto& header : headers) {
+    if (EqualIgnoringCase(header.first, name)) {
+      return header.second;
+    }
+  }
+  return "";
+}
+
+// Calls `f(token, parameters)` for each element of a comma-separated header value, with the whitespace trimmed.
+template <typename F>
+void ForEachListElement(const std::string& value, F&& f) {
+  size_t i = 0;
+  while (i < value.length()) {
+    size_t end = value.find(',', i);
+    if (end == std::string::npos) {
+      end = value.length();
+    }
+    std::string element = value.substr(i, end - i);
+    const size_t semicolon = element.find(';');
+    std::string parameters = (semicolon == std::string::npos) ? "" : element.substr(semicolon + 1);
+    element.resize(std::min(element.length(), semicolon));
+    const size_t first = element.find_first_not_of(" \t");
+    const size_t last = element.find_last_not_of(" \t");
+    if (first != std::string::npos) {
+      f(element.substr(first, last - first + 1), parameters);
+    }
+    i = end + 1;
+  }
+}
+
+// The 64-bit FNV-1a hash of the content.
+inline uint64_t ContentHash(const char* data, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+  }
+  return hash;
+}
+
+inline uint64_t ContentHash(const std::string& content) {
+  return ContentHash(content.data(), content.length());
+}
+
+// Compresses the content into the gzip format, or returns an empty string if zlib fails.
+inline std::string Gzip(const char* data, size_t size) {
+  z_stream stream = z_stream();
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return "";
+  }
+  std::string result(deflateBound(&stream, size), '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream.avail_in = static_cast<uInt>(size);
+  stream.next_out = reinterpret_cast<Bytef*>(&result[0]);
+  stream.avail_out = static_cast<uInt>(result.length());
+  const bool ok = (deflate(&stream, Z_FINISH) == Z_STREAM_END);
+  result.resize(stream.total_out);
+  deflateEnd(&stream);
+  return ok ? result : "";
+}
+
+inline std::string Gzip(const std::string& content) { return Gzip(content.data(), content.length()); }
+
+// The contents of a file mapped into memory, read-only. Empty if the file is empty or can not be mapped,
+// and not `Read()` in the latter case.
+class MappedFile final {
+ public:
+  explicit MappedFile(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+      if (info.st_size == 0) {
+        read_ = true;
+      } else {
+        void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+          data_ = static_cast<const char*>(data);
+          size_ = static_cast<size_t>(info.st_size);
+          read_ = true;
+        }
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  const char* Data() const { return data_; }
+  size_t Size() const { return size_; }
+  bool Read() const { return read_; }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool read_ = false;
+
+  MappedFile(const MappedFile&) = delete;
+  void operator=(const MappedFile&) = delete;
+};
+
+}  // namespace impl
+
+struct StaticFile {
+  std::string content_type;
+  std::string etag;  // Of the identity, quoted, as it goes into the header.
+  std::string gzip;  // Empty if compression does not make the file smaller.
+  std::string brotli;  // Empty if there was no precompressed `.br` file.
+
+  StaticFile(const std::string& content_type, const std::string& content, const std::string& brotli = "")
+      : content_type(content_type), brotli(brotli), identity_(content) {
+    Prepare(content.data(), content.length());
+  }
+
+  // Serves the file mapped into memory, which it only copies out of on the first request for the identity.
+  StaticFile(const std::string& content_type,
+             std::shared_ptr<const impl::MappedFile> mapped,
+             const std::string& brotli = "")
+      : content_type(content_type),
+        brotli(brotli),
+        mapped_(std::move(mapped)),
+        identity_once_(std::make_shared<std::once_flag>()) {
+    Prepare(mapped_->Data(), mapped_->Size());
+  }
+
+  const std::string& Identity() const {
+    if (mapped_) {
+      std::call_once(*identity_once_, [this]() {
+        if (mapped_->Size()) {
+          identity_.assign(mapped_->Data(), mapped_->Size());
+        }
+      });
+    }
+    return identity_;
+  }
+
+  // The `ETag` of the variant of the body with the `encoding`, as set by `Body()`.
+  const std::string& ETag(const std::string& encoding) const {
+    if (encoding == "br") {
+      return brotli_etag_;
+    } else if (encoding == "gzip") {
+      return gzip_etag_;
+    } else {
+      return etag;
+    }
+  }
+
+  // Whether the `If-None-Match` header value matches the current version of the file, in any encoding.
+  // Uses the weak comparison, as RFC 7232 requires for `If-None-Match`.
+  bool NotModified(const std::string& if_none_match) const {
+    bool match = false;
+    impl::ForEachListElement(if_none_match, [this, &match](const std::string& tag, const std::string&) {
+      const std::string opaque = (tag.compare(0, 2, "W/") == 0) ? tag.substr(2) : tag;
+      if (opaque == "*" || opaque == etag || opaque == gzip_etag_ || opaque == brotli_etag_) {
+        match = true;
+      }
+    });
+    return match;
+  }
+
+  // The best variant of the body for the `Accept-Encoding` header value, preferring brotli, then gzip.
+  // Sets `encoding` to the value of the `Content-Encoding` header to send, empty for the identity.
+  const std::string& Body(const std::string& accept_encoding, std::string& encoding) const {
+    bool accepts_brotli = false;
+    bool accepts_gzip = false;
+    const auto accept = [&accepts_brotli, &accepts_gzip](const std::string& coding, const std::string& params) {
+      const size_t q = params.find("q=");
+      if (q != std::string::npos && atof(params.c_str() + q + 2) <= 0) {
+        return;
+      }
+      if (impl::EqualIgnoringCase(coding, "br")) {
+        accepts_brotli = true;
+      } else if (impl::EqualIgnoringCase(coding, "gzip")) {
+        accepts_gzip = true;
+      }
+    };
+    impl::ForEachListElement(accept_encoding, accept);
+    if (accepts_brotli && !brotli.empty()) {
+      encoding = "br";
+      return brotli;
+    } else if (accepts_gzip && !gzip.empty()) {
+      encoding = "gzip";
+      return gzip;
+    } else {
+      encoding.clear();
+      return Identity();
+    }
+  }
+
+  void Serve(bricks::net::api::Request r) const {
+    using bricks::net::HTTPHeaders;
+    using bricks::net::HTTPResponseCode;
+    const auto& headers = r.http.headers();
+    std::string encoding;
+    const std::string& body = Body(impl::HeaderValue(headers, "Accept-Encoding"), encoding);
+    HTTPHeaders response_headers(
+        {{"ETag", ETag(encoding)}, {"Cache-Control", "no-cache"}, {"Vary", "Accept-Encoding"}});
+    if (NotModified(impl::HeaderValue(headers, "If-None-Match"))) {
+      // With the tag of the variant that would have been sent, and without the type of the empty body.
+      Respond(r, "", HTTPResponseCode::NotModified, "", response_headers);
+    } else {
+      if (!encoding.empty()) {
+        response_headers.emplace_back("Content-Encoding", encoding);
+      }
+      Respond(r, body, HTTPResponseCode::OK, content_type, response_headers);
+    }
+  }
+
+ private:
+  void Prepare(const char* data, size_t size) {
+    char buffer[64];
+    snprintf(buffer,
+             sizeof(buffer),
+             "\"%llx-%016llx\"",
+             static_cast<unsigned long long>(size),
+             static_cast<unsigned long long>(impl::ContentHash(data, size)));
+    etag = buffer;
+    gzip_etag_ = etag.substr(0, etag.length() - 1) + "-gz\"";
+    brotli_etag_ = etag.substr(0, etag.length() - 1) + "-br\"";
+    gzip = impl::Gzip(data, size);
+    if (gzip.length() >= size) {
+      gzip.clear();
+    }
+    if (brotli.length() >= size) {
+      brotli.clear();
+    }
+  }
+
+  std::string gzip_etag_;
+  std::string brotli_etag_;
+  std::shared_ptr<const impl::MappedFile> mapped_;  // Null unless the file is served from the mapping.
+  std::shared_ptr<std::once_flag> identity_once_;
+  mutable std::string identity_;  // For a mapped file, set once by `Identity()`.
+};
+
+class StaticFileCache final {
+ public:
+  // Adds the file to be served under `url`, which should not be in the cache yet.
+  // The returned reference stays valid for the lifetime of the cache.
+  const StaticFile& Add(const std::string& url,
+                        const std::string& content_type,
+                        const std::string& content,
+                        const std::string& brotli = "") {
+    return files_.emplace(url, StaticFile(content_type, content, brotli)).first->second;
+  }
+
+  // Returns `nullptr` if there is no file under `url`.
+  const StaticFile* Find(const std::string& url) const {
+    const auto cit = files_.find(url);
+    return (cit != files_.end()) ? &cit->second : nullptr;
+  }
+
+  size_t Size() const { return files_.size(); }
+
+ private:
+  std::map<std::string, StaticFile> files_;
+};
+
+// A static file loaded on its first request, or by `Warm()`, instead of at startup.
+class LazyStaticFile final {
+ public:
+  // The `brotli_path` is that of the precompressed variant, empty if there is none.
+  LazyStaticFile(const std::string& path, const std::string& content_type, const std::string& brotli_path)
+      : path_(path), content_type_(content_type), brotli_path_(brotli_path) {}
+
+  // Returns `nullptr` if the file can not be read, as when it is gone since it was listed.
+  const StaticFile* Get() const {
+    std::call_once(once_, [this]() {
+      const auto mapped = std::make_shared<const impl::MappedFile>(path_);
+      if (mapped->Read()) {
+        std::string brotli;
+        if (!brotli_path_.empty()) {
+          const impl::MappedFile mapped_brotli(brotli_path_);
+          if (mapped_brotli.Size()) {
+            brotli.assign(mapped_brotli.Data(), mapped_brotli.Size());
+          }
+        }
+        file_.reset(new StaticFile(content_type_, mapped, brotli));
+      }
+      loaded_ = true;
+    });
+    return file_.get();
+  }
+
+  void Warm() const { Get(); }
+  bool Loaded() const { return loaded_; }
+
+  void Serve(bricks::net::api::Request r) const {
+    if (const StaticFile* file = Get()) {
+      file->Serve(std::move(r));
+    } else {
+      Respond(r, "<h1>NOT FOUND</h1>\n", bricks::net::HTTPResponseCode::NotFound);
+    }
+  }
+
+ private:
+  const std::string path_;
+  const std::string content_type_;
+  const std::string brotli_path_;
+  mutable std::once_flag once_;
+  mutable std::unique_ptr<const StaticFile> file_;  // Set once, by `once_`.
+  mutable std::atomic_bool loaded_{false};
+
+  LazyStaticFile(const LazyStaticFile&) = delete;
+  void operator=(const LazyStaticFile&) = delete;
+};
+
+// The static files to load lazily, each of which is to be registered under its URL.
+class LazyStaticFiles final {
+ public:
+  struct Entry {
+    std::string url;
+    std::string path;
+    std::string content_type;
+    std::string brotli_path;  // Empty if there is no precompressed variant.
+  };
+
+  explicit LazyStaticFiles(const std::vector<Entry>& entries = std::vector<Entry>()) {
+    urls_.reserve(entries.size());
+    for (const Entry& entry : entries) {
+      urls_.push_back(entry.url);
+      files_.emplace_back(entry.path, entry.content_type, entry.brotli_path);
+    }
+  }
+
+  // Calls `f(url, file)` for each file, in the order they were listed.
+  template <typename F>
+  void ForEach(F&& f) const {
+    for (size_t i = 0; i < files_.size(); ++i) {
+      f(urls_[i], files_[i]);
+    }
+  }
+
+  size_t Size() const { return files_.size(); }
+
+ private:
+  std::vector<std::string> urls_;
+  std::deque<LazyStaticFile> files_;  // In the order of `urls_`.
+};
+
+}  // namespace demo
+
+#endif  // DEMO_STATIC_FILES_H
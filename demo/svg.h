@@ -0,0 +1,378 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "Dima" Korolev <dmitry.korolev@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*******************************************************************************/
+
+// Defines class `SVGPlot`, a native renderer of scatter and line plots into SVG.
+//
+// The output follows the layout and markup of the gnuplot 4.4 SVG terminal on an 800x800 canvas,
+// so that it matches what the demo used to produce by running gnuplot, without spawning a process.
+// The markup of the data is generated separately from the frame, which allows the callers to keep
+// the per-series markup around and only append to it as new points arrive.
+
+#ifndef DEMO_SVG_H
+#define DEMO_SVG_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace demo {
+
+class SVGPlot final {
+ public:
+  struct Series {
+    std::string name;
+    std::string color;  // The gnuplot default color for this series if empty.
+    double line_width = 1;
+    bool as_points = false;
+    Series(const std::string& name = "") : name(name) {}
+    Series& Color(const std::string& value) {
+      color = value;
+      return *this;
+    }
+    Series& LineWidth(double value) {
+      line_width = value;
+      return *this;
+    }
+    Series& AsPoints() {
+      as_points = true;
+      return *this;
+    }
+  };
+
+  SVGPlot& Title(const std::string& value) {
+    title_ = value;
+    return *this;
+  }
+  SVGPlot& KeyTitle(const std::string& value) {
+    key_title_ = value;
+    return *this;
+  }
+  SVGPlot& NoKey() {
+    key_ = false;
+    return *this;
+  }
+  SVGPlot& XRange(double min, double max) {
+    x_min_ = min;
+    x_max_ = max;
+    return *this;
+  }
+  SVGPlot& YRange(double min, double max) {
+    y_min_ = min;
+    y_max_ = max;
+    return *this;
+  }
+  SVGPlot& Grid() {
+    grid_ = true;
+    return *this;
+  }
+  SVGPlot& Plot(const Series& series) {
+    series_.push_back(series);
+    return *this;
+  }
+
+  // Appends the markup of one point of the `series`-th series, which must be plotted `AsPoints()`.
+  // Points outside the plot range are skipped.
+  void AppendPoint(size_t series, double x, double y, std::string& output) const {
+    if (x >= x_min_ && x <= x_max_ && y >= y_min_ && y <= y_max_) {
+      AppendPointMarkup(series, MapX(x), MapY(y), output);
+    }
+  }
+
+  // Appends the markup of a polyline.
+  void AppendLine(const std::vector<std::pair<double, double>>& points, std::string& output) const {
+    if (points.empty()) {
+      return;
+    }
+    output += "\t<path  d='";
+    for (size_t i = 0; i < points.size(); ++i) {
+      output += (i ? "L" : "M") + Coordinate(MapX(points[i].first)) + ',' +
+                Coordinate(MapY(points[i].second)) + ' ';
+    }
+    output += "'></path>\n";
+  }
+
+  // Renders the complete document, given the markup of the data of each series, in the order of `Plot()` calls.
+  std::string Render(const std::vector<std::string>& data) const {
+    std::string output = Header();
+    std::string color;
+    const auto set_color = [&output, &color](const std::string& value) {
+      if (value != color) {
+        if (!color.empty()) {
+          output += "</g>\n";
+        }
+        output += Group(value, 1);
+        color = value;
+      }
+    };
+    set_color("white");
+    set_color("black");
+    const int key_rows = key_ ? static_cast<int>(series_.size() + (key_title_.empty() ? 0 : 1)) : 0;
+    const int key_bottom = kKeyTop + key_rows * kKeyRowHeight;
+    const int key_left = kKeyRight - KeyWidth();
+    for (double y : Tics(y_min_, y_max_)) {
+      const int v = MapY(y);
+      if (grid_) {
+        set_color("gray");
+        const bool split = key_rows && v >= kKeyTop && v <= key_bottom;
+        output += Path(split ? Segment(kXLeft, v, key_left, v) + Segment(kKeyRight, v, kXRight, v)
+                             : Segment(kXLeft, v, kXRight, v));
+      }
+      set_color("black");
+      output += Path(Segment(kXLeft, v, kXLeft + kTicLength, v) + Segment(kXRight, v, kXRight - kTicLength, v));
+      output += Text(kXLeft - kCharWidth, v + kTextBaseline, "end", TicLabel(y));
+    }
+    for (double x : Tics(x_min_, x_max_)) {
+      const int v = MapX(x);
+      if (grid_) {
+        set_color("gray");
+        const bool split = key_rows && v >= key_left && v <= kKeyRight;
+        output += Path(split ? Segment(v, kYBottom, v, key_bottom) + Segment(v, kKeyTop, v, kYTop)
+                             : Segment(v, kYBottom, v, kYTop));
+      }
+      set_color("black");
+      output += Path(Segment(v, kYBottom, v, kYBottom - kTicLength) + Segment(v, kYTop, v, kYTop + kTicLength));
+      output += Text(v, kYBottom + kXTicLabelOffset, "middle", TicLabel(x));
+    }
+    set_color("black");
+    output += Path(Border());
+    if (!title_.empty()) {
+      output += Text((kXLeft + kXRight) / 2, kTitleBaseline, "middle", title_);
+    }
+    if (key_rows && !key_title_.empty()) {
+      output += Text((key_left + kKeyRight) / 2, KeyRowCenter(0) + kTextBaseline, "middle", key_title_);
+    }
+    output += "</g>\n";
+    for (size_t i = 0; i < series_.size(); ++i) {
+      const Series& series = series_[i];
+      output += "\t<a xlink:title=\"Plot #" + std::to_string(i + 1) + "\">\n";
+      output += Group(series.color.empty() ? DefaultColor(i) : series.color, series.line_width);
+      // Like gnuplot, draw the title and the line sample of the key before the data, and the point sample after.
+      const int row = static_cast<int>(i) + (key_title_.empty() ? 0 : 1);
+      const int sample_x = kKeyRight - kKeySampleOffset;
+      if (key_rows) {
+        output += Text(key_left + KeyTextWidth(), KeyRowCenter(row) + kTextBaseline, "end", series.name);
+        if (!series.as_points) {
+          output += Path(Segment(sample_x - kKeySampleOffset + kCharWidth,
+                                 KeyRowCenter(row),
+                                 sample_x + kKeySampleOffset - kCharWidth,
+                                 KeyRowCenter(row)));
+        }
+      }
+      if (i < data.size()) {
+        output += data[i];
+      }
+      if (key_rows && series.as_points) {
+        AppendPointMarkup(i, sample_x, KeyRowCenter(row), output);
+      }
+      output += "</g>\n\t</a>\n";
+    }
+    output += Group("black", 1) + Path(Border()) + "</g>\n</svg>\n\n";
+    return output;
+  }
+
+ private:
+  // The geometry of the canvas, in the tenths of a pixel, as the gnuplot SVG terminal lays it out.
+  enum {
+    kCanvas = 8000,
+    kXLeft = 539,
+    kXRight = 7750,
+    kYTop = 541,
+    kYBottom = 7640,
+    kTicLength = 90,
+    kCharWidth = 83,
+    kTextBaseline = 45,
+    kXTicLabelOffset = 225,
+    kTitleBaseline = 316,
+    kKeyRight = kXRight - kCharWidth,
+    kKeyTop = kYTop + kTicLength,
+    kKeyRowHeight = 180,
+    kKeySampleOffset = 294
+  };
+
+  int MapX(double x) const {
+    return static_cast<int>(kXLeft + (x - x_min_) * (kXRight - kXLeft) / (x_max_ - x_min_) + 0.5);
+  }
+
+  int MapY(double y) const {
+    return kCanvas -
+           static_cast<int>((kCanvas - kYBottom) + (y - y_min_) * (kYBottom - kYTop) / (y_max_ - y_min_) + 0.5);
+  }
+
+  int KeyTextWidth() const {
+    size_t length = 0;
+    for (const auto& series : series_) {
+      length = std::max(length, series.name.length());
+    }
+    return static_cast<int>(length) * kCharWidth;
+  }
+
+  int KeyWidth() const { return KeyTextWidth() + 2 * kKeySampleOffset; }
+
+  static int KeyRowCenter(int row) { return kKeyTop + kKeyRowHeight / 2 + row * kKeyRowHeight; }
+
+  // The positions of the axis tics, chosen the way gnuplot does it by default.
+  static std::vector<double> Tics(double min, double max) {
+    const double range = max - min;
+    const double power = pow(10.0, floor(log10(range)));
+    const double norm = range / power;
+    const double positions = 20.0 / norm;
+    double step;
+    if (positions > 40) {
+      step = 0.05;
+    } else if (positions > 20) {
+      step = 0.1;
+    } else if (positions > 10) {
+      step = 0.2;
+    } else if (positions > 4) {
+      step = 0.5;
+    } else if (positions > 2) {
+      step = 1;
+    } else if (positions > 0.5) {
+      step = 2;
+    } else {
+      step = ceil(norm);
+    }
+    step *= power;
+    std::vector<double> tics;
+    for (double i = ceil(min / step - 1e-9); i * step <= max + step * 1e-9; ++i) {
+      tics.push_back((i == 0) ? 0 : i * step);
+    }
+    return tics;
+  }
+
+  static std::string TicLabel(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "% g", value);
+    return buffer;
+  }
+
+  static std::string DefaultColor(size_t i) {
+    static const char* colors[] = {"red", "green", "blue", "magenta", "cyan", "sienna", "orange", "coral"};
+    return colors[i % (sizeof(colors) / sizeof(colors[0]))];
+  }
+
+  static std::string Coordinate(int tenths) { return std::to_string(tenths / 10) + '.' + char('0' + tenths % 10); }
+
+  static std::string Segment(int x1, int y1, int x2, int y2) {
+    return 'M' + Coordinate(x1) + ',' + Coordinate(y1) + " L" + Coordinate(x2) + ',' + Coordinate(y2) + ' ';
+  }
+
+  static std::string Border() {
+    return 'M' + Coordinate(kXLeft) + ',' + Coordinate(kYTop) + " L" + Coordinate(kXLeft) + ',' +
+           Coordinate(kYBottom) + " L" + Coordinate(kXRight) + ',' + Coordinate(kYBottom) + " L" +
+           Coordinate(kXRight) + ',' + Coordinate(kYTop) + " L" + Coordinate(kXLeft) + ',' + Coordinate(kYTop) +
+           " Z ";
+  }
+
+  static void AppendPointMarkup(size_t series, int x, int y, std::string& output) {
+    char buffer[128];
+    const int length = snprintf(buffer,
+             sizeof(buffer),
+             "\t<use xlink:href='#gpPt%d' transform='translate(%d.%d,%d.%d) scale(4.50)'/>\n",
+             static_cast<int>(series % 13),
+             x / 10,
+             x % 10,
+             y / 10,
+             y % 10);
+    output.append(buffer, length);
+  }
+
+  static std::string Path(const std::string& d) { return "\t<path  d='" + d + "'></path>\n"; }
+
+  static std::string Group(const std::string& color, double line_width) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.2f", line_width);
+    return "<g style=\"fill:none; color:" + color + "; stroke:currentColor; stroke-width:" + buffer +
+           "; stroke-linecap:butt; stroke-linejoin:miter\">\n";
+  }
+
+  static std::string Text(int x, int y, const std::string& anchor, const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+      if (c == '&') {
+        escaped += "&amp;";
+      } else if (c == '<') {
+        escaped += "&lt;";
+      } else {
+        escaped += c;
+      }
+    }
+    return "\t<g transform=\"translate(" + Coordinate(x) + ',' + Coordinate(y) +
+           ")\" style=\"stroke:none; fill:black; font-family:Arial; font-size:12.00pt; text-anchor:" + anchor +
+           "\">\n\t\t<text>" + escaped + "</text>\n\t</g>\n";
+  }
+
+  static std::string Header() {
+    return
+        "<?xml version=\"1.0\" encoding=\"utf-8\"  standalone=\"no\"?>\n"
+        "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \n"
+        " \"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n"
+        "<svg width=\"800\" height=\"800\" viewBox=\"0 0 800 800\"\n"
+        " xmlns=\"http://www.w3.org/2000/svg\"\n"
+        " xmlns:xlink=\"http://www.w3.org/1999/xlink\"\n"
+        ">\n"
+        "\n"
+        "<desc>Produced by GNUPLOT 4.4 patchlevel 3 </desc>\n"
+        "\n"
+        "<defs>\n"
+        "\n"
+        "\t<circle id='gpDot' r='0.5' stroke-width='0.5'/>\n"
+        "\t<path id='gpPt0' stroke-width='0.222' stroke='currentColor' d='M-1,0 h2 M0,-1 v2'/>\n"
+        "\t<path id='gpPt1' stroke-width='0.222' stroke='currentColor' d='M-1,-1 L1,1 M1,-1 L-1,1'"
+        "/>\n"
+        "\t<path id='gpPt2' stroke-width='0.222' stroke='currentColor' d='M-1,0 L1,0 M0,-1 L0,1 "
+        "M-1,-1 L1,1 M-1,1 L1,-1'/>\n"
+        "\t<rect id='gpPt3' stroke-width='0.222' stroke='currentColor' x='-1' y='-1' width='2' height='"
+        "2'/>\n"
+        "\t<rect id='gpPt4' stroke-width='0.222' stroke='currentColor' fill='currentColor' x='-1'"
+        " y='-1' width='2' height='2'/>\n"
+        "\t<circle id='gpPt5' stroke-width='0.222' stroke='currentColor' cx='0' cy='0' r='1'/>\n"
+        "\t<use xlink:href='#gpPt5' id='gpPt6' fill='currentColor' stroke='none'/>\n"
+        "\t<path id='gpPt7' stroke-width='0.222' stroke='currentColor' d='M0,-1.33 L-1.33,0.67 L1.33,0.67 "
+        "z'/>\n"
+        "\t<use xlink:href='#gpPt7' id='gpPt8' fill='currentColor' stroke='none'/>\n"
+        "\t<use xlink:href='#gpPt7' id='gpPt9' stroke='currentColor' transform='rotate(180)'/>\n"
+        "\t<use xlink:href='#gpPt9' id='gpPt10' fill='currentColor' stroke='none'/>\n"
+        "\t<use xlink:href='#gpPt3' id='gpPt11' stroke='currentColor' transform='rotate(45)'/>\n"
+        "\t<use xlink:href='#gpPt11' id='gpPt12' fill='currentColor' stroke='none'/>\n"
+        "</defs>\n";
+  }
+
+  std::string title_;
+  std::string key_title_;
+  bool key_ = true;
+  bool grid_ = false;
+  double x_min_ = -10;
+  double x_max_ = 10;
+  double y_min_ = -10;
+  double y_max_ = 10;
+  std::vector<Series> series_;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_SVG_H
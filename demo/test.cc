@@ -25,6 +25,26 @@ SOFTWARE.
 #include "demo.h"
 
 DEFINE_int32(demo_port, 2015, "The local port to spawn the demo on.");
+DEFINE_string(demo_log_dir, "", "The directory for the durable log of points, empty for in-memory only.");
+DEFINE_string(demo_data_dir, "", "The directory for the named datasets, empty to keep them in memory only.");
+DEFINE_int32(demo_dataset_max_points, 1000000, "The quota of points per named dataset.");
+DEFINE_int32(demo_max_resident_datasets, 16, "The number of named datasets to keep in memory.");
+DEFINE_string(demo_peers, "", "The comma-separated `host:port`-s of the nodes to shard the datasets across.");
+DEFINE_string(demo_host, "localhost", "The host of this node, as listed in `--demo_peers`.");
+DEFINE_int32(demo_threads, 8, "The number of threads to handle the requests on.");
+DEFINE_int32(demo_max_queued_requests, 1024, "The number of requests to queue before responding with a 503.");
+DEFINE_bool(demo_fast_start, false, "Load the static files on their first request instead of at startup.");
+DEFINE_bool(demo_warm_static_files, true, "With `--demo_fast_start`, load the static files in the background.");
+DEFINE_int32(demo_keep_alive_port, 0, "The port to serve the small requests on with keep-alive, 0 for none.");
+DEFINE_int32(demo_stream_writers, 4, "The number of threads to write the `/layout/data` streams on.");
+DEFINE_int32(demo_stream_send_timeout_ms, 5000, "End the streams a write to which takes longer, 0 to never.");
+
+#include <sys/resource.h>
+
+#include <csignal>
+#include <fstream>
+#include <limits>
+#include <tuple>
 
 #include "../Bricks/util/singleton.h"
 #include "../Bricks/file/file.h"
@@ -81,3 +101,1578 @@ TEST(Demo, VisualizesPoints) {
   EXPECT_EQ(FileSystem::ReadFileAsString("golden/two_points.svg"),
             HTTP(GET("localhost:2015/demo_id?format=svg")).body);
 }
+
+// The `data` is only to be read once `closed` is set, while `length` can be watched as the data comes in.
+struct MockBroadcastSink : BroadcastSink {
+  std::string& data;
+  std::atomic_size_t& length;
+  std::atomic_bool& closed;
+  MockBroadcastSink(std::string& data, std::atomic_size_t& length, std::atomic_bool& closed)
+      : data(data), length(length), closed(closed) {}
+  ~MockBroadcastSink() { closed = true; }
+  void Send(const ConstBuffer* buffers, size_t count) override {
+    for (size_t i = 0; i < count; ++i) {
+      data.append(buffers[i].data, buffers[i].size);
+    }
+    length = data.length();
+  }
+};
+
+TEST(Broadcaster, FansOutToAllSubscribers) {
+  std::string a, b;
+  std::atomic_size_t a_length(0), b_length(0);
+  std::atomic_bool a_closed(false), b_closed(false);
+  Broadcaster broadcaster(2);
+  broadcaster.Subscribe(std::unique_ptr<BroadcastSink>(new MockBroadcastSink(a, a_length, a_closed)), 100);
+  broadcaster.Subscribe(std::unique_ptr<BroadcastSink>(new MockBroadcastSink(b, b_length, b_closed)), 200);
+  EXPECT_EQ(2u, broadcaster.SubscribersCount());
+  for (int i = 0; i < 3; ++i) {
+    broadcaster.Publish(Printf("%d\n", i), 50 * i);
+    // Let the writers flush, so that the test does not depend on how the data is split into chunks.
+    while (b_length < static_cast<size_t>(2 * (i + 1))) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  broadcaster.Publish("3\n", 150);
+  while (!a_closed || b_length < 8u) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  while (broadcaster.SubscribersCount()) {
+    broadcaster.Publish("4\n", 250);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(b_closed);
+  EXPECT_EQ("0\n1\n", a);
+  EXPECT_EQ("0\n1\n2\n3\n", b);
+}
+
+TEST(Broadcaster, SendsThePendingDataBeforeClosing) {
+  std::string a, b;
+  std::atomic_size_t a_length(0), b_length(0);
+  std::atomic_bool a_closed(false), b_closed(false);
+  // With the flush delay, the data is still pending when the subscriptions end.
+  Broadcaster broadcaster(1, 1 << 14, 50);
+  broadcaster.Subscribe(std::unique_ptr<BroadcastSink>(new MockBroadcastSink(a, a_length, a_closed)), 100);
+  const Broadcaster::Handle handle =
+      broadcaster.Subscribe(std::unique_ptr<BroadcastSink>(new MockBroadcastSink(b, b_length, b_closed)),
+                            1e18,
+                            Broadcaster::kNoChannel);
+  broadcaster.Publish("0\n", 0);
+  broadcaster.Publish("1\n", 100);
+  EXPECT_TRUE(Broadcaster::PublishResult::Queued == broadcaster.PublishTo(handle, "2\n", 2, 0));
+  broadcaster.Close(handle);
+  EXPECT_TRUE(Broadcaster::PublishResult::Over == broadcaster.PublishTo(handle, "3\n", 2, 0));
+  while (!a_closed || !b_closed) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ("0\n", a);
+  EXPECT_EQ("2\n", b);
+}
+
+// A client that keeps the connection open, but has stopped reading from it.
+struct StalledBroadcastSink : BroadcastSink {
+  std::atomic_bool aborted;
+  std::atomic_size_t& closed;
+  explicit StalledBroadcastSink(std::atomic_size_t& closed) : aborted(false), closed(closed) {}
+  ~StalledBroadcastSink() { ++closed; }
+  void Send(const ConstBuffer*, size_t) override {
+    while (!aborted) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    throw std::runtime_error("Aborted.");
+  }
+  void Abort() override { aborted = true; }
+};
+
+TEST(Broadcaster, StalledSubscribersDoNotHoldUpTheOthers) {
+  std::string data;
+  std::atomic_size_t length(0);
+  std::atomic_bool closed(false);
+  std::atomic_size_t stalled_closed(0);
+  {
+    // More stalled subscribers than writers.
+    Broadcaster broadcaster(2, 1 << 14, 0, 50);
+    for (int i = 0; i < 3; ++i) {
+      broadcaster.Subscribe(std::unique_ptr<BroadcastSink>(new StalledBroadcastSink(stalled_closed)));
+    }
+    broadcaster.Subscribe(std::unique_ptr<BroadcastSink>(new MockBroadcastSink(data, length, closed)));
+    broadcaster.Publish("0\n", 0);
+    broadcaster.Publish("1\n", 0);
+    while (length < 4 || stalled_closed < 3) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(3u, broadcaster.StalledCount());
+    // The stalled subscriptions are gone, and new writers have taken the place of those they held up.
+    broadcaster.Publish("2\n", 0);
+    while (length < 6) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(1u, broadcaster.SubscribersCount());
+  }
+  EXPECT_TRUE(closed);
+  EXPECT_EQ("0\n1\n2\n", data);
+}
+
+TEST(PointStore, ConcurrentWritersAndSnapshots) {
+  PointStore store(4);
+  const size_t kThreads = 8;
+  const size_t kPointsPerThread = 5000;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&store, t]() {
+      for (size_t i = 0; i < kPointsPerThread; ++i) {
+        store.Add(Point(t, i, i % 2));
+      }
+    });
+  }
+  const PointStore::Snapshot early = store.GetSnapshot();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const PointStore::Snapshot snapshot = store.GetSnapshot();
+  EXPECT_EQ(kThreads * kPointsPerThread, store.Size());
+  EXPECT_EQ(kThreads * kPointsPerThread, snapshot.Size());
+  // The points added by each thread are seen in the order they were added.
+  std::vector<double> last(kThreads, -1);
+  snapshot.ForEach([&last](const Point& p) {
+    EXPECT_EQ(last[static_cast<size_t>(p.x)] + 1, p.y);
+    EXPECT_EQ(static_cast<size_t>(p.y) % 2 == 1, p.label);
+    last[static_cast<size_t>(p.x)] = p.y;
+  });
+  size_t since = 0;
+  snapshot.ForEachSince(early, [&since](const Point&) { ++since; });
+  EXPECT_EQ(snapshot.Size() - early.Size(), since);
+}
+
+TEST(PointStore, KeepsTheOrderOfAddsAcrossShards) {
+  PointStore store(4);
+  const size_t kThreads = 8;
+  const size_t kPointsPerThread = 2000;
+  // Each point is `(id, the number of adds completed before its own has started)`.
+  std::atomic_size_t completed(0);
+  std::vector<size_t> completion(kThreads * kPointsPerThread);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (size_t i = 0; i < kPointsPerThread; ++i) {
+        const size_t id = t * kPointsPerThread + i;
+        store.Add(Point(id, completed.load(), false));
+        completion[id] = completed++;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  // Every point comes after all the points which were completely added before it was started.
+  std::vector<bool> seen(completion.size());
+  size_t first_not_seen = 0;
+  const auto check = [&](const Point& p) {
+    EXPECT_LE(static_cast<size_t>(p.y), first_not_seen);
+    seen[completion[static_cast<size_t>(p.x)]] = true;
+    while (first_not_seen < seen.size() && seen[first_not_seen]) {
+      ++first_not_seen;
+    }
+  };
+  const PointStore::Snapshot snapshot = store.GetSnapshot();
+  snapshot.ForEach(check);
+  EXPECT_EQ(seen.size(), first_not_seen);
+  // The same order when visited a few points at a time.
+  std::vector<Point> points;
+  PointStore::Snapshot::Cursor cursor;
+  while (snapshot.ForEachFrom(cursor, 999, [&points](const Point& p) { points.push_back(p); })) {
+  }
+  const std::vector<Point> all = snapshot.ToVector();
+  ASSERT_EQ(all.size(), points.size());
+  for (size_t i = 0; i < all.size(); ++i) {
+    EXPECT_EQ(all[i].x, points[i].x);
+  }
+}
+
+TEST(Demo, KeepsThePointsInTheOrderTheyWerePosted) {
+  DemoServer server(2024, HashRing::FromList(""));
+  const size_t n = 2 * std::max(std::thread::hardware_concurrency(), 8u) + 1;
+  std::string expected = "{\"state\":{\"points\":[";
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_EQ("ADDED\n", HTTP(POST(Printf("localhost:2024/demo_id?x=%zu&y=0&label=0", i))).body);
+    expected += Printf("%s{\"x\":%zu,\"y\":0,\"label\":false}", i ? "," : "", i);
+  }
+  EXPECT_EQ(expected + "]}}\n", HTTP(GET("localhost:2024/demo_id")).body);
+}
+
+TEST(Demo, BulkUploadNDJSONAndBinary) {
+  PointStore store(1);
+  const auto add = [&store](const Point* begin, const Point* end) { store.Add(begin, end); };
+  const IngestResult ndjson = ParseNDJSONPoints(
+      "{\"x\":1,\"y\":2,\"label\":true}\n"
+      "\n"
+      " { \"label\" : false , \"y\" : -0.5 , \"x\" : 1e-3 } \n"
+      "{\"x\":1,\"y\":2}\n"
+      "garbage\n"
+      "{\"x\":3,\"y\":4,\"label\":0}",
+      add);
+  EXPECT_EQ(3u, ndjson.accepted);
+  EXPECT_EQ(2u, ndjson.rejected);
+  std::string binary;
+  AppendBinaryPoint(Point(0.5, -0.5, true), binary);
+  AppendBinaryPoint(Point(5, 6, false), binary);
+  binary += "\x01\x02";
+  const IngestResult packed = ParseBinaryPoints(binary, add);
+  EXPECT_EQ(2u, packed.accepted);
+  EXPECT_EQ(1u, packed.rejected);
+  EXPECT_EQ(
+      "1,2,1 0.001,-0.5,0 3,4,0 0.5,-0.5,1 5,6,0 ",
+      [&store]() {
+        std::string result;
+        store.GetSnapshot().ForEach([&result](const Point& p) {
+          result += Printf("%g,%g,%d ", p.x, p.y, static_cast<int>(p.label));
+        });
+        return result;
+      }());
+}
+
+// Adds the three points the tests below expect to the server on `port`, the last one via the bulk upload.
+static void AddExamplePoints(int port) {
+  EXPECT_EQ("ADDED\n", HTTP(POST(Printf("localhost:%d/demo_id?x=0.25&y=-0.25&label=1", port))).body);
+  EXPECT_EQ("ADDED\n", HTTP(POST(Printf("localhost:%d/demo_id?x=-0.25&y=0.25&label=0", port))).body);
+  const auto response = HTTP(POST(Printf("localhost:%d/demo_id?format=ndjson", port),
+                                  "{\"x\":0.5,\"y\":0.5,\"label\":true}\nnope\n",
+                                  "application/x-ndjson"));
+  EXPECT_EQ(200, static_cast<int>(response.code));
+  EXPECT_EQ("{\"result\":{\"accepted\":1,\"rejected\":1}}\n", response.body);
+}
+
+TEST(Demo, BulkUploadEndpoint) {
+  DemoServer server(2025, HashRing::FromList(""));
+  AddExamplePoints(2025);
+  EXPECT_EQ(
+      "{\"state\":{\"points\":["
+      "{\"x\":0.25,\"y\":-0.25,\"label\":true},"
+      "{\"x\":-0.25,\"y\":0.25,\"label\":false},"
+      "{\"x\":0.5,\"y\":0.5,\"label\":true}"
+      "]}}\n",
+      HTTP(GET("localhost:2025/demo_id")).body);
+}
+
+TEST(Demo, VisualizesClassBoundariesAndNewPoints) {
+  DemoServer server(2026, HashRing::FromList(""));
+  const auto boundaries = HTTP(GET("localhost:2026/yinyang.svg"));
+  EXPECT_EQ(200, static_cast<int>(boundaries.code));
+  EXPECT_EQ(0u, boundaries.body.find("<?xml"));
+  EXPECT_NE(std::string::npos, boundaries.body.find("<text>Class boundaries</text>"));
+  EXPECT_NE(std::string::npos, boundaries.body.find("stroke-width:5.00"));
+  // The cached plot picks up the points added after it was built.
+  const std::string empty = HTTP(GET("localhost:2026/demo_id?format=svg")).body;
+  AddExamplePoints(2026);
+  const std::string svg = HTTP(GET("localhost:2026/demo_id?format=svg")).body;
+  EXPECT_NE(empty, svg);
+  EXPECT_NE(std::string::npos, svg.find("<use xlink:href='#gpPt1' transform='translate(578.3,247.7) scale(4.50)'/>"));
+  EXPECT_EQ(svg, HTTP(GET("localhost:2026/demo_id?format=svg")).body);
+}
+
+TEST(Demo, FormatsDoublesForStreamingJSON) {
+  const auto format = [](double value) {
+    char buffer[kMaxFormattedNumberLength];
+    return std::string(buffer, FormatDouble(value, buffer));
+  };
+  EXPECT_EQ("0.25", format(0.25));
+  EXPECT_EQ("-0.25", format(-0.25));
+  EXPECT_EQ("0.001", format(1e-3));
+  EXPECT_EQ("0.3", format(0.3));
+  EXPECT_EQ("1428000000000", format(1428000000000.0));
+  EXPECT_EQ("0.33333333333333331", format(1.0 / 3));
+  EXPECT_EQ("1.0000000000000001e+300", format(1e300));
+  EXPECT_EQ("null", format(std::numeric_limits<double>::quiet_NaN()));
+  std::string chunks;
+  size_t count = 0;
+  PointStore store(1);
+  for (int i = 0; i < 100; ++i) {
+    store.Add(Point(i, -i, i % 2));
+  }
+  StreamStateJSON(store.GetSnapshot(), [&chunks, &count](const std::string& chunk) {
+    chunks += chunk;
+    ++count;
+  }, 256);
+  EXPECT_LT(10u, count);
+  EXPECT_EQ(0u, chunks.find("{\"state\":{\"points\":[{\"x\":0,\"y\":0,\"label\":false},{\"x\":1,\"y\":-1,\"label\":true},"));
+  EXPECT_EQ("{\"x\":99,\"y\":-99,\"label\":true}]}}\n", chunks.substr(chunks.length() - 33));
+  // The same JSON in steps of a few points.
+  std::string stepped;
+  StateJSONStream<std::function<void(const std::string&)>> stream(
+      store.GetSnapshot(), [&stepped](const std::string& chunk) { stepped += chunk; }, 256);
+  size_t steps = 1;
+  while (stream.Step(7)) {
+    ++steps;
+  }
+  EXPECT_EQ(15u, steps);
+  EXPECT_EQ(chunks, stepped);
+}
+
+TEST(PointLog, GroupCommitRotationCompactionAndReplay) {
+  const std::string dir = Printf(".noshit/point_log_%llu", static_cast<unsigned long long>(Now()));
+  PointLogOptions options;
+  options.max_segment_bytes = 1000;
+  options.compact_after_segments = 3;
+  {
+    PointLog log(dir, options);
+    for (int i = 0; i < 1000; ++i) {
+      const Point point(i, -i, i % 2);
+      log.Append(&point, &point + 1);
+    }
+    log.Flush();
+    log.Compact();
+    const Point point(1000, -1000, false);
+    log.Append(&point, &point + 1);
+  }
+  PointStore store;
+  const auto add = [&store](const Point* begin, const Point* end) { store.Add(begin, end); };
+  // Decoded on several threads, and still added in the order the points were appended in.
+  EXPECT_EQ(1001u, PointLog::Replay(dir, add, 4));
+  const std::vector<Point> points = store.GetSnapshot().ToVector();
+  ASSERT_EQ(1001u, points.size());
+  for (int i = 0; i <= 1000; ++i) {
+    EXPECT_EQ(i, points[i].x);
+    EXPECT_EQ(-i, points[i].y);
+    EXPECT_EQ(i % 2 == 1, points[i].label);
+  }
+  // Reopening the log continues with a new segment and keeps everything written so far.
+  {
+    PointLog log(dir, options);
+    const Point point(1001, -1001, true);
+    log.Append(&point, &point + 1);
+  }
+  EXPECT_EQ(1002u, PointLog::Replay(dir, [](const Point*, const Point*) {}));
+}
+
+TEST(PointLog, CompactionSkipsTheSegmentsLeftOverByAnInterruptedOne) {
+  const std::string dir = Printf(".noshit/point_log_leftover_%llu", static_cast<unsigned long long>(Now()));
+  const auto count = [&dir]() { return PointLog::Replay(dir, [](const Point*, const Point*) {}); };
+  // Each batch of points gets a segment of its own, and is merged into the snapshot by the next compaction.
+  PointLogOptions options;
+  options.max_segment_bytes = 1;
+  {
+    PointLog log(dir, options);
+    for (int i = 0; i < 100; ++i) {
+      const Point point(i, -i, i % 2);
+      log.Append(&point, &point + 1);
+    }
+    log.Flush();
+    log.Compact();
+  }
+  // As if the compaction was interrupted after renaming the snapshot, before removing the first segment.
+  std::string leftover = "KSPOINTS";
+  for (int i = 0; i < 100; ++i) {
+    AppendBinaryPoint(Point(i, -i, i % 2), leftover);
+  }
+  std::ofstream(dir + "/points.1.log", std::ios::binary) << leftover;
+  EXPECT_EQ(100u, count());
+  {
+    PointLog log(dir, options);
+    const Point point(100, -100, false);
+    log.Append(&point, &point + 1);
+    log.Flush();
+    log.Compact();
+  }
+  EXPECT_EQ(101u, count());
+  EXPECT_FALSE(std::ifstream(dir + "/points.1.log").good());
+}
+
+TEST(PointLog, FailedWritesAreRetriedWithoutDuplicatesAndGivenUpOnAtExit) {
+  const std::string dir = Printf(".noshit/point_log_failing_%llu", static_cast<unsigned long long>(Now()));
+  // The writes past the limit on the size of the files fail, the first one after writing what fits.
+  signal(SIGXFSZ, SIG_IGN);
+  rlimit unlimited;
+  getrlimit(RLIMIT_FSIZE, &unlimited);
+  const auto limit_file_size = [&unlimited](rlim_t size) {
+    rlimit limit = unlimited;
+    limit.rlim_cur = size;
+    setrlimit(RLIMIT_FSIZE, &limit);
+  };
+  std::vector<Point> points;
+  for (int i = 0; i < 20; ++i) {
+    points.emplace_back(i, -i, i % 2);
+  }
+  {
+    PointLog log(dir);
+    // Room for the header, ten records and a part of the eleventh one.
+    limit_file_size(8 + 10 * 17 + 5);
+    log.Append(points.begin(), points.end());
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    setrlimit(RLIMIT_FSIZE, &unlimited);
+    log.Flush();
+  }
+  std::vector<Point> replayed;
+  PointLog::Replay(dir, [&replayed](const Point* begin, const Point* end) {
+    replayed.insert(replayed.end(), begin, end);
+  }, 1);
+  ASSERT_EQ(20u, replayed.size());
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_EQ(i, replayed[i].x);
+    EXPECT_EQ(-i, replayed[i].y);
+  }
+  // With the writes still failing, the log gives up on the points once it is closed, instead of hanging.
+  {
+    PointLog log(dir);
+    limit_file_size(0);
+    log.Append(points.begin(), points.end());
+  }
+  setrlimit(RLIMIT_FSIZE, &unlimited);
+  EXPECT_EQ(20u, PointLog::Replay(dir, [](const Point*, const Point*) {}));
+}
+
+TEST(RollupStore, DownsamplesToTheResolutionThatFitsTheWidth) {
+  using demo::RollupBucket;
+  using demo::RollupStore;
+  RollupStore rollups({10, 100}, 8);
+  std::vector<std::pair<size_t, double>> completed;
+  std::vector<RollupStore::Completed> buffer(rollups.Resolutions().size());
+  for (int t = 0; t < 200; t += 5) {
+    const size_t count = rollups.Add(t, t % 10 ? 1 : 3, buffer.data());
+    for (size_t i = 0; i < count; ++i) {
+      completed.emplace_back(buffer[i].resolution, buffer[i].bucket.begin_ms);
+    }
+  }
+  // The fine resolution only keeps the last 8 buckets, so the window going further back is served coarse.
+  EXPECT_EQ(0u, rollups.Resolution(150, 200, 10));
+  EXPECT_EQ(1u, rollups.Resolution(150, 200, 2));
+  EXPECT_EQ(1u, rollups.Resolution(0, 200, 100));
+  const std::vector<RollupBucket> fine = rollups.Query(0, 150, 200);
+  ASSERT_EQ(4u, fine.size());
+  EXPECT_EQ(150, fine[0].begin_ms);
+  EXPECT_EQ(2u, fine[0].count);
+  EXPECT_EQ(1, fine[0].min);
+  EXPECT_EQ(3, fine[0].max);
+  EXPECT_EQ(2, fine[0].Mean());
+  const std::vector<RollupBucket> coarse = rollups.Query(1, 0, 200);
+  ASSERT_EQ(1u, coarse.size());
+  EXPECT_EQ(20u, coarse[0].count);
+  std::string json;
+  coarse[0].AppendJSONLine(json);
+  EXPECT_EQ("{\"x\":0,\"y\":2,\"min\":1,\"max\":3,\"count\":20}\n", json);
+  EXPECT_EQ(20u, completed.size());
+  EXPECT_EQ(std::make_pair(static_cast<size_t>(1), 0.0), completed[10]);
+}
+
+TEST(Demo, ServesStaticFiles) {
+  Singleton<DemoServer>();
+  const auto response = HTTP(GET("localhost:2015/static/hello.txt"));
+  EXPECT_EQ(200, static_cast<int>(response.code));
+  EXPECT_EQ("Hello, World!\n", response.body);
+}
+
+TEST(StaticFileCache, ETagConditionalGetAndCompression) {
+  StaticFileCache cache;
+  std::string script;
+  for (int i = 0; i < 1000; ++i) {
+    script += "console.log(" + std::to_string(i) + ");\n";
+  }
+  const StaticFile& file = cache.Add("/static/app.js", "application/javascript", script, "BROTLI");
+  const StaticFile& tiny = cache.Add("/static/answer.txt", "text/plain", "42.\n");
+  EXPECT_EQ(&file, cache.Find("/static/app.js"));
+  EXPECT_TRUE(cache.Find("/static/nope.js") == nullptr);
+
+  EXPECT_EQ('"', file.etag.front());
+  EXPECT_EQ('"', file.etag.back());
+  EXPECT_EQ(file.etag, StaticFile("text/plain", script).etag);
+  EXPECT_NE(file.etag, tiny.etag);
+  EXPECT_TRUE(file.NotModified(file.etag));
+  EXPECT_TRUE(file.NotModified("\"foo\", W/" + file.etag));
+  EXPECT_TRUE(file.NotModified("*"));
+  EXPECT_FALSE(file.NotModified(""));
+  EXPECT_FALSE(file.NotModified(tiny.etag));
+  // Each encoding is a representation of its own, and the tags of all of them revalidate the file.
+  EXPECT_EQ(file.etag.substr(0, file.etag.length() - 1) + "-gz\"", file.ETag("gzip"));
+  EXPECT_EQ(file.etag.substr(0, file.etag.length() - 1) + "-br\"", file.ETag("br"));
+  EXPECT_EQ(file.etag, file.ETag(""));
+  EXPECT_TRUE(file.NotModified(file.ETag("gzip")));
+  EXPECT_TRUE(file.NotModified("W/" + file.ETag("br")));
+  EXPECT_FALSE(file.NotModified(tiny.ETag("gzip")));
+
+  std::string encoding;
+  EXPECT_EQ(script, file.Body("", encoding));
+  EXPECT_EQ("", encoding);
+  EXPECT_EQ("BROTLI", file.Body("gzip, deflate, br", encoding));
+  EXPECT_EQ("br", encoding);
+  EXPECT_EQ(&file.gzip, &file.Body("gzip, br;q=0", encoding));
+  EXPECT_EQ("gzip", encoding);
+  EXPECT_EQ(script, file.Body("identity", encoding));
+  EXPECT_EQ("", encoding);
+  // Compressing a tiny file does not pay off, so it is always sent as is.
+  EXPECT_EQ("42.\n", tiny.Body("gzip", encoding));
+  EXPECT_EQ("", encoding);
+
+  ASSERT_LT(file.gzip.length(), script.length());
+  std::string inflated(script.length(), '\0');
+  z_stream stream = z_stream();
+  ASSERT_EQ(Z_OK, inflateInit2(&stream, 15 + 16));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(file.gzip.data()));
+  stream.avail_in = file.gzip.length();
+  stream.next_out = reinterpret_cast<Bytef*>(&inflated[0]);
+  stream.avail_out = inflated.length();
+  EXPECT_EQ(Z_STREAM_END, inflate(&stream, Z_FINISH));
+  inflateEnd(&stream);
+  EXPECT_EQ(script, inflated);
+}
+
+TEST(StaticFileCache, LazyFilesLoadOnFirstRequest) {
+  const std::string dir = Printf(".noshit/static_%llu", static_cast<unsigned long long>(Now()));
+  ::mkdir(".noshit", 0755);
+  ::mkdir(dir.c_str(), 0755);
+  std::string script;
+  for (int i = 0; i < 1000; ++i) {
+    script += "console.log(" + std::to_string(i) + ");\n";
+  }
+  std::ofstream(dir + "/app.js") << script;
+  std::ofstream(dir + "/app.js.br") << "BROTLI";
+  std::ofstream(dir + "/index.html") << "<html></html>\n";
+  LazyStaticFiles files({{"/static/app.js", dir + "/app.js", "application/javascript", dir + "/app.js.br"},
+                         {"/", dir + "/index.html", "text/html", ""},
+                         {"/static/gone.txt", dir + "/gone.txt", "text/plain", ""}});
+  EXPECT_EQ(3u, files.Size());
+  std::vector<std::string> urls;
+  std::map<std::string, const LazyStaticFile*> listed;
+  files.ForEach([&urls, &listed](const std::string& url, const LazyStaticFile& file) {
+    urls.push_back(url);
+    listed[url] = &file;
+  });
+  EXPECT_EQ(std::vector<std::string>({"/static/app.js", "/", "/static/gone.txt"}), urls);
+
+  const LazyStaticFile& lazy = *listed["/static/app.js"];
+  EXPECT_FALSE(lazy.Loaded());
+  ASSERT_TRUE(lazy.Get() != nullptr);
+  const StaticFile& file = *lazy.Get();
+  EXPECT_TRUE(lazy.Loaded());
+  EXPECT_FALSE(listed["/"]->Loaded());
+  // The same as the file loaded at startup.
+  const StaticFile eager("application/javascript", script, "BROTLI");
+  EXPECT_EQ(eager.etag, file.etag);
+  EXPECT_EQ(eager.gzip, file.gzip);
+  std::string encoding;
+  EXPECT_EQ("BROTLI", file.Body("br", encoding));
+  EXPECT_EQ(script, file.Body("", encoding));
+  EXPECT_EQ(&file.Body("", encoding), &file.Body("identity", encoding));
+  listed["/"]->Warm();
+  EXPECT_EQ("<html></html>\n", listed["/"]->Get()->Body("", encoding));
+  // A file gone since it was listed is not served as an empty one, but as not found.
+  EXPECT_TRUE(listed["/static/gone.txt"]->Get() == nullptr);
+  EXPECT_TRUE(listed["/static/gone.txt"]->Loaded());
+}
+
+TEST(Demo, ServesConstantJSONFromCache) {
+  Singleton<DemoServer>();
+  const auto first = HTTP(GET("localhost:2015/layout/meta"));
+  EXPECT_EQ(200, static_cast<int>(first.code));
+  EXPECT_EQ(JSON(ExampleMeta(), "meta") + '\n', first.body);
+  EXPECT_EQ(first.body, HTTP(GET("localhost:2015/layout/meta")).body);
+  EXPECT_EQ(JSON(ExampleConfig(), "config") + '\n', HTTP(GET("localhost:2015/config.json")).body);
+}
+
+TEST(CachedResponse, BuildsOnceUntilInvalidated) {
+  int builds = 0;
+  CachedResponse response([&builds]() { return "build " + std::to_string(++builds); });
+  EXPECT_EQ(0, builds);
+  const std::shared_ptr<const std::string> first = response.Body();
+  EXPECT_EQ("build 1", *first);
+  EXPECT_EQ(first, response.Body());
+  EXPECT_EQ(1, builds);
+  response.Invalidate();
+  EXPECT_EQ("build 2", *response.Body());
+  EXPECT_EQ("build 2", *response.Body());
+  EXPECT_EQ(2, builds);
+  // The body handed out before the invalidation stays valid.
+  EXPECT_EQ("build 1", *first);
+}
+
+TEST(Demo, ExportsMetrics) {
+  DemoServer server(2027, HashRing::FromList(""));
+  AddExamplePoints(2027);
+  HTTP(GET("localhost:2027/ok"));
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2027/demo_id?query=foo")).code));
+  const auto response = HTTP(GET("localhost:2027/metrics"));
+  EXPECT_EQ(200, static_cast<int>(response.code));
+  EXPECT_NE(std::string::npos, response.body.find("# TYPE demo_http_requests_total counter\n"));
+  EXPECT_NE(std::string::npos, response.body.find("demo_http_requests_total{route=\"/ok\"} "));
+  EXPECT_NE(std::string::npos, response.body.find("demo_http_response_bytes_total{route=\"/ok\"} 3\n"));
+  EXPECT_NE(std::string::npos, response.body.find("demo_http_responses_total{route=\"/ok\",code=\"2xx\"} 1\n"));
+  // The requests responded to with an error code count as errors, even though their handler did not throw.
+  EXPECT_NE(std::string::npos,
+            response.body.find("demo_http_responses_total{route=\"/demo_id\",code=\"4xx\"} 1\n"));
+  EXPECT_NE(std::string::npos, response.body.find("demo_http_errors_total{route=\"/demo_id\"} 1\n"));
+  EXPECT_NE(std::string::npos,
+            response.body.find("demo_http_request_duration_seconds_bucket{route=\"/ok\",le=\"+Inf\"} "));
+  EXPECT_NE(std::string::npos, response.body.find("\ndemo_points 3\n"));
+}
+
+TEST(Metrics, LatencyHistogramsAndCounters) {
+  for (uint64_t ns : {0ull, 1ull, 7ull, 8ull, 9ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull}) {
+    const size_t index = LatencyBuckets::Index(ns);
+    EXPECT_LE(index ? LatencyBuckets::UpperBound(index - 1) : 0, ns);
+    EXPECT_GT(LatencyBuckets::UpperBound(index), ns);
+    EXPECT_LE(LatencyBuckets::UpperBound(index), ns + ns / 8 + 1);
+  }
+  EXPECT_EQ(LatencyBuckets::kCount - 1, LatencyBuckets::Index(std::numeric_limits<uint64_t>::max()));
+
+  Metrics metrics;
+  RouteMetrics& route = metrics.Route("/foo");
+  EXPECT_EQ(&route, &metrics.Route("/foo"));
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&route]() {
+      for (int i = 1; i <= 1000; ++i) {
+        route.Record(i * 1000, 10, (i % 100 == 0) ? 503 : (i % 100 == 1) ? 404 : 200, 5);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const RouteStats stats = route.Stats();
+  EXPECT_EQ(4000u, stats.requests);
+  EXPECT_EQ(80u, stats.errors);
+  EXPECT_EQ(3920u, stats.responses[2]);
+  EXPECT_EQ(40u, stats.responses[4]);
+  EXPECT_EQ(40u, stats.responses[5]);
+  EXPECT_EQ(40000u, stats.request_bytes);
+  EXPECT_EQ(20000u, stats.response_bytes);
+  EXPECT_EQ(4u * 500500u * 1000u, stats.latency_sum_ns);
+  EXPECT_NEAR(500000.0, stats.LatencyQuantile(0.5), 500000.0 / 8);
+  EXPECT_NEAR(990000.0, stats.LatencyQuantile(0.99), 990000.0 / 8);
+
+  metrics.Gauge("demo_answer", "The answer.", []() { return 42.0; });
+  const std::string text = metrics.Render();
+  EXPECT_NE(std::string::npos, text.find("demo_http_requests_total{route=\"/foo\"} 4000\n"));
+  EXPECT_NE(std::string::npos, text.find("demo_http_errors_total{route=\"/foo\"} 80\n"));
+  EXPECT_NE(std::string::npos, text.find("demo_http_responses_total{route=\"/foo\",code=\"5xx\"} 40\n"));
+  EXPECT_NE(std::string::npos, text.find("demo_http_response_bytes_total{route=\"/foo\"} 20000\n"));
+  EXPECT_EQ(std::string::npos, text.find("demo_http_responses_total{route=\"/foo\",code=\"none\"}"));
+  const std::string bucket = "demo_http_request_duration_seconds_bucket{route=\"/foo\",";
+  // The bucket of 10us also holds the values a bit above it, so only the ones from 1us to 9us are counted.
+  EXPECT_NE(std::string::npos, text.find(bucket + "le=\"0.00001\"} 36\n"));
+  EXPECT_NE(std::string::npos, text.find(bucket + "le=\"0.0025\"} 4000\n"));
+  EXPECT_NE(std::string::npos, text.find(bucket + "le=\"+Inf\"} 4000\n"));
+  EXPECT_NE(std::string::npos, text.find("demo_http_request_duration_seconds_sum{route=\"/foo\"} 2.002\n"));
+  EXPECT_NE(std::string::npos, text.find("# TYPE demo_answer gauge\ndemo_answer 42\n"));
+}
+
+TEST(Demo, QueriesPointsByRegion) {
+  DemoServer server(2028, HashRing::FromList(""));
+  AddExamplePoints(2028);
+  // The points of the box and of the radius queries come in no particular order.
+  const auto sorted_points = [](const std::string& json) {
+    std::vector<std::string> points;
+    for (size_t begin = json.find('{', 1); begin != std::string::npos; begin = json.find('{', begin + 1)) {
+      points.push_back(json.substr(begin, json.find('}', begin) + 1 - begin));
+    }
+    std::sort(points.begin(), points.end());
+    return points;
+  };
+  EXPECT_EQ(sorted_points("{\"points\":[{\"x\":0.25,\"y\":-0.25,\"label\":true},"
+                          "{\"x\":0.5,\"y\":0.5,\"label\":true}]}\n"),
+            sorted_points(HTTP(GET("localhost:2028/demo_id?query=bbox&x0=0&y0=-1&x1=1&y1=1")).body));
+  EXPECT_EQ(sorted_points("{\"points\":[{\"x\":0.25,\"y\":-0.25,\"label\":true},"
+                          "{\"x\":-0.25,\"y\":0.25,\"label\":false}]}\n"),
+            sorted_points(HTTP(GET("localhost:2028/demo_id?query=radius&x=0&y=0&r=0.4")).body));
+  EXPECT_EQ(
+      "{\"points\":[{\"x\":0.25,\"y\":-0.25,\"label\":true},{\"x\":0.5,\"y\":0.5,\"label\":true}]}\n",
+      HTTP(GET("localhost:2028/demo_id?query=knn&x=0.5&y=0&k=2")).body);
+  EXPECT_EQ("{\"points\":[]}\n", HTTP(GET("localhost:2028/demo_id?query=bbox&x0=0.9&y0=0.9&x1=1&y1=1")).body);
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2028/demo_id?query=everything")).code));
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2028/demo_id?query=knn&x=nan&y=0&k=1")).code));
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2028/demo_id?query=bbox&x0=nan&y0=0&x1=1&y1=1")).code));
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2028/demo_id?query=radius&x=0&y=0&r=inf")).code));
+  EXPECT_EQ(3u, sorted_points(HTTP(GET("localhost:2028/demo_id?query=knn&x=0&y=0&k=99999999999")).body).size());
+}
+
+TEST(SpatialIndex, MatchesTheFullScan) {
+  SpatialIndex index(-1, 1, 16);
+  std::vector<Point> points;
+  for (int i = 0; i < 5000; ++i) {
+    // Some of the points are outside the grid, in its border cells.
+    points.emplace_back(std::sin(i * 0.37) * 1.3, std::cos(i * 0.91) * 1.3, i % 3 == 0);
+  }
+  points.emplace_back(std::numeric_limits<double>::quiet_NaN(), 0, true);
+  index.Add(points.begin(), points.end());
+  EXPECT_EQ(5000u, index.Size());
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  EXPECT_TRUE(index.Nearest(nan, 0, 5).empty());
+  index.ForEachInBox(nan, -1, 1, 1, [](const Point&) { ADD_FAILURE(); });
+  index.ForEachInRadius(0, nan, 1, [](const Point&) { ADD_FAILURE(); });
+  const auto distance2 = [](const Point& p, double x, double y) {
+    return (p.x - x) * (p.x - x) + (p.y - y) * (p.y - y);
+  };
+  for (int q = 0; q < 50; ++q) {
+    const double x = std::sin(q * 1.7) * 1.5;
+    const double y = std::cos(q * 2.3) * 1.5;
+    const double size = 0.05 + (q % 7) * 0.2;
+    std::vector<std::tuple<double, double, bool>> in_box;
+    std::vector<std::tuple<double, double, bool>> in_radius;
+    std::vector<double> distances;
+    for (size_t i = 0; i < 5000; ++i) {
+      const Point& p = points[i];
+      if (p.x >= x && p.x <= x + size && p.y >= y && p.y <= y + size) {
+        in_box.emplace_back(p.x, p.y, p.label);
+      }
+      if (distance2(p, x, y) <= size * size) {
+        in_radius.emplace_back(p.x, p.y, p.label);
+      }
+      distances.push_back(distance2(p, x, y));
+    }
+    std::sort(in_box.begin(), in_box.end());
+    std::sort(in_radius.begin(), in_radius.end());
+    std::sort(distances.begin(), distances.end());
+    // The same points, in no particular order.
+    std::vector<std::tuple<double, double, bool>> found;
+    const auto add = [&found](const Point& p) { found.emplace_back(p.x, p.y, p.label); };
+    index.ForEachInBox(x, y, x + size, y + size, add);
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(in_box, found);
+    found.clear();
+    index.ForEachInRadius(x, y, size, add);
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(in_radius, found);
+    const size_t k = 1 + q * 3;
+    const std::vector<Point> nearest = index.Nearest(x, y, k);
+    ASSERT_EQ(k, nearest.size());
+    for (size_t i = 0; i < k; ++i) {
+      EXPECT_EQ(distances[i], distance2(nearest[i], x, y));
+    }
+  }
+}
+
+TEST(Demo, ScoresLabelsAgainstClassBoundaries) {
+  DemoServer server(2029, HashRing::FromList(""));
+  AddExamplePoints(2029);
+  const std::string stored = HTTP(GET("localhost:2029/score")).body;
+  EXPECT_EQ(0u,
+            stored.find("{\"score\":{\"confusion\":{\"true_positive\":2,\"false_positive\":0,"
+                        "\"true_negative\":1,\"false_negative\":0,\"accuracy\":1"));
+  const std::string posted = HTTP(POST("localhost:2029/score",
+                                       "{\"x\":0.5,\"y\":-0.5,\"label\":false}\n"
+                                       "{\"x\":-0.5,\"y\":0.5,\"label\":false}\nnope\n",
+                                       "application/x-ndjson")).body;
+  EXPECT_EQ(0u,
+            posted.find("{\"score\":{\"confusion\":{\"true_positive\":0,\"false_positive\":1,"
+                        "\"true_negative\":1,\"false_negative\":0,\"accuracy\":0.5"));
+  EXPECT_NE(std::string::npos, posted.find("\"rejected\":1}}\n"));
+  // Scoring does not add the points.
+  EXPECT_EQ(stored, HTTP(GET("localhost:2029/score")).body);
+}
+
+TEST(Classifier, VectorizedKernelsMatchTheAnalyticBoundary) {
+  EXPECT_TRUE(YinYangLabel(0.5, -0.5));
+  EXPECT_TRUE(YinYangLabel(-0.1, -0.5));  // In the lower circle.
+  EXPECT_FALSE(YinYangLabel(0.1, 0.5));  // In the upper circle.
+  EXPECT_FALSE(YinYangLabel(-0.5, 0.5));
+  EXPECT_FALSE(YinYangLabel(std::numeric_limits<double>::quiet_NaN(), -0.5));
+
+  std::vector<Point> points;
+  for (int i = 0; i < 1003; ++i) {
+    const double x = std::sin(i * 0.37);
+    const double y = std::cos(i * 0.73);
+    points.emplace_back(x, y, (i % 7 == 0) ? !YinYangLabel(x, y) : YinYangLabel(x, y));
+  }
+  ConfusionMatrix expected;
+  for (const Point& p : points) {
+    const bool predicted = YinYangLabel(p.x, p.y);
+    ++(p.label ? (predicted ? expected.true_positive : expected.false_negative)
+               : (predicted ? expected.false_positive : expected.true_negative));
+  }
+  const ConfusionMatrix matrix = ScorePoints(points.begin(), points.end());
+  EXPECT_EQ(1003u, matrix.Total());
+  EXPECT_EQ(expected.true_positive, matrix.true_positive);
+  EXPECT_EQ(expected.false_positive, matrix.false_positive);
+  EXPECT_EQ(expected.true_negative, matrix.true_negative);
+  EXPECT_EQ(expected.false_negative, matrix.false_negative);
+  EXPECT_EQ(144u, matrix.false_positive + matrix.false_negative);
+
+  ClassifierEvaluator evaluator;
+  evaluator.Add(points.begin(), points.begin() + 500);
+  evaluator.Add(points.begin() + 500, points.end());
+  EXPECT_EQ(matrix.true_positive, evaluator.Matrix().true_positive);
+  EXPECT_DOUBLE_EQ(matrix.Accuracy(), evaluator.Matrix().Accuracy());
+}
+
+TEST(Classifier, EachKernelMatchesTheScalarOne) {
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<uint8_t> label;
+  // The points right on the boundaries, and off the plane.
+  const double edges[][2] = {{0, 0},
+                             {0, 1},
+                             {0, -1},
+                             {0.5, 0.5},
+                             {-0.5, -0.5},
+                             {0.5, -0.5},
+                             {-0.0, 0.25},
+                             {std::numeric_limits<double>::quiet_NaN(), 0.5},
+                             {0.1, std::numeric_limits<double>::quiet_NaN()},
+                             {std::numeric_limits<double>::infinity(), 0}};
+  for (int i = 0; i < 1000; ++i) {
+    const double* edge = edges[i % 10];
+    x.push_back(i % 3 ? std::sin(i * 0.37) : edge[0]);
+    y.push_back(i % 3 ? std::cos(i * 0.73) : edge[1]);
+    label.push_back(i % 5 < 2);
+  }
+  const auto check = [&x, &y, &label](
+      void (*kernel)(const double*, const double*, const uint8_t*, size_t, impl::ConfusionCounts&)) {
+    // All the offsets and lengths, to cover the unaligned loads and the scalar tails.
+    for (size_t begin = 0; begin < 4; ++begin) {
+      for (size_t n = 0; begin + n <= x.size(); n += (n < 16 ? 1 : 97)) {
+        impl::ConfusionCounts expected;
+        impl::ScoreScalar(&x[begin], &y[begin], &label[begin], n, expected);
+        impl::ConfusionCounts actual;
+        kernel(&x[begin], &y[begin], &label[begin], n, actual);
+        EXPECT_EQ(n, actual.total);
+        EXPECT_EQ(expected.labeled, actual.labeled);
+        EXPECT_EQ(expected.predicted, actual.predicted);
+        EXPECT_EQ(expected.both, actual.both);
+      }
+    }
+  };
+#ifdef DEMO_CLASSIFIER_X86_64
+  check(impl::ScoreSSE2);
+  // Only where the CPU can run it.
+  if (impl::HasAVX2()) {
+    check(impl::ScoreAVX2);
+  }
+#endif
+}
+
+TEST(PointStore, ColumnarBlocksAndLabelBitmap) {
+  PointStore store(2);
+  std::atomic_bool done(false);
+  std::thread reader([&store, &done]() {
+    // Concurrent readers only ever see the labels of the points they see, as they were written.
+    while (!done) {
+      store.GetSnapshot().ForEach([](const Point& p) { EXPECT_EQ(static_cast<int>(p.x) % 3 == 0, p.label); });
+    }
+  });
+  for (int i = 0; i < 5000; ++i) {
+    store.Add(Point(i, -i, i % 3 == 0));
+  }
+  done = true;
+  reader.join();
+  size_t count = 0;
+  size_t labeled = 0;
+  store.GetSnapshot().ForEachBlock([&count, &labeled](const PointStore::Snapshot::Block& block) {
+    for (size_t i = block.begin; i < block.end; ++i) {
+      EXPECT_EQ(-block.x[i], block.y[i]);
+      EXPECT_EQ(static_cast<int>(block.x[i]) % 3 == 0, block.Label(i));
+      labeled += block.Label(i);
+      ++count;
+    }
+  });
+  EXPECT_EQ(5000u, count);
+  EXPECT_EQ(1667u, labeled);
+  // 16 bytes and a bit per point, in the chunks of 1024 points, here one chunk per shard is not full.
+  // A single writer makes a single run, so each shard has just the one chunk of its runs.
+  EXPECT_EQ(0u, store.BytesAllocated() % 64);
+  EXPECT_LE(store.BytesAllocated(), 6u * (1024 * 16 + 1024 / 8 + 64) + 2u * (256 * 16 + 64));
+}
+
+// Counts the allocations of each thread, to test that the streaming code paths do not allocate.
+// Not inlined, so that the compiler does not see `free()` of what `operator new` returned and warn about it.
+static thread_local size_t allocations_by_this_thread = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  ++allocations_by_this_thread;
+  if (void* p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+
+struct CountingBroadcastSink : BroadcastSink {
+  std::atomic<uint64_t>& bytes;
+  std::atomic_size_t& sends;
+  std::atomic_size_t& writer_allocations;
+  CountingBroadcastSink(std::atomic<uint64_t>& bytes,
+                        std::atomic_size_t& sends,
+                        std::atomic_size_t& writer_allocations)
+      : bytes(bytes), sends(sends), writer_allocations(writer_allocations) {}
+  void Send(const ConstBuffer* buffers, size_t count) override {
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+      total += buffers[i].size;
+    }
+    writer_allocations = allocations_by_this_thread;
+    ++sends;
+    bytes += total;
+  }
+};
+
+// Holds up the writer thread sending to it for as long as `paused` is set.
+struct PausingBroadcastSink : BroadcastSink {
+  std::atomic_bool& paused;
+  explicit PausingBroadcastSink(std::atomic_bool& paused) : paused(paused) {}
+  void Send(const ConstBuffer*, size_t) override {
+    while (paused) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+};
+
+TEST(Broadcaster, StreamsPointsWithoutAllocatingAndCoalescesOnTheLatencyBudget) {
+  {
+    // Via the real-time data feed of the demo, with the subscribers of the raw points, of the completed
+    // buckets of the finest rollup resolution, and of the Gorilla-encoded stream.
+    std::atomic<uint64_t> received(0);
+    std::atomic<uint64_t> rollup_received(0);
+    std::atomic<uint64_t> gorilla_received(0);
+    std::atomic_size_t sends(0);
+    std::atomic_size_t rollup_sends(0);
+    std::atomic_size_t gorilla_sends(0);
+    std::atomic_size_t writer_allocations(0);
+    Broadcaster broadcaster(1);
+    RealtimeFeed feed(broadcaster);
+    broadcaster.Subscribe(
+        std::unique_ptr<BroadcastSink>(new CountingBroadcastSink(received, sends, writer_allocations)));
+    broadcaster.Subscribe(
+        std::unique_ptr<BroadcastSink>(
+            new CountingBroadcastSink(rollup_received, rollup_sends, writer_allocations)),
+        1e18,
+        1);
+    feed.SubscribeGorilla(
+        std::unique_ptr<BroadcastSink>(
+            new CountingBroadcastSink(gorilla_received, gorilla_sends, writer_allocations)),
+        1e18);
+    uint64_t published = 0;
+    const auto publish = [&](int begin, int end) {
+      char line[kMaxXYJSONLineLength];
+      for (int i = begin; i < end; ++i) {
+        // A bucket of the finest resolution, 100 ms, completes every second point.
+        const double x = 50.0 * i;
+        feed.Publish(x, sin(i));
+        published += FormatXYJSONLine(x, sin(i), line);
+        while (received < published) {
+          std::this_thread::yield();
+        }
+      }
+    };
+    publish(0, 1000);
+    const size_t publisher_allocations_before = allocations_by_this_thread;
+    const size_t writer_allocations_before = writer_allocations;
+    const size_t chunks_before = broadcaster.AllocatedChunks();
+    publish(1000, 11000);
+    EXPECT_EQ(publisher_allocations_before, allocations_by_this_thread);
+    EXPECT_EQ(writer_allocations_before, writer_allocations);
+    EXPECT_EQ(chunks_before, broadcaster.AllocatedChunks());
+    EXPECT_EQ(11000u, sends);
+    EXPECT_LT(0u, rollup_received);
+    EXPECT_LT(0u, gorilla_received);
+    EXPECT_EQ(0u, broadcaster.DroppedCount());
+  }
+  {
+    std::atomic<uint64_t> received(0);
+    std::atomic_size_t sends(0);
+    std::atomic_size_t writer_allocations(0);
+    std::atomic_bool paused(true);
+    Broadcaster broadcaster(1, 1 << 14, 100);
+    // The only writer is held up by the first subscriber until all the points are published, so that the test
+    // does not depend on publishing them within the budget.
+    broadcaster.Subscribe(std::unique_ptr<BroadcastSink>(new PausingBroadcastSink(paused)));
+    broadcaster.Subscribe(
+        std::unique_ptr<BroadcastSink>(new CountingBroadcastSink(received, sends, writer_allocations)));
+    char line[kMaxXYJSONLineLength];
+    uint64_t published = 0;
+    for (int i = 0; i < 100; ++i) {
+      const size_t length = FormatXYJSONLine(i, -i, line);
+      broadcaster.Publish(line, length, 0);
+      published += length;
+    }
+    paused = false;
+    while (received < published) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // All the points published while the data was waiting go out as one write, split into the pooled chunks.
+    EXPECT_EQ(1u, sends);
+  }
+  {
+    // The pending data waits for the budget to run out before it is sent.
+    std::atomic<uint64_t> received(0);
+    std::atomic_size_t sends(0);
+    std::atomic_size_t writer_allocations(0);
+    Broadcaster broadcaster(1, 1 << 14, 20);
+    broadcaster.Subscribe(
+        std::unique_ptr<BroadcastSink>(new CountingBroadcastSink(received, sends, writer_allocations)));
+    char line[kMaxXYJSONLineLength];
+    const size_t length = FormatXYJSONLine(0.5, -0.5, line);
+    EXPECT_EQ("{\"x\":0.5,\"y\":-0.5}\n", std::string(line, length));
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    broadcaster.Publish(line, length, 0);
+    while (received < length) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_GE(std::chrono::steady_clock::now() - begin, std::chrono::milliseconds(20));
+    EXPECT_EQ(1u, sends);
+  }
+}
+
+TEST(Demo, StreamsLivePoints) {
+  DemoServer server(2030, HashRing::FromList(""));
+  std::string body;
+  std::thread viewer([&body]() {
+    body = HTTP(GET("localhost:2030/layout/data?source=points&label=true&x0=0&t=1")).body;
+  });
+  while (HTTP(GET("localhost:2030/metrics")).body.find("\ndemo_active_streams 1\n") == std::string::npos) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ("ADDED\n", HTTP(POST("localhost:2030/demo_id?x=0.75&y=0.5&label=1")).body);
+  EXPECT_EQ("ADDED\n", HTTP(POST("localhost:2030/demo_id?x=0.75&y=-0.5&label=0")).body);
+  EXPECT_EQ("ADDED\n", HTTP(POST("localhost:2030/demo_id?x=-0.75&y=0.5&label=1")).body);
+  viewer.join();
+  EXPECT_EQ("{\"x\":0.75,\"y\":0.5,\"label\":true}\n", body);
+}
+
+struct BlockingBroadcastSink : BroadcastSink {
+  std::string& data;
+  std::atomic_bool& blocked;
+  std::atomic_bool& closed;
+  BlockingBroadcastSink(std::string& data, std::atomic_bool& blocked, std::atomic_bool& closed)
+      : data(data), blocked(blocked), closed(closed) {}
+  ~BlockingBroadcastSink() { closed = true; }
+  void Send(const ConstBuffer* buffers, size_t count) override {
+    while (blocked) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (size_t i = 0; i < count; ++i) {
+      data.append(buffers[i].data, buffers[i].size);
+    }
+  }
+};
+
+TEST(PointFeed, FiltersAndHandlesLaggingSubscribers) {
+  {
+    PointRing ring(3);
+    for (int i = 0; i < 20; ++i) {
+      ring.Push(Point(i, i, false));
+    }
+    Point point;
+    EXPECT_TRUE(PointRing::ReadResult::Overwritten == ring.Read(0, point));
+    EXPECT_TRUE(PointRing::ReadResult::Overwritten == ring.Read(11, point));
+    EXPECT_TRUE(PointRing::ReadResult::Ready == ring.Read(12, point));
+    EXPECT_EQ(12, point.x);
+    EXPECT_TRUE(PointRing::ReadResult::NotYet == ring.Read(20, point));
+  }
+  std::atomic<double> now(0);
+  const auto clock = [&now]() { return now.load(); };
+  {
+    PointRing ring;
+    Broadcaster broadcaster(2);
+    PointFeed feed(ring, broadcaster, clock);
+    std::string labeled, boxed;
+    std::atomic_size_t labeled_length(0), boxed_length(0);
+    std::atomic_bool labeled_closed(false), boxed_closed(false);
+    PointFilter label_filter;
+    label_filter.label = 1;
+    PointFilter box_filter;
+    box_filter.x0 = 0;
+    box_filter.y1 = 0;
+    feed.Subscribe(
+        std::unique_ptr<BroadcastSink>(new MockBroadcastSink(labeled, labeled_length, labeled_closed)),
+        100,
+        label_filter);
+    feed.Subscribe(
+        std::unique_ptr<BroadcastSink>(new MockBroadcastSink(boxed, boxed_length, boxed_closed)),
+        100,
+        box_filter);
+    const std::vector<Point> points{Point(0.5, -0.5, true), Point(-0.5, -0.5, true), Point(0.5, 0.5, false)};
+    ring.Push(points.begin(), points.end());
+    const std::string a = "{\"x\":0.5,\"y\":-0.5,\"label\":true}\n";
+    const std::string b = "{\"x\":-0.5,\"y\":-0.5,\"label\":true}\n";
+    while (broadcaster.SentBytes() < 2 * a.length() + b.length()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    now = 100;
+    while (!labeled_closed || !boxed_closed) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(a + b, labeled);
+    EXPECT_EQ(a, boxed);
+    EXPECT_EQ(0u, feed.LagCount());
+  }
+  now = 0;
+  // A client that does not read anything for a while gets either disconnected, or every second point and so on.
+  for (LagPolicy policy : {LagPolicy::Drop, LagPolicy::Downsample}) {
+    std::string data;
+    std::atomic_bool blocked(true), closed(false);
+    {
+      PointRing ring;
+      Broadcaster broadcaster(1, 1 << 10);
+      PointFeed feed(ring, broadcaster, clock);
+      feed.Subscribe(std::unique_ptr<BroadcastSink>(new BlockingBroadcastSink(data, blocked, closed)),
+                     1e18,
+                     PointFilter(),
+                     policy);
+      for (int i = 0; i < 1000; ++i) {
+        ring.Push(Point(i, 0, false));
+        if (i % 10 == 0) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+      while (!feed.LagCount()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      blocked = false;
+      if (policy == LagPolicy::Drop) {
+        while (!closed) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(0u, feed.SubscribersCount());
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_EQ(1u, feed.SubscribersCount());
+        EXPECT_FALSE(closed);
+      }
+    }
+    EXPECT_LT(std::count(data.begin(), data.end(), '\n'), 1000);
+  }
+}
+
+TEST(Demo, KeepsNamedDatasetsApart) {
+  DemoServer server(2031, HashRing::FromList(""));
+  EXPECT_EQ(404, static_cast<int>(HTTP(GET("localhost:2031/data?name=sheet")).code));
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2031/data?name=../sheet")).code));
+  EXPECT_EQ("ADDED\n", HTTP(POST("localhost:2031/data?name=sheet&x=0.5&y=0.25&label=1")).body);
+  EXPECT_EQ("ADDED\n", HTTP(POST("localhost:2031/data?name=other&x=-0.5&y=0.25&label=0")).body);
+  EXPECT_EQ("{\"state\":{\"points\":[{\"x\":0.5,\"y\":0.25,\"label\":true}]}}\n",
+            HTTP(GET("localhost:2031/data?name=sheet")).body);
+  EXPECT_EQ("{\"points\":[{\"x\":-0.5,\"y\":0.25,\"label\":false}]}\n",
+            HTTP(GET("localhost:2031/data?name=other&query=knn&x=0&y=0&k=5")).body);
+}
+
+TEST(DatasetRegistry, QuotasAndEvictionOfIdleDatasets) {
+  EXPECT_TRUE(DatasetRegistry::IsValidName("sheet-1_A"));
+  EXPECT_FALSE(DatasetRegistry::IsValidName(""));
+  EXPECT_FALSE(DatasetRegistry::IsValidName("../sheet"));
+  EXPECT_FALSE(DatasetRegistry::IsValidName(std::string(65, 'a')));
+
+  StateOptions options;
+  options.index_cells_per_side = 16;
+  options.live_capacity_log2 = 8;
+  options.max_points = 3;
+  DatasetRegistry registry(Printf(".noshit/datasets_%llu", static_cast<unsigned long long>(Now())), options, 2);
+  const auto touch = [&registry](const std::string& name) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    return registry.Acquire(name, true);
+  };
+  EXPECT_FALSE(registry.Acquire("a", false));
+  {
+    const DatasetRegistry::Pin a = touch("a");
+    ASSERT_TRUE(a);
+    const std::vector<Point> points{Point(0, 0, true), Point(1, 1, false)};
+    EXPECT_EQ(2u, a->Add(points.begin(), points.end()));
+    EXPECT_EQ(1u, a->Add(points.begin(), points.end()));
+    EXPECT_FALSE(a->Add(Point(2, 2, true)));
+    EXPECT_EQ(3u, a->points.Size());
+  }
+  touch("b")->Add(Point(3, 3, true));
+  EXPECT_EQ(0u, registry.EvictionCount());
+  touch("c");
+  // The least recently used "a" is evicted, and is loaded back from the disk, evicting "b".
+  EXPECT_EQ(1u, registry.EvictionCount());
+  EXPECT_EQ(2u, registry.ResidentCount());
+  {
+    const DatasetRegistry::Pin a = registry.Acquire("a", false);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(3u, a->points.Size());
+    EXPECT_FALSE(a->Add(Point(4, 4, true)));
+    EXPECT_EQ(2u, registry.EvictionCount());
+    // A pinned dataset is not evicted, even if it is the least recently used one.
+    touch("d");
+    touch("e");
+    EXPECT_EQ(3u, a->points.Size());
+    EXPECT_EQ(4u, registry.EvictionCount());
+  }
+  EXPECT_EQ(5u, registry.Size());
+  EXPECT_EQ(1u, registry.Acquire("b", false)->points.Size());
+
+  // Concurrent lookups, loads and evictions of the same datasets agree on what is in them.
+  std::vector<std::thread> threads;
+  std::atomic_size_t mismatches(0);
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&registry, &mismatches, t]() {
+      for (int i = 0; i < 100; ++i) {
+        const char* names[] = {"a", "b", "e"};
+        const size_t sizes[] = {3, 1, 0};
+        const DatasetRegistry::Pin dataset = registry.Acquire(names[(i + t) % 3], false);
+        if (!dataset || dataset->points.Size() != sizes[(i + t) % 3]) {
+          ++mismatches;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(0u, mismatches);
+}
+
+TEST(DatasetRegistry, DetachesDatasetsOnceNotInUse) {
+  StateOptions options;
+  options.index_cells_per_side = 16;
+  options.live_capacity_log2 = 8;
+  DatasetRegistry registry(Printf(".noshit/detached_%llu", static_cast<unsigned long long>(Now())), options, 2);
+  registry.Acquire("a", true)->Add(Point(1, 1, true));
+  {
+    // A dataset in use is not detached.
+    const DatasetRegistry::Pin a = registry.Acquire("a", false);
+    EXPECT_FALSE(registry.Detach("a", std::chrono::milliseconds(10)));
+  }
+  EXPECT_FALSE(registry.Detach("b", std::chrono::milliseconds(10)));
+  std::unique_ptr<State> a = registry.Detach("a", std::chrono::milliseconds(10));
+  ASSERT_TRUE(a != nullptr);
+  EXPECT_EQ(1u, a->points.Size());
+  // While detached, the dataset is neither acquired nor created anew.
+  EXPECT_FALSE(registry.Acquire("a", false));
+  EXPECT_FALSE(registry.Acquire("a", true));
+  registry.Restore("a", std::move(a));
+  EXPECT_EQ(1u, registry.Acquire("a", false)->points.Size());
+  // An evicted dataset is loaded to be detached.
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  registry.Acquire("b", true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  registry.Acquire("c", true);
+  EXPECT_EQ(1u, registry.EvictionCount());
+  a = registry.Detach("a", std::chrono::milliseconds(10));
+  ASSERT_TRUE(a != nullptr);
+  EXPECT_EQ(1u, a->points.Size());
+  EXPECT_EQ(3u, registry.Size());
+  registry.Drop("a", std::move(a));
+  EXPECT_EQ(2u, registry.Size());
+  EXPECT_FALSE(registry.Acquire("a", false));
+  std::vector<std::string> names = registry.Names();
+  std::sort(names.begin(), names.end());
+  EXPECT_EQ((std::vector<std::string>{"b", "c"}), names);
+  registry.Acquire("a", true);
+  EXPECT_EQ(3u, registry.Size());
+}
+
+TEST(HashRing, BalancesAndMovesFewKeysWhenANodeIsAdded) {
+  const HashRing three = HashRing::FromList("b:1,a:1,,c:1");
+  EXPECT_EQ(std::vector<std::string>({"a:1", "b:1", "c:1"}), three.Nodes());
+  const HashRing four({"c:1", "d:1", "a:1", "b:1"});
+  std::map<std::string, size_t> counts;
+  size_t moved = 0;
+  for (int i = 0; i < 10000; ++i) {
+    const std::string key = Printf("sheet%d", i);
+    const std::string& before = three.Owner(key);
+    const std::string& after = four.Owner(key);
+    ++counts[before];
+    if (before != after) {
+      ++moved;
+      // Keys only ever move to the new node.
+      EXPECT_EQ("d:1", after);
+    }
+  }
+  for (const auto& count : counts) {
+    EXPECT_NEAR(10000 / 3, count.second, 500);
+  }
+  EXPECT_NEAR(10000 / 4, moved, 500);
+}
+
+TEST(Demo, ShardsDatasetsAcrossNodes) {
+  const std::string nodes = "localhost:2018,localhost:2019";
+  DemoServer a(2018, HashRing::FromList(nodes));
+  DemoServer b(2019, HashRing::FromList(nodes));
+  ExampleConfig config;
+  config.data_hostnames = {"localhost:2018", "localhost:2019"};
+  EXPECT_EQ(JSON(config, "config") + '\n', HTTP(GET("localhost:2019/config.json")).body);
+  const size_t kDatasets = 20;
+  for (size_t i = 0; i < kDatasets; ++i) {
+    const int port = (i % 2) ? 2018 : 2019;
+    EXPECT_EQ("ADDED\n",
+              HTTP(POST(Printf("localhost:%d/data?name=sheet%zu&x=%zu&y=0&label=1", port, i, i))).body);
+  }
+  const auto datasets = [](int port) {
+    const std::string metrics = HTTP(GET(Printf("localhost:%d/metrics", port))).body;
+    const size_t offset = metrics.find("\ndemo_datasets ");
+    return (offset == std::string::npos) ? 0u : static_cast<size_t>(atoi(metrics.c_str() + offset + 15));
+  };
+  const auto expect_all_datasets = [kDatasets](int port) {
+    for (size_t i = 0; i < kDatasets; ++i) {
+      EXPECT_EQ(Printf("{\"state\":{\"points\":[{\"x\":%zu,\"y\":0,\"label\":true}]}}\n", i),
+                HTTP(GET(Printf("localhost:%d/data?name=sheet%zu", port, i))).body);
+    }
+  };
+  // Any node serves any dataset, which lives on one node only.
+  expect_all_datasets(2018);
+  expect_all_datasets(2019);
+  EXPECT_EQ(kDatasets, datasets(2018) + datasets(2019));
+  EXPECT_LT(0u, datasets(2018));
+  EXPECT_LT(0u, datasets(2019));
+
+  // Adding a node only moves the datasets it now owns.
+  const std::string three_nodes = nodes + ",localhost:2020";
+  DemoServer c(2020, HashRing::FromList(three_nodes));
+  size_t should_move = 0;
+  for (size_t i = 0; i < kDatasets; ++i) {
+    should_move += (HashRing::FromList(three_nodes).Owner(Printf("sheet%zu", i)) == "localhost:2020");
+  }
+  EXPECT_LT(0u, should_move);
+  EXPECT_GT(kDatasets / 2, should_move);
+  size_t moved = 0;
+  for (int port : {2018, 2019}) {
+    const std::string response =
+        HTTP(POST(Printf("localhost:%d/ring?nodes=%s", port, three_nodes.c_str()))).body;
+    const size_t offset = response.find("\"moved\":");
+    ASSERT_NE(std::string::npos, offset);
+    moved += atoi(response.c_str() + offset + 8);
+  }
+  EXPECT_EQ(should_move, moved);
+  EXPECT_EQ(should_move, datasets(2020));
+  EXPECT_EQ(kDatasets, datasets(2018) + datasets(2019) + datasets(2020));
+  expect_all_datasets(2018);
+  expect_all_datasets(2020);
+}
+
+TEST(Gorilla, RoundTripsBitExactInAnyChunks) {
+  std::vector<std::pair<int64_t, double>> points;
+  int64_t timestamp = 1444000000000ll;
+  for (int i = 0; i < 1000; ++i) {
+    // Mostly a steady pace, with a few jumps too far for a delta of delta.
+    timestamp += (i % 300 == 299) ? 1ll << 40 : 100 + (i * 37) % 100;
+    points.emplace_back(timestamp, sin(i * 0.05));
+  }
+  points[10].second = points[9].second;
+  points[20].second = -0.0;
+  points[30].second = std::numeric_limits<double>::quiet_NaN();
+  points[40].second = std::numeric_limits<double>::infinity();
+  points[50].first = std::numeric_limits<int64_t>::min();
+  points[51].first = std::numeric_limits<int64_t>::max();
+
+  GorillaEncoder encoder;
+  std::string stream;
+  for (const auto& point : points) {
+    EXPECT_EQ((&point - &points.front()) % GorillaEncoder::kBlockSize == 0, encoder.AtBlockStart());
+    char record[GorillaEncoder::kMaxRecordLength];
+    stream.append(record, encoder.Add(point.first, point.second, record));
+  }
+  EXPECT_GT(12u * points.size(), stream.length());
+
+  const auto bits = [](double value) {
+    uint64_t result;
+    memcpy(&result, &value, sizeof(result));
+    return result;
+  };
+  for (size_t step : {1u, 7u, 1000000u}) {
+    GorillaDecoder decoder;
+    size_t i = 0;
+    for (size_t offset = 0; offset < stream.length(); offset += step) {
+      ASSERT_TRUE(decoder.Feed(stream.data() + offset,
+                               std::min(step, stream.length() - offset),
+                               [&](int64_t timestamp, double value) {
+                                 ASSERT_LT(i, points.size());
+                                 EXPECT_EQ(points[i].first, timestamp);
+                                 EXPECT_EQ(bits(points[i].second), bits(value));
+                                 ++i;
+                               }));
+    }
+    EXPECT_EQ(points.size(), i);
+  }
+
+  // A stream can only be joined at a key record.
+  GorillaDecoder decoder;
+  EXPECT_FALSE(decoder.Feed(stream.data() + 17, stream.length() - 17, [](int64_t, double) {}));
+}
+
+TEST(Demo, StreamsGorillaEncodedData) {
+  Singleton<DemoServer>();
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2015/layout/data?encoding=gorilla&window=1000")).code));
+  EXPECT_EQ(400, static_cast<int>(HTTP(GET("localhost:2015/layout/data?encoding=xml")).code));
+  std::string json;
+  std::thread viewer([&json]() { json = HTTP(GET("localhost:2015/layout/data?t=2")).body; });
+  const std::string gorilla = HTTP(GET("localhost:2015/layout/data?encoding=gorilla&t=2")).body;
+  viewer.join();
+  GorillaDecoder decoder;
+  std::vector<std::string> lines;
+  EXPECT_TRUE(decoder.Feed(gorilla.data(), gorilla.length(), [&lines](int64_t timestamp, double value) {
+    char x[kMaxFormattedNumberLength];
+    char y[kMaxFormattedNumberLength];
+    lines.push_back("{\"x\":" + std::string(x, FormatDouble(static_cast<double>(timestamp), x)) + ",\"y\":" +
+                    std::string(y, FormatDouble(value, y)) + "}\n");
+  }));
+  // The stream starts with the block in progress, so the points streamed as JSON too are the last ones,
+  // all in a row, give or take those around the ends of the streams.
+  size_t first = lines.size();
+  size_t last = 0;
+  size_t found = 0;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    if (json.find(lines[i]) != std::string::npos) {
+      first = std::min(first, i);
+      last = i;
+      ++found;
+    }
+  }
+  EXPECT_LE(5u, found);
+  EXPECT_EQ(last - first + 1, found);
+  EXPECT_LE(lines.size(), last + 3);
+  // Way fewer bytes per point than JSON, even with the key record of the block.
+  const size_t json_lines = std::count(json.begin(), json.end(), '\n');
+  EXPECT_GT(json.length() / json_lines / 2, gorilla.length() / lines.size());
+}
+
+TEST(Executor, LimitsRoutesShedsAndRunsTasksInSteps) {
+  {
+    std::atomic_int running(0);
+    std::atomic_int max_running(0);
+    std::atomic_int steps(0);
+    std::atomic_int done(0);
+    const auto enter = [&running, &max_running]() {
+      const int now = ++running;
+      int max = max_running;
+      while (now > max && !max_running.compare_exchange_weak(max, now)) {
+      }
+    };
+    {
+      Executor executor(4, 1000);
+      Executor::Route& route = executor.AddRoute(2, 1000);
+      for (int i = 0; i < 200; ++i) {
+        ASSERT_TRUE(executor.Submit([&]() {
+          enter();
+          --running;
+          // The steps of a task hold on to its place within the route.
+          const auto step = std::make_shared<int>(0);
+          Executor::Continue([&, step]() {
+            enter();
+            ++steps;
+            --running;
+            if (++*step == 5) {
+              ++done;
+              return false;
+            }
+            return true;
+          });
+        }, &route));
+      }
+    }
+    EXPECT_EQ(200, done);
+    EXPECT_EQ(1000, steps);
+    EXPECT_GE(2, max_running);
+  }
+  {
+    std::atomic_bool blocked(true);
+    std::atomic_bool started(false);
+    Executor executor(1, 3);
+    Executor::Route& route = executor.AddRoute(1, 1);
+    EXPECT_TRUE(executor.Submit([&blocked, &started]() {
+      started = true;
+      while (blocked) {
+        std::this_thread::yield();
+      }
+    }, &route));
+    while (!started) {
+      std::this_thread::yield();
+    }
+    // One more task of the route may wait for its turn, and three tasks may wait for the thread.
+    EXPECT_TRUE(executor.Submit([]() {}, &route));
+    EXPECT_FALSE(executor.Submit([]() {}, &route));
+    EXPECT_EQ(1u, route.WaitingCount());
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_TRUE(executor.Submit([]() {}));
+    }
+    EXPECT_FALSE(executor.Submit([]() {}));
+    EXPECT_EQ(3u, executor.QueuedCount());
+    EXPECT_EQ(2u, executor.ShedCount());
+    blocked = false;
+  }
+  // Outside the executor, the steps run right away.
+  int steps = 0;
+  Executor::Continue([&steps]() { return ++steps < 3; });
+  EXPECT_EQ(3, steps);
+}
+
+TEST(KeepAliveServer, PipelinesRequestsAndCoalescesTheirResponses) {
+  std::atomic<int> handled(0);
+  KeepAliveServer server(0, {{"/echo", [&handled](const KeepAliveRequest& request,
+                                                          KeepAliveResponse& response) {
+                                      ++handled;
+                                      response.body = request.method + ' ' + request.query.at("q") + ' ' +
+                                                      request.body + '\n';
+                                    }}});
+  ASSERT_NE(0, server.Port());
+
+  // Three requests in one write, the responses to which come back in order, in one write too.
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = sockaddr_in();
+  address.sin_family = AF_INET;
+  address.sin_port = htons(server.Port());
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(0, connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)));
+  const std::string requests =
+      "GET /echo?q=a%20b HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "POST /echo?q=2 HTTP/1.1\r\nHost: localhost\r\nContent-Length: 4\r\n\r\nbody"
+      "GET /nope HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+  ASSERT_EQ(static_cast<ssize_t>(requests.length()), write(fd, requests.data(), requests.length()));
+  std::string responses;
+  char buffer[1024];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    responses.append(buffer, n);
+  }
+  close(fd);
+  EXPECT_EQ(
+      "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 9\r\n\r\nGET a b \n"
+      "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n\r\nPOST 2 body\n"
+      "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 19\r\nConnection: close\r\n\r\n"
+      "<h1>NOT FOUND</h1>\n",
+      responses);
+  EXPECT_EQ(2, handled);
+  EXPECT_EQ(3u, server.RequestsCount());
+  EXPECT_EQ(1u, server.WritesCount());
+
+  // The pooled client sends all its requests over one connection.
+  HTTPClientPool pool;
+  const std::string url = "localhost:" + std::to_string(server.Port());
+  for (int i = 0; i < 100; ++i) {
+    const PooledHTTPResponse response = pool.POST(url + "/echo?q=" + std::to_string(i), "x");
+    EXPECT_EQ(200, response.code);
+    EXPECT_EQ("POST " + std::to_string(i) + " x\n", response.body);
+    EXPECT_EQ("text/plain", response.content_type);
+  }
+  const std::vector<PooledHTTPResponse> pipelined = pool.Pipeline(
+      url, MakeHTTPRequest("GET", "/echo?q=p", url) + MakeHTTPRequest("POST", "/echo?q=q", url, "", "y"), 2);
+  ASSERT_EQ(2u, pipelined.size());
+  EXPECT_EQ("GET p \n", pipelined[0].body);
+  EXPECT_EQ("POST q y\n", pipelined[1].body);
+  EXPECT_EQ(404, pool.GET(url + "/nope").code);
+  EXPECT_EQ(1u, pool.ConnectionsOpened());
+  EXPECT_EQ(2u, server.AcceptedCount());
+}
+
+TEST(HTTPClientPool, RetriesOnceWhenThePooledConnectionIsClosed) {
+  const auto ok = [](const KeepAliveRequest&, KeepAliveResponse& response) { response.body = "OK\n"; };
+  HTTPClientPool pool;
+  int port;
+  {
+    KeepAliveServer server(0, {{"/ok", ok}});
+    port = server.Port();
+    EXPECT_EQ("OK\n", pool.GET("localhost:" + std::to_string(port) + "/ok").body);
+  }
+  const std::string url = "localhost:" + std::to_string(port) + "/ok";
+  {
+    // The pooled connection was closed along with the server, so the request goes over a new one.
+    KeepAliveServer server(port, {{"/ok", ok}});
+    EXPECT_EQ("OK\n", pool.GET(url).body);
+    EXPECT_EQ(2u, pool.ConnectionsOpened());
+  }
+  EXPECT_THROW(pool.GET(url), std::runtime_error);
+}
+
+TEST(Demo, ServesSmallRequestsOverKeepAlive) {
+  DemoServer server(2022, HashRing::FromList(""), 2023);
+  HTTPClientPool pool;
+  EXPECT_EQ("OK\n", pool.GET("localhost:2023/ok").body);
+  EXPECT_EQ(0u, pool.GET("localhost:2023/uptime").body.find("{\"uptime\":{\"uptime_total_s\":"));
+  EXPECT_EQ("ADDED\n", pool.POST("localhost:2023/demo_id?x=%2B0.5&y=-0.5&label=1").body);
+  EXPECT_EQ(400, pool.GET("localhost:2023/demo_id").code);
+  EXPECT_EQ(1u, pool.ConnectionsOpened());
+  // The point is there for the other endpoints, and the requests are in `/metrics`.
+  EXPECT_EQ("{\"state\":{\"points\":[{\"x\":0.5,\"y\":-0.5,\"label\":true}]}}\n",
+            HTTP(GET("localhost:2022/demo_id")).body);
+  const std::string metrics = HTTP(GET("localhost:2022/metrics")).body;
+  EXPECT_NE(std::string::npos, metrics.find("demo_http_requests_total{route=\"/ok\"} 1\n"));
+  EXPECT_NE(std::string::npos, metrics.find("demo_keep_alive_connections 1\n"));
+}
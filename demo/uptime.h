@@ -31,6 +31,8 @@ SOFTWARE.
 #include "../Bricks/cerealize/cerealize.h"
 #include "../Bricks/net/api/api.h"
 
+#include "metrics.h"
+
 struct UptimeTracker {
   bricks::time::EPOCH_MILLISECONDS start_ms_;
   UptimeTracker() : start_ms_(bricks::time::Now()) {}
@@ -54,7 +56,7 @@ struct UptimeTracker {
 
   // A functor to be able to use the `UptimeTracker` object directly as a handler.
   void operator()(bricks::net::api::Request r) {
-    r.connection.SendHTTPResponse(ResponseJSON(bricks::time::Now() - start_ms_), "uptime");
+    demo::Respond(r, ResponseJSON(bricks::time::Now() - start_ms_), "uptime");
   };
 };
 